@@ -38,6 +38,8 @@ macro(global_set_flags)
         add_definitions(-DTRACE_API)
     endif()
 
+    add_definitions(-DRU_LOG_MIN_SEVERITY=RU_SEVERITY_${LOG_MIN_SEVERITY})
+
     if(HWM_OVER_XU)
         add_definitions(-DHWM_OVER_XU)
     endif()
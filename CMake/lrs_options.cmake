@@ -9,6 +9,7 @@ option(BUILD_WITH_STATIC_CRT "Build with static link CRT" ON)
 option(FORCE_LIBUVC "Explicitly turn-on libuvc backend" OFF)
 option(FORCE_WINUSB_UVC "Explicitly turn-on winusb_uvc (for win7) backend" OFF)
 option(TRACE_API "Log all C API calls" OFF)
+set(LOG_MIN_SEVERITY "DEBUG" CACHE STRING "Lowest log severity compiled in: DEBUG, INFO, WARNING, ERROR, FATAL or NONE")
 option(HWM_OVER_XU "Send HWM commands over UVC XU control" ON)
 option(BUILD_SHARED_LIBS "Build shared library" OFF)
 option(BUILD_UNIT_TESTS "Build realsense unit tests. Note that when enabled, additional tests data set will be downloaded from a web server and stored in a temp directory" OFF)
@@ -4,11 +4,18 @@
 #ifndef LIBREALUVC_REALUVC_H
 #define LIBREALUVC_REALUVC_H 1
 
+#include "ru_blobs.h"
 #include "ru_common.h"
+#include "ru_control.h"
+#include "ru_convert.h"
 #include "ru_exception.h"
+#include "ru_exposure.h"
 #include "ru_hid.h"
+#include "ru_imu.h"
+#include "ru_rectify.h"
 #include "ru_usb.h"
 #include "ru_uvc.h"
+#include "ru_trace.h"
 #include "ru_videocapture.h"
 
 // These macro definitions are parsed by config_version.cmake
@@ -41,6 +41,30 @@ class DevFrame : public cv::UMatData {
   ~DevFrame();
 };
 
+// Mean brightness of the lit and dark frames of a strobed stereo IR
+// stream, for telling them apart.  A strobe mode never has two dark
+// frames in a row, so a longer run of them means the lit frames got
+// darker (less exposure or gain, LEDs off) and the levels follow.
+
+class StrobeLevels {
+ private:
+  double lit_;
+  double dark_;
+  int dark_run_;
+ 
+ public:
+  StrobeLevels();
+  
+  // Forget both levels: the next frame is taken as lit
+  void reset();
+  
+  // Classify a frame by its mean level, updating the levels
+  bool is_dark(double level);
+  
+  double get_lit_level() const { return lit_; }
+  double get_dark_level() const { return dark_; }
+};
+
 class DevFrameQueue {
  private:
   std::mutex mutex_;
@@ -51,6 +75,21 @@ class DevFrameQueue {
   size_t size_;
   size_t front_;
   vector<DevFrame*> queue_;
+  cv::Rect roi_;
+  bool convert_rgb_;
+  bool ambient_subtract_;
+  // Latest dark frame, in the device's row layout, with the rows
+  // [dark_begin_, dark_end_) filled in.  Used by pop_front() only.
+  std::mutex ambient_mutex_;
+  vector<uint8_t> dark_;
+  size_t dark_step_;
+  int dark_rows_;
+  int dark_begin_;
+  int dark_end_;
+  StrobeLevels levels_;
+  
+  bool take_dark_frame(const DevFrame* f, int row_begin, int row_end);
+  const uint8_t* dark_row(int row, size_t step, int rows) const;
  
  public:
   DevFrameQueue(DevFrameFixup fixup, size_t max_size = 1);
@@ -65,7 +104,41 @@ class DevFrameQueue {
     const std::function<void()>& release_func
   );
   
-  void pop_front(ru_time_t& ts, cv::Mat& mat);  
+  // Frames without a fixup come out by format: RU_FOURCC_Y10/Y12/Y16
+  // as CV_16UC1 views of the device buffer, RU_FOURCC_Y10P unpacked to
+  // a new CV_16UC1, RU_FOURCC_YUY2/UYVY as CV_8UC2 views (or BGR with
+  // convert_rgb), anything else 8-bit.
+  //
+  // With raw set the fixup, ROI and color conversion are skipped: mat
+  // holds the frame bytes as the device sent them, 8-bit, with stereo
+  // frames as height rows of both eyes.
+  //
+  // With hist set it gets the brightness histogram of the rows handed
+  // out, taken as the fixup goes over them (see ru_exposure.h).  With
+  // blobs set, stereo frames are scanned for blobs the same way (not
+  // raw ones; see ru_blobs.h).
+  void pop_front(
+    ru_nsec_t& ts, cv::Mat& mat, bool raw = false,
+    FrameHistogram* hist = nullptr, StereoBlobs* blobs = nullptr
+  );
+  
+  // Frames from pop_front() become zero-copy views of this region, and
+  // the fixup skips rows outside it.  An empty rect gives full frames.
+  void set_roi(const cv::Rect& roi);
+  
+  // With FIXUP_NORMAL, YUY2/UYVY frames are converted to a new BGR Mat
+  // and the device buffer is handed back straight away.
+  void set_convert_rgb(bool on);
+  
+  // For stereo IR frames in a strobe mode (LEAP_XU_STROBE_INTERVAL):
+  // frames far darker than the recent lit ones are taken as dark frames
+  // and kept instead of being returned, and pop_front() subtracts the
+  // latest one from each lit frame, with saturation, as it does the fixup.
+  void set_ambient_subtract(bool on);
+  
+  // Relearn the lit and dark levels after a change of exposure, gain or
+  // LEDs.  The first frame after this is handed out as lit.
+  void reset_ambient_levels();
 };
 
 } // end librealuvc
@@ -0,0 +1,49 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+#ifndef LIBREALUVC_RU_BLOBS_H
+#define LIBREALUVC_RU_BLOBS_H 1
+
+#include "ru_common.h"
+#include <opencv2/core.hpp>
+#include <vector>
+
+namespace librealuvc {
+
+// Bright blobs (IR markers, fingertips under the LEDs) found in a stereo
+// IR frame.  The threshold scan skips dark pixels 16 at a time, runs
+// above the threshold are joined into 8-connected blobs, and each blob
+// gets an intensity-weighted centroid.
+
+struct LIBREALUVC_EXPORT Blob {
+  float x, y;        // centroid in eye pixels, 0.0 the center of pixel 0
+  uint32_t area;     // pixels at or above the threshold
+  uint32_t mass;     // sum of (pixel - threshold + 1), the centroid weight
+  uint8_t peak;      // brightest pixel
+};
+
+struct LIBREALUVC_EXPORT BlobSettings {
+  int threshold;     // 1..255
+  int min_area;      // smaller blobs are noise
+  int max_blobs;     // per eye, heaviest first
+
+  BlobSettings();
+};
+
+struct LIBREALUVC_EXPORT StereoBlobs {
+  BlobSettings settings;        // input
+  std::vector<Blob> eye[2];     // left, right; sorted by mass
+  uint8_t peak[2];              // brightest pixel of each eye
+  cv::Point peak_at[2];         // its first position, in eye pixels
+
+  void clear();
+};
+
+// Scan a side-by-side stereo frame (CV_8UC1, left eye then right eye in
+// each row, as read() returns for Leap devices).  VideoCapture::read_blobs()
+// gets the same result from inside the frame fixup without a second pass.
+LIBREALUVC_EXPORT void find_stereo_blobs(const cv::Mat& mat, StereoBlobs& blobs);
+
+} // end librealuvc
+
+#endif
@@ -36,6 +36,8 @@ typedef double ru_time_t; // Timestamp in milliseconds
 
 typedef ru_time_t rs2_time_t;
 
+typedef int64_t ru_nsec_t; // Monotonic timestamp in nanoseconds
+
 #ifdef linux 
 typedef uint8_t byte;
 #endif
@@ -45,9 +47,19 @@ struct frame_object {
   uint8_t     metadata_size;
   const void* pixels;
   const void* metadata;
-  ru_time_t   backend_time;
+  // Capture time on the monotonic clock (CLOCK_MONOTONIC on Linux,
+  // QueryPerformanceCounter on Windows), exactly as the driver reported
+  // it.  Use monotonic_to_realtime_ns() if wall-clock time is needed.
+  ru_nsec_t   monotonic_ns;
 };
 
+// Convert a monotonic timestamp to nanoseconds since the Unix epoch.
+// This samples both clocks, so it is kept off the per-frame path.
+ru_nsec_t monotonic_to_realtime_ns(ru_nsec_t monotonic_ns);
+
+// Current time on the same monotonic clock used for frame timestamps.
+ru_nsec_t monotonic_now_ns();
+
 #define RU_FOURCC(c3, c2, c1, c0) ( \
   (((int32_t)(c3)) << 24) | \
   (((int32_t)(c2)) << 16) | \
@@ -57,6 +69,14 @@ struct frame_object {
 
 #define RU_FOURCC_YUY2 RU_FOURCC('Y', 'U', 'Y', '2')
 #define RU_FOURCC_NV12 RU_FOURCC('N', 'V', '1', '2')
+#define RU_FOURCC_UYVY RU_FOURCC('U', 'Y', 'V', 'Y')
+// Grayscale: 8 bits; 10, 12 or 16 bits in little-endian 16-bit words;
+// or 10 bits packed 4 pixels to 5 bytes (high bytes, then the low bits)
+#define RU_FOURCC_GREY RU_FOURCC('G', 'R', 'E', 'Y')
+#define RU_FOURCC_Y10  RU_FOURCC('Y', '1', '0', ' ')
+#define RU_FOURCC_Y12  RU_FOURCC('Y', '1', '2', ' ')
+#define RU_FOURCC_Y16  RU_FOURCC('Y', '1', '6', ' ')
+#define RU_FOURCC_Y10P RU_FOURCC('Y', '1', '0', 'P')
 
 typedef std::tuple<uint32_t, uint32_t, uint32_t, uint32_t> stream_profile_tuple;
 
@@ -0,0 +1,87 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+#ifndef LIBREALUVC_RU_CONTROL_H
+#define LIBREALUVC_RU_CONTROL_H 1
+
+#include "ru_common.h"
+#include "ru_uvc.h"
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+
+namespace librealuvc {
+
+// uvc_control_worker runs the control transfers of one device on its own
+// thread, in the order they were asked for.  A control the device keeps
+// busy (uvc_device_with_retry retries for up to 4 seconds) then holds up
+// only later control requests, never the caller or its frame loop.
+//
+// A set of a control which is still waiting in the queue replaces the
+// queued value instead of adding a transfer, and everyone who asked
+// gets the result of the one transfer.  Gets are never merged.  Don't
+// queue sets to controls the firmware treats as a command sequence
+// (e.g. the Peripheral's CONTRAST register); use the blocking calls.
+
+class LIBREALUVC_EXPORT uvc_control_worker {
+ public:
+  typedef std::function<bool()> operation;
+  typedef std::function<void(bool ok)> completion;
+
+ private:
+  struct request {
+    uint64_t key;
+    operation op;
+    vector<completion> done;
+  };
+
+  shared_ptr<uvc_device> dev_;
+  mutable std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable idle_cv_;
+  std::deque<request> queue_;
+  bool busy_;
+  bool stop_;
+  uint64_t coalesced_;
+  std::thread thread_;
+
+  void run();
+  static void complete(request& req, bool ok);
+
+ public:
+  explicit uvc_control_worker(shared_ptr<uvc_device> dev);
+  // Waits for the transfer in progress; anything still queued completes
+  // with false.
+  ~uvc_control_worker();
+
+  uvc_control_worker(const uvc_control_worker&) = delete;
+  uvc_control_worker& operator=(const uvc_control_worker&) = delete;
+
+  // Run op on the worker.  Requests with the same non-zero key coalesce
+  // while queued, the newer op replacing the older.  Keys below 2^56 are
+  // free for callers; the PU/XU calls below use the ones above.
+  void submit(uint64_t key, operation op, completion done);
+  std::future<bool> submit(uint64_t key, operation op);
+
+  std::future<bool> set_pu(ru_option opt, int32_t value);
+  void set_pu(ru_option opt, int32_t value, completion done);
+  std::future<bool> set_xu(const extension_unit& xu, uint8_t ctrl, const uint8_t* data, int len);
+  void set_xu(const extension_unit& xu, uint8_t ctrl, const uint8_t* data, int len, completion done);
+
+  // The future throws io_exception if the device doesn't answer
+  std::future<int32_t> get_pu(ru_option opt);
+  std::future<vector<uint8_t>> get_xu(const extension_unit& xu, uint8_t ctrl, int len);
+
+  // Requests waiting, not counting the one in progress
+  size_t queue_depth() const;
+  // Sets absorbed into a queued set of the same control so far
+  uint64_t coalesced_count() const;
+  // Block until everything submitted so far has completed
+  void wait_idle();
+};
+
+} // end librealuvc
+
+#endif
@@ -0,0 +1,36 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+#ifndef LIBREALUVC_RU_CONVERT_H
+#define LIBREALUVC_RU_CONVERT_H 1
+
+#include "ru_common.h"
+#include <opencv2/core.hpp>
+
+namespace librealuvc {
+
+// Color conversion of packed YUV 4:2:2 frames.
+//
+// The source is a CV_8UC2 Mat with one column per pixel, as returned by
+// VideoCapture::read() for YUY2/UYVY formats while CAP_PROP_CONVERT_RGB
+// is off (the default).  dst is (re)allocated as CV_8UC3
+// or CV_8UC1 and must not share memory with src.  The kernels use
+// SSSE3/AVX2 or NEON where available; every path gives identical output.
+
+LIBREALUVC_EXPORT void convert_yuyv_to_bgr(const cv::Mat& src, cv::Mat& dst);
+LIBREALUVC_EXPORT void convert_yuyv_to_rgb(const cv::Mat& src, cv::Mat& dst);
+LIBREALUVC_EXPORT void convert_uyvy_to_bgr(const cv::Mat& src, cv::Mat& dst);
+LIBREALUVC_EXPORT void convert_uyvy_to_rgb(const cv::Mat& src, cv::Mat& dst);
+
+// Luma only
+LIBREALUVC_EXPORT void convert_yuyv_to_gray(const cv::Mat& src, cv::Mat& dst);
+
+// The conversions above, the libuvc frame conversions and the Leap
+// frame fixups split large frames into bands of band_rows rows and run
+// them on OpenCV's thread pool.  Frames with fewer than min_pixels
+// pixels stay on the calling thread.  Defaults: 640x480, 32 rows.
+LIBREALUVC_EXPORT void set_convert_parallelism(int min_pixels, int band_rows);
+
+} // end librealuvc
+
+#endif
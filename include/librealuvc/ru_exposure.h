@@ -0,0 +1,81 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+#ifndef LIBREALUVC_RU_EXPOSURE_H
+#define LIBREALUVC_RU_EXPOSURE_H 1
+
+#include "ru_common.h"
+
+namespace librealuvc {
+
+// Brightness histogram of a frame, taken from every subsample-th row and
+// column while the frame is fixed up (see DevFrameQueue::pop_front).
+// YUV frames count their Y bytes, stereo frames both eyes alike.
+
+struct LIBREALUVC_EXPORT FrameHistogram {
+  uint32_t bins[256];
+  uint32_t count;
+  int subsample;
+
+  explicit FrameHistogram(int subsample = 4);
+
+  void clear();
+  // Smallest level with at least fraction p of the samples at or below it
+  int percentile(double p) const;
+  double mean() const;
+};
+
+struct LIBREALUVC_EXPORT AutoExposureSettings {
+  double target;      // brightness wanted at the percentile, 0..255
+  double percentile;  // e.g. 0.95: 95% of the samples at or below target
+  double tolerance;   // no change while within target +- tolerance
+  double max_ratio;   // largest change of exposure*gain per step (> 1)
+  int min_interval;   // frames between steps, counted once a step shows
+  int subsample;      // histogram every n-th row and column
+
+  AutoExposureSettings();
+};
+
+// AutoExposure turns frame histograms into exposure and gain settings.
+//
+// Brightness is taken as proportional to exposure*gain.  To brighten it
+// raises exposure first and gain only once exposure is at its maximum;
+// to darken it drops gain first, keeping noise low.  Each step is
+// limited to max_ratio, and the caller should only feed it frames that
+// already show the previous step (VideoCapture::set_at_frame tags them),
+// so the loop converges without overshoot.
+
+class LIBREALUVC_EXPORT AutoExposure {
+ private:
+  AutoExposureSettings settings_;
+  double exposure_min_, exposure_max_;
+  double gain_min_, gain_max_;
+  double exposure_;
+  double gain_;
+  int frames_since_step_;
+
+ public:
+  AutoExposure(
+    const AutoExposureSettings& settings,
+    double exposure_min, double exposure_max,
+    double gain_min, double gain_max,
+    double exposure, double gain
+  );
+
+  const AutoExposureSettings& settings() const { return settings_; }
+  void set_settings(const AutoExposureSettings& settings) { settings_ = settings; }
+
+  // Values set from elsewhere, e.g. by the application
+  void set_exposure(double exposure) { exposure_ = exposure; }
+  void set_gain(double gain) { gain_ = gain; }
+  double exposure() const { return exposure_; }
+  double gain() const { return gain_; }
+
+  // Look at one frame.  Returns true, with the new values in exposure
+  // and gain, when the device should change.
+  bool update(const FrameHistogram& hist, double& exposure, double& gain);
+};
+
+} // end librealuvc
+
+#endif
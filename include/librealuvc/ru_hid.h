@@ -71,12 +71,50 @@ enum custom_sensor_report_field {
 
 typedef std::function<void(const sensor_data&)> hid_callback;
 
+// Sensor names are interned: each distinct name gets a small id once, so
+// sample batches can identify their sensor without copying strings.
+
+typedef uint32_t hid_sensor_id;
+
+LIBREALUVC_EXPORT hid_sensor_id hid_sensor_intern(const string& name);
+LIBREALUVC_EXPORT const string& hid_sensor_name(hid_sensor_id id);
+
+// All samples returned by one read of one sensor, left in place in the
+// backend's read buffer.  Only valid for the duration of the callback.
+
+struct hid_sample_batch {
+  hid_sensor_id  sensor;
+  uint32_t       count;           // number of samples
+  uint32_t       stride;          // bytes from one sample to the next
+  uint32_t       data_size;       // bytes of reading at the start of a sample
+  uint32_t       metadata_offset; // where the metadata starts in a sample
+  uint32_t       metadata_size;   // 0 if there is no metadata
+  const uint8_t* samples;         // count*stride bytes
+  ru_nsec_t      monotonic_ns;    // host time the batch was read
+
+  const uint8_t* sample(uint32_t j) const { return samples + (size_t)j*stride; }
+  
+  // Sample j as delivered to a per-sample hid_callback
+  frame_object frame(uint32_t j) const {
+    const uint8_t* p = sample(j);
+    return {
+      data_size, (uint8_t)metadata_size, p,
+      (metadata_size ? p + metadata_offset : nullptr), monotonic_ns
+    };
+  }
+};
+
+typedef std::function<void(const hid_sample_batch&)> hid_batch_callback;
+
 class LIBREALUVC_EXPORT hid_device {
  public:
   virtual ~hid_device() = default;
   virtual void open(const vector<hid_profile>& hid_profiles) = 0;
   virtual void close() = 0;
   virtual void start_capture(hid_callback callback) = 0;
+  // One callback per read instead of per sample.  Backends without
+  // native batching deliver batches of one sample.
+  virtual void start_batch_capture(hid_batch_callback callback);
   virtual void stop_capture() = 0;
   virtual vector<hid_sensor> get_sensors() = 0;
   virtual vector<uint8_t> get_custom_report_data(
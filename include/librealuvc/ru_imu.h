@@ -0,0 +1,104 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+#ifndef LIBREALUVC_RU_IMU_H
+#define LIBREALUVC_RU_IMU_H 1
+
+#include "ru_common.h"
+#include "ru_hid.h"
+#include <atomic>
+
+namespace librealuvc {
+
+// One decoded motion sample.  monotonic_ns is on the same host clock as
+// frame_object::monotonic_ns and VideoCapture::get_frame_timestamp_ns(),
+// so IMU data can be lined up with video frames directly.
+
+struct imu_sample {
+  ru_nsec_t monotonic_ns;
+  uint64_t  device_ts;    // ts_high:ts_low as the sensor reported it
+  float     x, y, z;      // raw sensor units
+};
+
+// imu_ring keeps the most recent samples of one sensor.
+//
+// A single writer (the HID read thread) pushes; any number of readers
+// may query concurrently without locks.  Readers copy the requested
+// window into their own vector and drop anything the writer overwrote
+// meanwhile, so keep the capacity well above the window you ask for.
+//
+// Samples get host timestamps from their device timestamps: the offset
+// between the two clocks is the smallest one seen (the least delayed
+// read), allowed to creep by 100ppm for clock drift.
+
+class LIBREALUVC_EXPORT imu_ring {
+ private:
+  struct slot {
+    std::atomic<int64_t>  monotonic_ns;
+    std::atomic<uint64_t> device_ts;
+    std::atomic<float>    x, y, z;
+  };
+  size_t mask_;
+  std::unique_ptr<slot[]> slots_;
+  std::atomic<uint64_t> count_;   // samples published
+  std::atomic<uint64_t> claimed_; // samples the writer has started on
+  // writer-only clock mapping state
+  bool have_offset_;
+  int64_t offset_ns_;
+  ru_nsec_t offset_time_;
+  ru_nsec_t last_ns_;
+  uint32_t device_ts_ns_;
+
+  void load(uint64_t j, imu_sample& s) const;
+  bool overwritten(uint64_t first) const;
+  bool lower_bound(ru_nsec_t t, uint64_t& index, uint64_t& end) const;
+
+ public:
+  // capacity is rounded up to a power of 2; device_ts_ns is the length
+  // of one device timestamp tick (1000 for microsecond timestamps)
+  explicit imu_ring(size_t capacity = 4096, uint32_t device_ts_ns = 1000);
+
+  imu_ring(const imu_ring&) = delete;
+  imu_ring& operator=(const imu_ring&) = delete;
+
+  size_t capacity() const { return mask_ + 1; }
+
+  // Writer side
+  void push(const imu_sample& s);
+  // Decodes hid_sensor_data samples; the host time of each sample comes
+  // from its device timestamp and the batch read time
+  void push(const hid_sample_batch& batch);
+
+  // Reader side
+  // Samples with t0 <= monotonic_ns <= t1, oldest first, into out
+  // (cleared first).  Returns the number of samples.
+  size_t samples_between(ru_nsec_t t0, ru_nsec_t t1, vector<imu_sample>& out) const;
+  // Linear interpolation between the samples either side of t.  False if
+  // t is outside the buffered range.
+  bool interpolate_at(ru_nsec_t t, imu_sample& out) const;
+  // Most recent sample, false if none
+  bool latest(imu_sample& out) const;
+};
+
+// Routes batches from hid_device::start_batch_capture() to one imu_ring
+// per sensor.  The sensors are fixed at construction, so routing takes
+// no locks.
+
+class LIBREALUVC_EXPORT imu_recorder {
+ private:
+  vector<hid_sensor_id> ids_;
+  vector<shared_ptr<imu_ring>> rings_;
+
+ public:
+  imu_recorder(const vector<string>& sensor_names, size_t capacity = 4096);
+
+  // nullptr for a sensor that wasn't named at construction
+  shared_ptr<imu_ring> get_ring(const string& sensor_name) const;
+  shared_ptr<imu_ring> get_ring(hid_sensor_id id) const;
+
+  hid_batch_callback callback();
+};
+
+} // end librealuvc
+
+#endif
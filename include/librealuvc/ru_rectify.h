@@ -0,0 +1,69 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+#ifndef LIBREALUVC_RU_RECTIFY_H
+#define LIBREALUVC_RU_RECTIFY_H 1
+
+#include "ru_common.h"
+#include "ru_videocapture.h"
+#include <opencv2/core.hpp>
+
+namespace librealuvc {
+
+// Per-eye intrinsics and rectifying rotation decoded from a
+// "LeapStereoCalibration" blob (156 bytes, version 1).
+
+struct LIBREALUVC_EXPORT LeapEyeCalibration {
+  float focal_length;
+  float offset[2];      // principal point relative to (320, 240)
+  float tangential[2];
+  float radial[6];      // rational model, maps distorted -> undistorted
+  float rotation[3];    // Cayley parameters of the rectifying rotation
+};
+
+struct LIBREALUVC_EXPORT LeapStereoCalibration {
+  float baseline;
+  LeapEyeCalibration eye[2]; // left, right
+
+  // Throws invalid_value_exception if calib is not a LeapStereoCalibration
+  static LeapStereoCalibration parse(const OpaqueCalibration& calib);
+};
+
+// StereoRectifier turns stereo frames into rectified left/right images.
+//
+// The remap tables are computed once, in OpenCV's fixed-point form
+// (CV_16SC2 integer coordinates plus CV_16UC1 interpolation indices),
+// giving the same rectification as cv::initUndistortRectifyMap with the
+// default new camera matrix.  rectify() reads the frame as the device
+// delivered it, before any deinterleave, and writes both eyes in a
+// single bilinear pass split across threads.
+
+class LIBREALUVC_EXPORT StereoRectifier {
+ private:
+  int eye_width_;
+  int eye_height_;
+  cv::Mat map_xy_[2];   // CV_16SC2
+  cv::Mat map_frac_[2]; // CV_16UC1
+
+ public:
+  StereoRectifier(const LeapStereoCalibration& calib, int eye_width, int eye_height);
+
+  int eye_width() const { return eye_width_; }
+  int eye_height() const { return eye_height_; }
+
+  // The tables for one eye (0 = left), usable with cv::remap
+  const cv::Mat& map_xy(int eye) const { return map_xy_[eye]; }
+  const cv::Mat& map_frac(int eye) const { return map_frac_[eye]; }
+
+  // src holds both eyes as 8-bit pixels, eye_height rows of 2*eye_width
+  // bytes, in the layout named by fixup:
+  //   FIXUP_GRAY8_PIX_L_PIX_R  pixels alternate L R L R ... (raw Peripheral)
+  //   FIXUP_GRAY8_ROW_L_ROW_R  each row is the L row then the R row
+  // FIXUP_NORMAL means src is already side-by-side, which for 8-bit data
+  // is the same as FIXUP_GRAY8_ROW_L_ROW_R.
+  void rectify(const cv::Mat& src, DevFrameFixup fixup, cv::Mat& left, cv::Mat& right) const;
+};
+
+} // end librealuvc
+
+#endif
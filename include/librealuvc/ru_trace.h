@@ -0,0 +1,31 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+#ifndef LIBREALUVC_RU_TRACE_H
+#define LIBREALUVC_RU_TRACE_H 1
+
+#include "ru_common.h"
+#include <iosfwd>
+
+namespace librealuvc {
+
+// Per-frame latency tracing.
+//
+// While enabled, each stage of the frame path (DQBUF, callback, queue
+// push/pop, fixup, buffer re-queue) records a monotonic timestamp into a
+// ring buffer owned by the thread that hit it.  The most recent events
+// can be written out in Chrome trace-event format and loaded into
+// chrome://tracing or Perfetto.  Events of one frame share its id, which
+// is the frame's monotonic capture timestamp.
+
+LIBREALUVC_EXPORT void trace_enable(bool on);
+
+// Discard all recorded events
+LIBREALUVC_EXPORT void trace_clear();
+
+LIBREALUVC_EXPORT void trace_write_chrome_json(std::ostream& os);
+LIBREALUVC_EXPORT bool trace_dump_chrome_json(const string& file_path);
+
+} // end librealuvc
+
+#endif
@@ -53,6 +53,18 @@ struct LIBREALUVC_EXPORT extension_unit {
   operator string() const { return this->to_string(); }
 };
 
+// Sensor-side crop rectangle, in pixels of the full frame.
+// An empty rect means no cropping.
+
+struct crop_rect {
+  int32_t x;
+  int32_t y;
+  int32_t width;
+  int32_t height;
+  
+  bool empty() const { return ((width <= 0) || (height <= 0)); }
+};
+
 enum power_state {
   D0, // full power
   D3  // sleep
@@ -91,6 +103,14 @@ class LIBREALUVC_EXPORT uvc_device {
 
   virtual string get_device_location() const = 0;
   virtual usb_spec get_usb_specification() const = 0;
+  
+  // Request a hardware crop, applied by the next probe_and_commit().
+  // Backends without crop support ignore it.
+  virtual void set_crop(const crop_rect& rect) { }
+  
+  // The crop in effect for the committed stream, if any.  It may be
+  // larger than requested when the device rounds to its own alignment.
+  virtual bool get_crop(crop_rect& rect) const { return false; }
 };
 
 class LIBREALUVC_EXPORT uvc_device_info {
@@ -147,6 +167,9 @@ class LIBREALUVC_EXPORT uvc_device_with_retry : public uvc_device {
 
   virtual string get_device_location() const;
   virtual usb_spec get_usb_specification() const;
+  
+  virtual void set_crop(const crop_rect& rect);
+  virtual bool get_crop(crop_rect& rect) const;
 };
 
 } // end librealuvc
@@ -8,10 +8,13 @@
 // cv::VideoCapture, allowing code using cv::VideoCapture to
 // be ported with minimal changes.
 
+#include "ru_blobs.h"
 #include "ru_common.h"
+#include "ru_exposure.h"
 #include "ru_uvc.h"
 #include <opencv2/core.hpp>
 #include <opencv2/videoio.hpp>
+#include <future>
 #include <memory>
 #include <string>
 #include <vector>
@@ -33,6 +36,8 @@ using std::vector;
 // When it's an opencv device, it will forward method calls to get
 // the normal cv::VideoCapture behavior.
 
+class uvc_control_worker;
+
 class IVideoStream {
  public:
   virtual ~IVideoStream() { }
@@ -94,6 +99,10 @@ class IPropertyDriver {
   
   virtual shared_ptr<OpaqueCalibration> get_opaque_calibration() { return nullptr; }
   
+  // Frames between a control change being acknowledged and the first
+  // frame that was exposed with it
+  virtual int get_control_latency_frames() { return 1; }
+  
   virtual HandlerResult get_prop_range(int prop_id, double* min, double* max) = 0;
   
   virtual HandlerResult get_prop(int prop_id, double* val) = 0;
@@ -119,6 +128,9 @@ enum CapPropLeap {
   CAP_PROP_LEAP_BASE = 100,
   CAP_PROP_LEAP_HDR  = 101,
   CAP_PROP_LEAP_LEDS = 102,
+  // Subtract the strobe's dark frames from the lit ones, which are the
+  // only ones read() then returns (DevFrameQueue::set_ambient_subtract)
+  CAP_PROP_LEAP_AMBIENT_SUBTRACT = 103,
 };
 
 class LIBREALUVC_EXPORT VideoCapture : public cv::VideoCapture {
@@ -131,6 +143,7 @@ class LIBREALUVC_EXPORT VideoCapture : public cv::VideoCapture {
   shared_ptr<librealuvc::uvc_device> realuvc_;
   shared_ptr<IPropertyDriver> driver_;
   shared_ptr<IVideoStream> istream_;
+  shared_ptr<uvc_control_worker> controls_;
   cv::Mat reusable_image_;
   
  public:
@@ -152,7 +165,23 @@ class LIBREALUVC_EXPORT VideoCapture : public cv::VideoCapture {
   virtual VideoCapture& operator>>(cv::Mat& image);
   virtual VideoCapture& operator>>(cv::UMat& image);
   
+  // Unlike OpenCV, CAP_PROP_CONVERT_RGB defaults to off: YUY2/UYVY frames
+  // come out as CV_8UC2, one column per pixel, ready for ru_convert.h.
+  // set(cv::CAP_PROP_CONVERT_RGB, 1) gives BGR frames instead.  The Leap
+  // stereo layouts are 8-bit gray either way.
   virtual bool read(cv::OutputArray image);
+  
+  // Stereo cameras only: wait for the next frame and rectify both eyes
+  // with the device calibration.  The remap tables are built on the
+  // first call.  The region of interest doesn't apply.  Returns false
+  // for mono cameras or when the calibration can't be read.
+  virtual bool read_stereo(cv::OutputArray left, cv::OutputArray right);
+  
+  // Stereo cameras only: wait for the next frame and find its blobs
+  // (ru_blobs.h) as the frame is fixed up, using blobs.settings.  Rows
+  // outside the region of interest are skipped.  The frame goes to image
+  // only if asked for.
+  virtual bool read_blobs(StereoBlobs& blobs, cv::OutputArray image = cv::noArray());
   virtual void release();
   virtual bool retrieve(cv::OutputArray image, int flag = 0);
   virtual bool set(int prop_id, double value);
@@ -165,6 +194,19 @@ class LIBREALUVC_EXPORT VideoCapture : public cv::VideoCapture {
   
   virtual bool is_stereo_camera() const;
   
+  // Restrict frames to a region of interest, in the coordinates of the
+  // full output image.  Where the device supports it the crop happens on
+  // the sensor, so less data crosses the bus; otherwise the frames are
+  // zero-copy views of the region.  An empty rect restores full frames.
+  // Set it before the first read(): once streaming, the region can only
+  // move within the hardware crop chosen at stream start.
+  virtual bool set_roi(const cv::Rect& roi);
+  virtual cv::Rect get_roi() const;
+  
+  // Monotonic capture time of the last frame returned by read()/retrieve(),
+  // in nanoseconds.  CAP_PROP_POS_MSEC gives the same instant as wall-clock.
+  virtual ru_nsec_t get_frame_timestamp_ns() const;
+  
   virtual shared_ptr<OpaqueCalibration> get_opaque_calibration();
   
   virtual bool get_prop_range(int prop_id, double* min_val, double* max_val);
@@ -172,6 +214,46 @@ class LIBREALUVC_EXPORT VideoCapture : public cv::VideoCapture {
   virtual bool get_xu(int ctrl, uint8_t* data, int len);
   virtual bool set_xu(int ctrl, const uint8_t* data, int len);
   
+  // Queue a set() or set_xu() on the device's control thread and return
+  // at once.  Sets of a property that is still waiting in the queue
+  // coalesce into one transfer of the latest value.  For an OpenCV
+  // device the set happens before returning.
+  //
+  // Neither set() nor the control thread holds up read() while a transfer
+  // is in progress.  Blocking calls and queued ones take turns on the
+  // device, each property or XU set going through whole, so multi-transfer
+  // sequences (e.g. the Peripheral's LED command) never interleave.
+  virtual std::future<bool> set_async(int prop_id, double value);
+  virtual void set_async(int prop_id, double value, std::function<void(bool)> done);
+  virtual std::future<bool> set_xu_async(int ctrl, const uint8_t* data, int len);
+  
+  // Control requests waiting to reach the device
+  virtual size_t get_control_queue_depth() const;
+  
+  // Apply several property changes as one transaction on the control
+  // thread, returning its id.  Each frame from read()/read_stereo() is
+  // tagged with the newest transaction in effect when it was exposed, so
+  // a control loop can use the very first frame with its settings:
+  //
+  //   auto id = cap.set_at_frame({{cv::CAP_PROP_EXPOSURE, e}, {cv::CAP_PROP_GAIN, g}});
+  //   do { cap.read(image); } while (cap.get_frame_settings_id() < id);
+  //
+  // "In effect" means captured at least get_control_latency_frames()
+  // frame intervals after the device acknowledged the last change.  done
+  // gets false if any change failed.  OpenCV devices apply the changes
+  // before returning and return 0.
+  typedef vector<std::pair<int, double>> PropertyChanges;
+  virtual uint64_t set_at_frame(const PropertyChanges& changes, std::function<void(bool)> done = nullptr);
+  
+  // Transaction id of the last frame read, 0 before any took effect
+  virtual uint64_t get_frame_settings_id() const;
+  
+  // set(cv::CAP_PROP_AUTO_EXPOSURE, 1) runs an AutoExposure loop inside
+  // read()/read_stereo(), on devices whose driver has CAP_PROP_EXPOSURE.
+  // Steps go out through set_at_frame(), one at a time.
+  virtual void set_auto_exposure_settings(const AutoExposureSettings& settings);
+  virtual AutoExposureSettings get_auto_exposure_settings() const;
+  
   inline cv::Mat& get_reusable_image() { return reusable_image_; }
 };
   
@@ -53,11 +53,16 @@ void control_range::populate_raw_data(std::vector<uint8_t>& vec, int32_t value)
     std::copy(data, data + sizeof(value), vec.data());
 }
 
-double monotonic_to_realtime(double monotonic) {
+ru_nsec_t monotonic_to_realtime_ns(ru_nsec_t monotonic_ns) {
   using namespace std::chrono;
-  auto realtime = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
-  auto time_since_epoch = duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
-  return monotonic + (realtime - time_since_epoch);
+  auto realtime = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  auto time_since_epoch = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+  return monotonic_ns + (realtime - time_since_epoch);
+}
+
+ru_nsec_t monotonic_now_ns() {
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
 }
 
 } // end librealuvc
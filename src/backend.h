@@ -43,8 +43,6 @@ std::shared_ptr<backend> create_backend();
 
 } // end platform
 
-double monotonic_to_realtime(double monotonic);
-
 } // end librealuvc
 
 #endif
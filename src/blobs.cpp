@@ -0,0 +1,188 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+#include "blobs.h"
+#include "convert.h"
+#include <librealuvc/ru_exception.h>
+#include <algorithm>
+#include <mutex>
+
+namespace librealuvc {
+
+namespace { // anon
+
+int find_root(std::vector<int>& parent, int j) {
+  while (parent[j] != j) {
+    parent[j] = parent[parent[j]];
+    j = parent[j];
+  }
+  return j;
+}
+
+struct blob_sum {
+  uint32_t area;
+  uint32_t mass;
+  uint64_t mass_x;
+  uint64_t mass_y;
+  uint8_t peak;
+};
+
+} // end anon
+
+BlobSettings::BlobSettings() :
+  threshold(200),
+  min_area(2),
+  max_blobs(32) {
+}
+
+void StereoBlobs::clear() {
+  for (int e = 0; e < 2; ++e) {
+    eye[e].clear();
+    peak[e] = 0;
+    peak_at[e] = cv::Point();
+  }
+}
+
+blob_band::blob_band() {
+  for (int e = 0; e < 2; ++e) {
+    peak[e] = -1;
+    peak_x[e] = peak_y[e] = 0;
+  }
+}
+
+void blob_band::scan(const uint8_t* p, int n, int eye, int row, uint8_t threshold) {
+  int best = max_row(p, n);
+  if (best > peak[eye]) {
+    peak[eye] = best;
+    peak_x[eye] = find_at_least_row(p, n, 0, (uint8_t)best);
+    peak_y[eye] = row;
+  }
+  if (best < threshold) return;
+  // Runs are short, so only the gaps between them are worth vectorizing
+  for (int x = find_at_least_row(p, n, 0, threshold); x < n;
+       x = find_at_least_row(p, n, x, threshold)) {
+    blob_run run;
+    run.eye = eye;
+    run.row = row;
+    run.x0 = x;
+    run.mass = 0;
+    run.mass_x = 0;
+    run.peak = 0;
+    for (; (x < n) && (p[x] >= threshold); ++x) {
+      uint32_t w = (uint32_t)(p[x] - threshold + 1);
+      run.mass += w;
+      run.mass_x += (uint64_t)w * x;
+      run.peak = std::max(run.peak, p[x]);
+    }
+    run.x1 = x;
+    runs.push_back(run);
+  }
+}
+
+void blob_band::merge_into(blob_band& all) const {
+  all.runs.insert(all.runs.end(), runs.begin(), runs.end());
+  for (int e = 0; e < 2; ++e) {
+    // Ties go to the topmost, so the result doesn't depend on banding
+    if ((peak[e] > all.peak[e]) ||
+        ((peak[e] == all.peak[e]) && (peak_y[e] < all.peak_y[e]))) {
+      all.peak[e] = peak[e];
+      all.peak_x[e] = peak_x[e];
+      all.peak_y[e] = peak_y[e];
+    }
+  }
+}
+
+void blob_finish(blob_band& all, StereoBlobs& blobs) {
+  for (int e = 0; e < 2; ++e) {
+    blobs.eye[e].clear();
+    blobs.peak[e] = (uint8_t)std::max(0, all.peak[e]);
+    blobs.peak_at[e] = cv::Point(all.peak_x[e], all.peak_y[e]);
+  }
+  auto& runs = all.runs;
+  std::sort(runs.begin(), runs.end(), [](const blob_run& a, const blob_run& b) {
+    if (a.eye != b.eye) return (a.eye < b.eye);
+    if (a.row != b.row) return (a.row < b.row);
+    return (a.x0 < b.x0);
+  });
+  // Union each run with the runs of the row above that touch it,
+  // diagonals included.  Both rows are sorted by x0 and don't overlap,
+  // so one pointer into the row above serves the whole row.
+  int nrun = (int)runs.size();
+  std::vector<int> parent(nrun);
+  for (int j = 0; j < nrun; ++j) parent[j] = j;
+  int above_begin = 0, above_end = 0;
+  for (int begin = 0; begin < nrun; ) {
+    int end = begin;
+    while ((end < nrun) && (runs[end].eye == runs[begin].eye) && (runs[end].row == runs[begin].row)) ++end;
+    bool touching = ((above_end > above_begin) &&
+      (runs[above_begin].eye == runs[begin].eye) && (runs[above_begin].row == runs[begin].row - 1));
+    if (touching) {
+      int a = above_begin;
+      for (int c = begin; c < end; ++c) {
+        while ((a < above_end) && (runs[a].x1 < runs[c].x0)) ++a;
+        for (int b = a; (b < above_end) && (runs[b].x0 <= runs[c].x1); ++b) {
+          int ra = find_root(parent, b);
+          int rc = find_root(parent, c);
+          if (ra != rc) parent[std::max(ra, rc)] = std::min(ra, rc);
+        }
+      }
+    }
+    above_begin = begin;
+    above_end = end;
+    begin = end;
+  }
+  std::vector<blob_sum> sums(nrun);
+  for (int j = 0; j < nrun; ++j) {
+    const blob_run& run = runs[j];
+    blob_sum& s = sums[find_root(parent, j)];
+    s.area += (uint32_t)(run.x1 - run.x0);
+    s.mass += run.mass;
+    s.mass_x += run.mass_x;
+    s.mass_y += (uint64_t)run.mass * run.row;
+    s.peak = std::max(s.peak, run.peak);
+  }
+  int min_area = std::max(1, blobs.settings.min_area);
+  for (int j = 0; j < nrun; ++j) {
+    if (parent[j] != j) continue;
+    const blob_sum& s = sums[j];
+    if ((int)s.area < min_area) continue;
+    Blob blob;
+    blob.x = (float)((double)s.mass_x / s.mass);
+    blob.y = (float)((double)s.mass_y / s.mass);
+    blob.area = s.area;
+    blob.mass = s.mass;
+    blob.peak = s.peak;
+    blobs.eye[runs[j].eye].push_back(blob);
+  }
+  size_t max_blobs = (size_t)std::max(0, blobs.settings.max_blobs);
+  for (int e = 0; e < 2; ++e) {
+    auto& list = blobs.eye[e];
+    std::sort(list.begin(), list.end(), [](const Blob& a, const Blob& b) {
+      return (a.mass > b.mass);
+    });
+    if (list.size() > max_blobs) list.resize(max_blobs);
+  }
+}
+
+LIBREALUVC_EXPORT void find_stereo_blobs(const cv::Mat& mat, StereoBlobs& blobs) {
+  if ((mat.type() != CV_8UC1) || (mat.dims != 2)) {
+    throw invalid_value_exception("find_stereo_blobs needs a CV_8UC1 side-by-side frame");
+  }
+  int threshold = std::max(1, std::min(255, blobs.settings.threshold));
+  int half = (mat.cols / 2);
+  blob_band all;
+  std::mutex all_mutex;
+  parallel_rows(mat.rows, mat.cols, [&](int row_begin, int row_end) {
+    blob_band band;
+    for (int row = row_begin; row < row_end; ++row) {
+      const uint8_t* p = mat.ptr<uint8_t>(row);
+      band.scan(p, half, 0, row, (uint8_t)threshold);
+      band.scan(p + half, half, 1, row, (uint8_t)threshold);
+    }
+    std::lock_guard<std::mutex> lock(all_mutex);
+    band.merge_into(all);
+  });
+  blob_finish(all, blobs);
+}
+
+} // end librealuvc
@@ -0,0 +1,42 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+#ifndef LIBREALUVC_BLOBS_H
+#define LIBREALUVC_BLOBS_H
+
+#include <librealuvc/ru_blobs.h>
+#include <cstdint>
+#include <vector>
+
+namespace librealuvc {
+
+// A horizontal run of pixels at or above the threshold, [x0, x1)
+struct blob_run {
+  int eye;
+  int row;
+  int x0, x1;
+  uint32_t mass;
+  uint64_t mass_x;
+  uint8_t peak;
+};
+
+// The blob scan of a band of rows.  The frame fixup keeps one per band
+// and merges them, in any order, before blob_finish().
+struct blob_band {
+  std::vector<blob_run> runs;
+  int peak[2];
+  int peak_x[2];
+  int peak_y[2];
+
+  blob_band();
+  // Scan n pixels of one eye's row
+  void scan(const uint8_t* p, int n, int eye, int row, uint8_t threshold);
+  void merge_into(blob_band& all) const;
+};
+
+// Join the runs into blobs
+void blob_finish(blob_band& all, StereoBlobs& blobs);
+
+} // end librealuvc
+
+#endif
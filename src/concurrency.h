@@ -8,133 +8,304 @@
 #include <thread>
 #include <atomic>
 #include <functional>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+#endif
 
 const int QUEUE_MAX_SIZE = 10;
-// Simplest implementation of a blocking concurrent queue for thread messaging
+
+// Futex-style wait word: waiters sleep until the epoch moves on, and
+// notify_all() costs one atomic load when nobody is waiting.
+class wait_word
+{
+    std::atomic<uint32_t> _epoch;
+    std::atomic<uint32_t> _waiters;
+#ifndef __linux__
+    std::mutex _mutex;
+    std::condition_variable _cv;
+#endif
+public:
+    wait_word() : _epoch(0), _waiters(0) {}
+
+    // Register as a waiter, then re-check the condition before wait()
+    uint32_t prepare_wait()
+    {
+        _waiters.fetch_add(1);
+        return _epoch.load();
+    }
+
+    void cancel_wait()
+    {
+        _waiters.fetch_sub(1);
+    }
+
+    // false if the deadline passed first
+    bool wait(uint32_t epoch, std::chrono::steady_clock::time_point deadline)
+    {
+        bool woken = true;
+#ifdef __linux__
+        while (_epoch.load(std::memory_order_acquire) == epoch)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= deadline)
+            {
+                woken = false;
+                break;
+            }
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now).count();
+            struct timespec ts;
+            ts.tv_sec = (time_t)(ns / 1000000000);
+            ts.tv_nsec = (long)(ns % 1000000000);
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&_epoch), FUTEX_WAIT_PRIVATE, epoch, &ts, nullptr, 0);
+        }
+#else
+        std::unique_lock<std::mutex> lock(_mutex);
+        woken = _cv.wait_until(lock, deadline, [&]() { return _epoch.load() != epoch; });
+#endif
+        _waiters.fetch_sub(1);
+        return woken;
+    }
+
+    void notify_all()
+    {
+        // pairs with the fetch_add in prepare_wait()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_waiters.load(std::memory_order_relaxed) == 0)
+            return;
+        _epoch.fetch_add(1);
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&_epoch), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+        { std::lock_guard<std::mutex> lock(_mutex); }
+        _cv.notify_all();
+#endif
+    }
+};
+
+// Bounded blocking queue for thread messaging, on a preallocated ring.
+// Any number of threads may enqueue; enqueue() never allocates, and when
+// the ring is full it drops the oldest item, while blocking_enqueue()
+// waits for room. Slots are claimed with per-slot sequence numbers, so
+// clear() and the overflow drop can pop from any thread.
 template<class T>
 class single_consumer_queue
 {
-    std::deque<T> _queue;
-    std::mutex _mutex;
-    std::condition_variable _deq_cv; // not empty signal
-    std::condition_variable _enq_cv; // not empty signal
+    struct cell
+    {
+        std::atomic<size_t> seq;
+        T item;
+    };
+
+    // Polls before sleeping; a wakeup costs far more than a short spin
+    static const int SPIN_COUNT = 256;
 
-    unsigned int _cap;
-    bool _accepting;
+    std::unique_ptr<cell[]> _cells;
+    size_t _cap;
+    // producers and the consumer each get their own cache line
+    alignas(64) std::atomic<size_t> _head; // next to dequeue
+    alignas(64) std::atomic<size_t> _tail; // next to enqueue
+
+    alignas(64) wait_word _not_empty;
+    wait_word _not_full;
+
+    std::atomic<bool> _accepting;
 
     // flush mechanism is required to abort wait on cv
     // when need to stop
     std::atomic<bool> _need_to_flush;
-    std::atomic<bool> _was_flushed;
-public:
-    explicit single_consumer_queue<T>(unsigned int cap = QUEUE_MAX_SIZE)
-        : _queue(), _mutex(), _deq_cv(), _enq_cv(), _cap(cap), _need_to_flush(false), _was_flushed(false), _accepting(true)
-    {}
 
-    void enqueue(T&& item)
+    bool try_push(T& item)
     {
-        std::unique_lock<std::mutex> lock(_mutex);
-        if (_accepting)
+        auto pos = _tail.load(std::memory_order_relaxed);
+        for (;;)
         {
-            _queue.push_back(std::move(item));
-            if (_queue.size() > _cap)
+            auto& c = _cells[pos % _cap];
+            auto seq = c.seq.load(std::memory_order_acquire);
+            auto diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
             {
-                _queue.pop_front();
+                if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    c.item = std::move(item);
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false; // full
+            }
+            else
+            {
+                pos = _tail.load(std::memory_order_relaxed);
             }
         }
-        lock.unlock();
-        _deq_cv.notify_one();
     }
 
-    void blocking_enqueue(T&& item)
+    bool try_pop(T* item)
     {
-        auto pred = [this]()->bool { return _queue.size() <= _cap; };
-
-        std::unique_lock<std::mutex> lock(_mutex);
-        if (_accepting)
+        auto pos = _head.load(std::memory_order_relaxed);
+        for (;;)
         {
-            _enq_cv.wait(lock, pred);
-            _queue.push_back(std::move(item));
+            auto& c = _cells[pos % _cap];
+            auto seq = c.seq.load(std::memory_order_acquire);
+            auto diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0)
+            {
+                if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    if (item)
+                        *item = std::move(c.item);
+                    c.item = T();
+                    c.seq.store(pos + _cap, std::memory_order_release);
+                    _not_full.notify_all();
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false; // empty
+            }
+            else
+            {
+                pos = _head.load(std::memory_order_relaxed);
+            }
         }
-        lock.unlock();
-        _deq_cv.notify_one();
     }
 
+    bool has_item()
+    {
+        auto pos = _head.load();
+        return _cells[pos % _cap].seq.load() == pos + 1;
+    }
 
-    bool dequeue(T* item ,unsigned int timeout_ms = 5000)
+    bool has_room()
     {
-        std::unique_lock<std::mutex> lock(_mutex);
-        _accepting = true;
-        _was_flushed = false;
-        const auto ready = [this]() { return (_queue.size() > 0) || _need_to_flush; };
-        if (!ready() && !_deq_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready))
-        {
-            return false;
-        }
+        auto pos = _tail.load();
+        return _cells[pos % _cap].seq.load() == pos;
+    }
 
-        if (_queue.size() <= 0)
+public:
+    explicit single_consumer_queue<T>(unsigned int cap = QUEUE_MAX_SIZE)
+        : _cells(new cell[cap ? cap : 1]), _cap(cap ? cap : 1), _head(0), _tail(0),
+          _accepting(true), _need_to_flush(false)
+    {
+        for (size_t i = 0; i < _cap; ++i)
+            _cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    void enqueue(T&& item)
+    {
+        if (!_accepting)
+            return;
+        while (!try_push(item))
         {
-            return false;
+            // Full: drop the oldest, unless a dequeue is already freeing a slot
+            if (_tail.load() - _head.load() >= _cap)
+                try_pop(nullptr);
+            else
+                std::this_thread::yield();
         }
-        *item = std::move(_queue.front());
-        _queue.pop_front();
-        _enq_cv.notify_one();
-        return true;
+        _not_empty.notify_all();
     }
 
-    bool try_dequeue(T* item)
+    void blocking_enqueue(T&& item)
     {
-        std::unique_lock<std::mutex> lock(_mutex);
-        _accepting = true;
-        if (_queue.size() > 0)
+        if (!_accepting)
+            return;
+        for (int spin = 0; !try_push(item); ++spin)
         {
-            auto val = std::move(_queue.front());
-            _queue.pop_front();
-            *item = std::move(val);
-            _enq_cv.notify_one();
-            return true;
+            if (spin < SPIN_COUNT)
+            {
+                if (!_accepting)
+                    return;
+                std::this_thread::yield();
+                continue;
+            }
+            auto epoch = _not_full.prepare_wait();
+            if (has_room() || !_accepting)
+            {
+                _not_full.cancel_wait();
+                if (!_accepting)
+                    return;
+                continue;
+            }
+            _not_full.wait(epoch, std::chrono::steady_clock::time_point::max());
         }
-        return false;
+        _not_empty.notify_all();
     }
 
-    bool peek(T** item)
+    bool dequeue(T* item, unsigned int timeout_ms = 5000)
     {
-        std::unique_lock<std::mutex> lock(_mutex);
+        if (!_accepting.load(std::memory_order_relaxed))
+            _accepting = true;
 
-        if (_queue.size() <= 0)
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        for (int spin = 0; ; ++spin)
         {
-            return false;
+            if (try_pop(item))
+                return true;
+            if (_need_to_flush)
+                return false;
+            if (spin < SPIN_COUNT)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            auto epoch = _not_empty.prepare_wait();
+            if (has_item() || _need_to_flush)
+            {
+                _not_empty.cancel_wait();
+                continue;
+            }
+            if (!_not_empty.wait(epoch, deadline))
+                return try_pop(item);
         }
-        *item = &_queue.front();
-        return true;
     }
 
-    void clear()
+    bool try_dequeue(T* item)
     {
-        std::unique_lock<std::mutex> lock(_mutex);
+        if (!_accepting.load(std::memory_order_relaxed))
+            _accepting = true;
+        return try_pop(item);
+    }
 
+    void clear()
+    {
         _accepting = false;
         _need_to_flush = true;
 
-        while (_queue.size() > 0)
-        {
-            auto item = std::move(_queue.front());
-            _queue.pop_front();
-        }
-        _deq_cv.notify_all();
+        while (try_pop(nullptr)) {}
+
+        _not_empty.notify_all();
+        _not_full.notify_all();
     }
 
     void start()
     {
-        std::unique_lock<std::mutex> lock(_mutex);
         _need_to_flush = false;
         _accepting = true;
     }
 
     size_t size()
     {
-        std::unique_lock<std::mutex> lock(_mutex);
-        return _queue.size();
+        auto head = _head.load();
+        auto tail = _tail.load();
+        return (tail > head) ? std::min(tail - head, _cap) : 0;
+    }
+
+    size_t capacity() const
+    {
+        return _cap;
     }
 };
 
@@ -159,11 +330,6 @@ public:
         return _queue.dequeue(item, timeout_ms);
     }
 
-    bool peek(T** item)
-    {
-        return _queue.peek(item);
-    }
-
     bool try_dequeue(T* item)
     {
         return _queue.try_dequeue(item);
@@ -181,7 +347,7 @@ public:
 
     void flush()
     {
-        _queue.flush();
+        _queue.clear();
     }
 
     size_t size()
@@ -309,10 +475,10 @@ public:
             if (_was_stopped || !(*wait_sucess))
                 return;
 
-            {
-                std::lock_guard<std::mutex> locker(m);
-                invoked = true;
-            }
+            // notify under the lock: flush() may return and destroy cv
+            // as soon as it sees invoked
+            std::lock_guard<std::mutex> locker(m);
+            invoked = true;
             cv.notify_one();
         });
         std::unique_lock<std::mutex> locker(m);
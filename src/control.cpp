@@ -0,0 +1,207 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+#include <librealuvc/ru_control.h>
+#include <librealuvc/ru_exception.h>
+#include "types.h"
+
+namespace librealuvc {
+
+namespace { // anon
+
+constexpr uint64_t KEY_PU = (1ull << 56);
+constexpr uint64_t KEY_XU = (2ull << 56);
+
+uint64_t xu_key(const extension_unit& xu, uint8_t ctrl) {
+  return (KEY_XU | ((uint64_t)(uint8_t)xu.subdevice << 16) | ((uint64_t)(uint8_t)xu.unit << 8) | ctrl);
+}
+
+} // end anon
+
+uvc_control_worker::uvc_control_worker(shared_ptr<uvc_device> dev) :
+  dev_(dev),
+  busy_(false),
+  stop_(false),
+  coalesced_(0) {
+  thread_ = std::thread([this]() { run(); });
+}
+
+uvc_control_worker::~uvc_control_worker() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  thread_.join();
+}
+
+void uvc_control_worker::complete(request& req, bool ok) {
+  for (auto& done : req.done) {
+    if (!done) continue;
+    try {
+      done(ok);
+    } catch (std::exception& e) {
+      LOG_ERROR("uvc_control_worker: completion threw " << e.what());
+    } catch (...) {
+      LOG_ERROR("uvc_control_worker: completion threw");
+    }
+  }
+}
+
+void uvc_control_worker::run() {
+  for (;;) {
+    request req;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_cv_.wait(lock, [this]() { return (stop_ || !queue_.empty()); });
+      if (stop_) break;
+      req = std::move(queue_.front());
+      queue_.pop_front();
+      busy_ = true;
+    }
+    bool ok = false;
+    try {
+      ok = req.op();
+    } catch (std::exception& e) {
+      LOG_WARNING("uvc_control_worker: control request threw " << e.what());
+    } catch (...) {
+      LOG_WARNING("uvc_control_worker: control request threw");
+    }
+    complete(req, ok);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      busy_ = false;
+    }
+    idle_cv_.notify_all();
+  }
+  // Stopping: whatever is left never reaches the device
+  std::deque<request> cancelled;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancelled.swap(queue_);
+  }
+  for (auto& req : cancelled) complete(req, false);
+  idle_cv_.notify_all();
+}
+
+void uvc_control_worker::submit(uint64_t key, operation op, completion done) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stop_) {
+      throw wrong_api_call_sequence_exception("uvc_control_worker is stopping");
+    }
+    if (key != 0) {
+      for (auto& req : queue_) {
+        if (req.key != key) continue;
+        req.op = std::move(op);
+        req.done.push_back(std::move(done));
+        ++coalesced_;
+        return;
+      }
+    }
+    request req;
+    req.key = key;
+    req.op = std::move(op);
+    req.done.push_back(std::move(done));
+    queue_.push_back(std::move(req));
+  }
+  work_cv_.notify_one();
+}
+
+std::future<bool> uvc_control_worker::submit(uint64_t key, operation op) {
+  auto promise = std::make_shared<std::promise<bool>>();
+  auto result = promise->get_future();
+  submit(key, std::move(op), [promise](bool ok) { promise->set_value(ok); });
+  return result;
+}
+
+void uvc_control_worker::set_pu(ru_option opt, int32_t value, completion done) {
+  auto dev = dev_;
+  submit(KEY_PU | (uint32_t)opt, [dev, opt, value]() {
+    return dev->set_pu(opt, value);
+  }, std::move(done));
+}
+
+std::future<bool> uvc_control_worker::set_pu(ru_option opt, int32_t value) {
+  auto dev = dev_;
+  return submit(KEY_PU | (uint32_t)opt, [dev, opt, value]() {
+    return dev->set_pu(opt, value);
+  });
+}
+
+void uvc_control_worker::set_xu(
+  const extension_unit& xu, uint8_t ctrl, const uint8_t* data, int len, completion done
+) {
+  auto dev = dev_;
+  vector<uint8_t> bytes(data, data + len);
+  submit(xu_key(xu, ctrl), [dev, xu, ctrl, bytes]() {
+    return dev->set_xu(xu, ctrl, bytes.data(), (int)bytes.size());
+  }, std::move(done));
+}
+
+std::future<bool> uvc_control_worker::set_xu(
+  const extension_unit& xu, uint8_t ctrl, const uint8_t* data, int len
+) {
+  auto dev = dev_;
+  vector<uint8_t> bytes(data, data + len);
+  return submit(xu_key(xu, ctrl), [dev, xu, ctrl, bytes]() {
+    return dev->set_xu(xu, ctrl, bytes.data(), (int)bytes.size());
+  });
+}
+
+std::future<int32_t> uvc_control_worker::get_pu(ru_option opt) {
+  auto dev = dev_;
+  auto promise = std::make_shared<std::promise<int32_t>>();
+  auto result = promise->get_future();
+  auto value = std::make_shared<int32_t>(0);
+  submit(0, [dev, opt, value]() {
+    return dev->get_pu(opt, *value);
+  }, [promise, value, opt](bool ok) {
+    if (ok) {
+      promise->set_value(*value);
+    } else {
+      promise->set_exception(std::make_exception_ptr(
+        io_exception(to_string() << "get_pu(" << (int)opt << ") failed")
+      ));
+    }
+  });
+  return result;
+}
+
+std::future<vector<uint8_t>> uvc_control_worker::get_xu(
+  const extension_unit& xu, uint8_t ctrl, int len
+) {
+  auto dev = dev_;
+  auto promise = std::make_shared<std::promise<vector<uint8_t>>>();
+  auto result = promise->get_future();
+  auto data = std::make_shared<vector<uint8_t>>(len);
+  submit(0, [dev, xu, ctrl, data]() {
+    return dev->get_xu(xu, ctrl, data->data(), (int)data->size());
+  }, [promise, data, ctrl](bool ok) {
+    if (ok) {
+      promise->set_value(std::move(*data));
+    } else {
+      promise->set_exception(std::make_exception_ptr(
+        io_exception(to_string() << "get_xu(" << (int)ctrl << ") failed")
+      ));
+    }
+  });
+  return result;
+}
+
+size_t uvc_control_worker::queue_depth() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return queue_.size();
+}
+
+uint64_t uvc_control_worker::coalesced_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return coalesced_;
+}
+
+void uvc_control_worker::wait_idle() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_cv_.wait(lock, [this]() { return ((queue_.empty() && !busy_) || stop_); });
+}
+
+} // end librealuvc
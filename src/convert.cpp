@@ -0,0 +1,665 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+#include "convert.h"
+#include <librealuvc/ru_convert.h>
+#include <librealuvc/ru_exception.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define RU_CONVERT_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define RU_CONVERT_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(RU_CONVERT_X86) && defined(__GNUC__)
+#define RU_TARGET(isa) __attribute__((target(isa)))
+#else
+#define RU_TARGET(isa)
+#endif
+
+namespace librealuvc {
+
+namespace { // anon
+
+// Fixed-point BT.601 coefficients, scaled by 2^14
+constexpr int COEF_RV = 22987;
+constexpr int COEF_GU = -5636;
+constexpr int COEF_GV = -11698;
+constexpr int COEF_BU = 29049;
+
+inline uint8_t sat(int i) {
+  return (uint8_t)((i >= 255) ? 255 : ((i < 0) ? 0 : i));
+}
+
+// Portable kernels, also used for the tail of each SIMD row
+
+template<int LAYOUT, int ORDER>
+void rgb_row_scalar(const uint8_t* src, uint8_t* dst, int npix) {
+  const int yoff = ((LAYOUT == YUV422_YUYV) ? 0 : 1);
+  const int uoff = ((LAYOUT == YUV422_YUYV) ? 1 : 0);
+  for (int j = 0; j+2 <= npix; j += 2, src += 4, dst += 6) {
+    int u = src[uoff] - 128;
+    int v = src[uoff+2] - 128;
+    int r = (COEF_RV * v) >> 14;
+    int g = (COEF_GU * u + COEF_GV * v) >> 14;
+    int b = (COEF_BU * u) >> 14;
+    int c0 = ((ORDER == ORDER_BGR) ? b : r);
+    int c2 = ((ORDER == ORDER_BGR) ? r : b);
+    dst[0] = sat(src[yoff] + c0);
+    dst[1] = sat(src[yoff] + g);
+    dst[2] = sat(src[yoff] + c2);
+    dst[3] = sat(src[yoff+2] + c0);
+    dst[4] = sat(src[yoff+2] + g);
+    dst[5] = sat(src[yoff+2] + c2);
+  }
+}
+
+void extract_row_scalar(const uint8_t* src, uint8_t* dst, int npix, int offset) {
+  src += offset;
+  for (int j = 0; j < npix; ++j) dst[j] = src[2*j];
+}
+
+inline uint8_t sub_sat(uint8_t a, uint8_t b) {
+  return (uint8_t)((a > b) ? (a - b) : 0);
+}
+
+void deinterleave_row_scalar(
+  const uint8_t* src, const uint8_t* dark, uint8_t* dst_l, uint8_t* dst_r, int npix
+) {
+  if (dark) {
+    for (int j = 0; j < npix; ++j) {
+      uint8_t l = sub_sat(src[2*j], dark[2*j]);
+      uint8_t r = sub_sat(src[2*j+1], dark[2*j+1]);
+      dst_l[j] = l;
+      dst_r[j] = r;
+    }
+  } else {
+    for (int j = 0; j < npix; ++j) {
+      uint8_t l = src[2*j];
+      uint8_t r = src[2*j+1];
+      dst_l[j] = l;
+      dst_r[j] = r;
+    }
+  }
+}
+
+void subtract_row_scalar(uint8_t* row, const uint8_t* dark, int n) {
+  for (int j = 0; j < n; ++j) row[j] = sub_sat(row[j], dark[j]);
+}
+
+int find_at_least_row_scalar(const uint8_t* row, int n, int start, uint8_t threshold) {
+  for (int j = start; j < n; ++j) {
+    if (row[j] >= threshold) return j;
+  }
+  return n;
+}
+
+uint8_t max_row_scalar(const uint8_t* row, int n) {
+  uint8_t best = 0;
+  for (int j = 0; j < n; ++j) best = std::max(best, row[j]);
+  return best;
+}
+
+void unpack_y10p_row_scalar(const uint8_t* src, uint16_t* dst, int npix) {
+  int j = 0;
+  for (; j+4 <= npix; j += 4, src += 5, dst += 4) {
+    uint8_t low = src[4];
+    dst[0] = (uint16_t)((src[0] << 2) | (low & 3));
+    dst[1] = (uint16_t)((src[1] << 2) | ((low >> 2) & 3));
+    dst[2] = (uint16_t)((src[2] << 2) | ((low >> 4) & 3));
+    dst[3] = (uint16_t)((src[3] << 2) | (low >> 6));
+  }
+  // The padded last group keeps its low bits in the fifth byte
+  if (j < npix) {
+    uint8_t low = src[4];
+    for (int k = 0; k < npix - j; ++k) {
+      dst[k] = (uint16_t)((src[k] << 2) | ((low >> (2*k)) & 3));
+    }
+  }
+}
+
+typedef void (*rgb_row_fn)(const uint8_t*, uint8_t*, int);
+typedef void (*extract_row_fn)(const uint8_t*, uint8_t*, int, int);
+typedef void (*deinterleave_row_fn)(const uint8_t*, const uint8_t*, uint8_t*, uint8_t*, int);
+typedef void (*subtract_row_fn)(uint8_t*, const uint8_t*, int);
+typedef int (*find_at_least_row_fn)(const uint8_t*, int, int, uint8_t);
+typedef uint8_t (*max_row_fn)(const uint8_t*, int);
+typedef void (*unpack_y10p_row_fn)(const uint8_t*, uint16_t*, int);
+
+#if defined(RU_CONVERT_X86)
+
+// 8 pixels from 16 bytes of YUYV/UYVY to 24 bytes of RGB/BGR.
+// madd on the (u,v) pairs gives the exact 32-bit sums the scalar code
+// shifts, and packus does the saturation.
+
+template<int LAYOUT, int ORDER>
+RU_TARGET("ssse3") inline void rgb_block8_ssse3(const uint8_t* src, uint8_t* dst) {
+  const __m128i lo_bytes = _mm_set1_epi16(0x00ff);
+  __m128i v = _mm_loadu_si128((const __m128i*)src);
+  __m128i y = ((LAYOUT == YUV422_YUYV) ? _mm_and_si128(v, lo_bytes) : _mm_srli_epi16(v, 8));
+  __m128i uv = ((LAYOUT == YUV422_YUYV) ? _mm_srli_epi16(v, 8) : _mm_and_si128(v, lo_bytes));
+  uv = _mm_sub_epi16(uv, _mm_set1_epi16(128));
+  __m128i r4 = _mm_srai_epi32(_mm_madd_epi16(uv, _mm_set1_epi32(COEF_RV << 16)), 14);
+  __m128i g4 = _mm_srai_epi32(_mm_madd_epi16(uv,
+    _mm_set1_epi32((int)(((uint32_t)(uint16_t)COEF_GV << 16) | (uint16_t)COEF_GU))), 14);
+  __m128i b4 = _mm_srai_epi32(_mm_madd_epi16(uv, _mm_set1_epi32(COEF_BU)), 14);
+  __m128i rg = _mm_packs_epi32(r4, g4);
+  __m128i bb = _mm_packs_epi32(b4, b4);
+  // each chroma term covers 2 pixels
+  const __m128i dup_lo = _mm_setr_epi8(0,1,0,1, 2,3,2,3, 4,5,4,5, 6,7,6,7);
+  const __m128i dup_hi = _mm_setr_epi8(8,9,8,9, 10,11,10,11, 12,13,12,13, 14,15,14,15);
+  __m128i r = _mm_add_epi16(y, _mm_shuffle_epi8(rg, dup_lo));
+  __m128i g = _mm_add_epi16(y, _mm_shuffle_epi8(rg, dup_hi));
+  __m128i b = _mm_add_epi16(y, _mm_shuffle_epi8(bb, dup_lo));
+  __m128i c01 = _mm_packus_epi16(((ORDER == ORDER_BGR) ? b : r), g);
+  __m128i c22 = _mm_packus_epi16(((ORDER == ORDER_BGR) ? r : b), g);
+  const __m128i s01a = _mm_setr_epi8(0,8,-1, 1,9,-1, 2,10,-1, 3,11,-1, 4,12,-1, 5);
+  const __m128i s2a  = _mm_setr_epi8(-1,-1,0, -1,-1,1, -1,-1,2, -1,-1,3, -1,-1,4, -1);
+  const __m128i s01b = _mm_setr_epi8(13,-1, 6,14,-1, 7,15,-1, -1,-1,-1,-1,-1,-1,-1,-1);
+  const __m128i s2b  = _mm_setr_epi8(-1,5, -1,-1,6, -1,-1,7, -1,-1,-1,-1,-1,-1,-1,-1);
+  __m128i out0 = _mm_or_si128(_mm_shuffle_epi8(c01, s01a), _mm_shuffle_epi8(c22, s2a));
+  __m128i out1 = _mm_or_si128(_mm_shuffle_epi8(c01, s01b), _mm_shuffle_epi8(c22, s2b));
+  _mm_storeu_si128((__m128i*)dst, out0);
+  _mm_storel_epi64((__m128i*)(dst+16), out1);
+}
+
+template<int LAYOUT, int ORDER>
+RU_TARGET("ssse3") void rgb_row_ssse3(const uint8_t* src, uint8_t* dst, int npix) {
+  int j = 0;
+  for (; j+8 <= npix; j += 8) {
+    rgb_block8_ssse3<LAYOUT, ORDER>(src + 2*j, dst + 3*j);
+  }
+  rgb_row_scalar<LAYOUT, ORDER>(src + 2*j, dst + 3*j, npix - j);
+}
+
+// The same steps on 16 pixels; every instruction used works within a
+// 128-bit lane, so each lane produces 24 output bytes.
+template<int LAYOUT, int ORDER>
+RU_TARGET("avx2") void rgb_row_avx2(const uint8_t* src, uint8_t* dst, int npix) {
+  const __m256i lo_bytes = _mm256_set1_epi16(0x00ff);
+  const __m256i bias = _mm256_set1_epi16(128);
+  const __m256i k_r = _mm256_set1_epi32(COEF_RV << 16);
+  const __m256i k_g = _mm256_set1_epi32((int)(((uint32_t)(uint16_t)COEF_GV << 16) | (uint16_t)COEF_GU));
+  const __m256i k_b = _mm256_set1_epi32(COEF_BU);
+  const __m256i dup_lo = _mm256_setr_epi8(
+    0,1,0,1, 2,3,2,3, 4,5,4,5, 6,7,6,7,
+    0,1,0,1, 2,3,2,3, 4,5,4,5, 6,7,6,7);
+  const __m256i dup_hi = _mm256_setr_epi8(
+    8,9,8,9, 10,11,10,11, 12,13,12,13, 14,15,14,15,
+    8,9,8,9, 10,11,10,11, 12,13,12,13, 14,15,14,15);
+  const __m256i s01a = _mm256_setr_epi8(
+    0,8,-1, 1,9,-1, 2,10,-1, 3,11,-1, 4,12,-1, 5,
+    0,8,-1, 1,9,-1, 2,10,-1, 3,11,-1, 4,12,-1, 5);
+  const __m256i s2a = _mm256_setr_epi8(
+    -1,-1,0, -1,-1,1, -1,-1,2, -1,-1,3, -1,-1,4, -1,
+    -1,-1,0, -1,-1,1, -1,-1,2, -1,-1,3, -1,-1,4, -1);
+  const __m256i s01b = _mm256_setr_epi8(
+    13,-1, 6,14,-1, 7,15,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    13,-1, 6,14,-1, 7,15,-1, -1,-1,-1,-1,-1,-1,-1,-1);
+  const __m256i s2b = _mm256_setr_epi8(
+    -1,5, -1,-1,6, -1,-1,7, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,5, -1,-1,6, -1,-1,7, -1,-1,-1,-1,-1,-1,-1,-1);
+  int j = 0;
+  for (; j+16 <= npix; j += 16) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(src + 2*j));
+    __m256i y = ((LAYOUT == YUV422_YUYV) ? _mm256_and_si256(v, lo_bytes) : _mm256_srli_epi16(v, 8));
+    __m256i uv = ((LAYOUT == YUV422_YUYV) ? _mm256_srli_epi16(v, 8) : _mm256_and_si256(v, lo_bytes));
+    uv = _mm256_sub_epi16(uv, bias);
+    __m256i r4 = _mm256_srai_epi32(_mm256_madd_epi16(uv, k_r), 14);
+    __m256i g4 = _mm256_srai_epi32(_mm256_madd_epi16(uv, k_g), 14);
+    __m256i b4 = _mm256_srai_epi32(_mm256_madd_epi16(uv, k_b), 14);
+    __m256i rg = _mm256_packs_epi32(r4, g4);
+    __m256i bb = _mm256_packs_epi32(b4, b4);
+    __m256i r = _mm256_add_epi16(y, _mm256_shuffle_epi8(rg, dup_lo));
+    __m256i g = _mm256_add_epi16(y, _mm256_shuffle_epi8(rg, dup_hi));
+    __m256i b = _mm256_add_epi16(y, _mm256_shuffle_epi8(bb, dup_lo));
+    __m256i c01 = _mm256_packus_epi16(((ORDER == ORDER_BGR) ? b : r), g);
+    __m256i c22 = _mm256_packus_epi16(((ORDER == ORDER_BGR) ? r : b), g);
+    __m256i out0 = _mm256_or_si256(_mm256_shuffle_epi8(c01, s01a), _mm256_shuffle_epi8(c22, s2a));
+    __m256i out1 = _mm256_or_si256(_mm256_shuffle_epi8(c01, s01b), _mm256_shuffle_epi8(c22, s2b));
+    uint8_t* d = dst + 3*j;
+    _mm_storeu_si128((__m128i*)d, _mm256_castsi256_si128(out0));
+    _mm_storel_epi64((__m128i*)(d+16), _mm256_castsi256_si128(out1));
+    _mm_storeu_si128((__m128i*)(d+24), _mm256_extracti128_si256(out0, 1));
+    _mm_storel_epi64((__m128i*)(d+40), _mm256_extracti128_si256(out1, 1));
+  }
+  rgb_row_scalar<LAYOUT, ORDER>(src + 2*j, dst + 3*j, npix - j);
+}
+
+void extract_row_sse2(const uint8_t* src, uint8_t* dst, int npix, int offset) {
+  const __m128i lo_bytes = _mm_set1_epi16(0x00ff);
+  int j = 0;
+  for (; j+16 <= npix; j += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(src + 2*j));
+    __m128i b = _mm_loadu_si128((const __m128i*)(src + 2*j + 16));
+    if (offset == 0) {
+      a = _mm_and_si128(a, lo_bytes);
+      b = _mm_and_si128(b, lo_bytes);
+    } else {
+      a = _mm_srli_epi16(a, 8);
+      b = _mm_srli_epi16(b, 8);
+    }
+    _mm_storeu_si128((__m128i*)(dst + j), _mm_packus_epi16(a, b));
+  }
+  extract_row_scalar(src + 2*j, dst + j, npix - j, offset);
+}
+
+// 8 pixels from each 10 bytes: pshufb spreads the high bytes and the
+// shared low-bits byte into 16-bit lanes, and a multiply by 64, 16, 4, 1
+// lines each pixel's two low bits up under one fixed shift.
+RU_TARGET("ssse3") void unpack_y10p_row_ssse3(const uint8_t* src, uint16_t* dst, int npix) {
+  const __m128i hi_index = _mm_setr_epi8(0,-1, 1,-1, 2,-1, 3,-1, 5,-1, 6,-1, 7,-1, 8,-1);
+  const __m128i lo_index = _mm_setr_epi8(4,-1, 4,-1, 4,-1, 4,-1, 9,-1, 9,-1, 9,-1, 9,-1);
+  const __m128i lo_mul = _mm_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1);
+  const __m128i three = _mm_set1_epi16(3);
+  int j = 0;
+  // 16 bytes are loaded for every 10 used, so stop short of the row end
+  for (; j+16 <= npix; j += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + 5*j/4));
+    __m128i hi = _mm_slli_epi16(_mm_shuffle_epi8(v, hi_index), 2);
+    __m128i lo = _mm_mullo_epi16(_mm_shuffle_epi8(v, lo_index), lo_mul);
+    lo = _mm_and_si128(_mm_srli_epi16(lo, 6), three);
+    _mm_storeu_si128((__m128i*)(dst + j), _mm_or_si128(hi, lo));
+  }
+  unpack_y10p_row_scalar(src + 5*j/4, dst + j, npix - j);
+}
+
+// Both 16-byte loads happen before the store to dst_l, so dst_l == src works
+void deinterleave_row_sse2(
+  const uint8_t* src, const uint8_t* dark, uint8_t* dst_l, uint8_t* dst_r, int npix
+) {
+  const __m128i lo_bytes = _mm_set1_epi16(0x00ff);
+  int j = 0;
+  for (; j+16 <= npix; j += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(src + 2*j));
+    __m128i b = _mm_loadu_si128((const __m128i*)(src + 2*j + 16));
+    if (dark) {
+      a = _mm_subs_epu8(a, _mm_loadu_si128((const __m128i*)(dark + 2*j)));
+      b = _mm_subs_epu8(b, _mm_loadu_si128((const __m128i*)(dark + 2*j + 16)));
+    }
+    __m128i l = _mm_packus_epi16(_mm_and_si128(a, lo_bytes), _mm_and_si128(b, lo_bytes));
+    __m128i r = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+    _mm_storeu_si128((__m128i*)(dst_l + j), l);
+    _mm_storeu_si128((__m128i*)(dst_r + j), r);
+  }
+  deinterleave_row_scalar(src + 2*j, (dark ? dark + 2*j : nullptr), dst_l + j, dst_r + j, npix - j);
+}
+
+void subtract_row_sse2(uint8_t* row, const uint8_t* dark, int n) {
+  int j = 0;
+  for (; j+16 <= n; j += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(row + j));
+    __m128i d = _mm_loadu_si128((const __m128i*)(dark + j));
+    _mm_storeu_si128((__m128i*)(row + j), _mm_subs_epu8(a, d));
+  }
+  subtract_row_scalar(row + j, dark + j, n - j);
+}
+
+inline int lowest_bit(unsigned int mask) {
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return (int)index;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+int find_at_least_row_sse2(const uint8_t* row, int n, int start, uint8_t threshold) {
+  const __m128i t = _mm_set1_epi8((char)threshold);
+  int j = start;
+  for (; j+16 <= n; j += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(row + j));
+    // max(v, t) == v exactly where v >= t
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, t), v));
+    if (mask) return (j + lowest_bit((unsigned int)mask));
+  }
+  return find_at_least_row_scalar(row, n, j, threshold);
+}
+
+uint8_t max_row_sse2(const uint8_t* row, int n) {
+  __m128i best = _mm_setzero_si128();
+  int j = 0;
+  for (; j+16 <= n; j += 16) {
+    best = _mm_max_epu8(best, _mm_loadu_si128((const __m128i*)(row + j)));
+  }
+  best = _mm_max_epu8(best, _mm_srli_si128(best, 8));
+  best = _mm_max_epu8(best, _mm_srli_si128(best, 4));
+  best = _mm_max_epu8(best, _mm_srli_si128(best, 2));
+  best = _mm_max_epu8(best, _mm_srli_si128(best, 1));
+  uint8_t result = (uint8_t)_mm_cvtsi128_si32(best);
+  return std::max(result, max_row_scalar(row + j, n - j));
+}
+
+bool cpu_has(const char* isa) {
+#if defined(__GNUC__)
+  __builtin_cpu_init();
+  if (!strcmp(isa, "avx2")) return __builtin_cpu_supports("avx2");
+  return __builtin_cpu_supports("ssse3");
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  bool ssse3 = ((info[2] & (1 << 9)) != 0);
+  bool osxsave = ((info[2] & (1 << 27)) != 0);
+  if (strcmp(isa, "avx2")) return ssse3;
+  if (!osxsave || ((_xgetbv(0) & 6) != 6)) return false;
+  __cpuidex(info, 7, 0);
+  return ((info[1] & (1 << 5)) != 0);
+#else
+  return false;
+#endif
+}
+
+#endif // RU_CONVERT_X86
+
+#if defined(RU_CONVERT_NEON)
+
+// vld4 splits 8 macropixels into Y0/U/Y1/V planes; even and odd pixels
+// are computed separately and zipped back together for vst3.
+template<int LAYOUT, int ORDER>
+void rgb_row_neon(const uint8_t* src, uint8_t* dst, int npix) {
+  const uint8x8_t bias = vdup_n_u8(128);
+  int j = 0;
+  for (; j+16 <= npix; j += 16) {
+    uint8x8x4_t p = vld4_u8(src + 2*j);
+    uint8x8_t y0 = p.val[(LAYOUT == YUV422_YUYV) ? 0 : 1];
+    uint8x8_t y1 = p.val[(LAYOUT == YUV422_YUYV) ? 2 : 3];
+    int16x8_t u = vreinterpretq_s16_u16(vsubl_u8(p.val[(LAYOUT == YUV422_YUYV) ? 1 : 0], bias));
+    int16x8_t v = vreinterpretq_s16_u16(vsubl_u8(p.val[(LAYOUT == YUV422_YUYV) ? 3 : 2], bias));
+    int16x8_t r = vcombine_s16(
+      vshrn_n_s32(vmull_n_s16(vget_low_s16(v), COEF_RV), 14),
+      vshrn_n_s32(vmull_n_s16(vget_high_s16(v), COEF_RV), 14));
+    int16x8_t g = vcombine_s16(
+      vshrn_n_s32(vmlal_n_s16(vmull_n_s16(vget_low_s16(u), COEF_GU), vget_low_s16(v), COEF_GV), 14),
+      vshrn_n_s32(vmlal_n_s16(vmull_n_s16(vget_high_s16(u), COEF_GU), vget_high_s16(v), COEF_GV), 14));
+    int16x8_t b = vcombine_s16(
+      vshrn_n_s32(vmull_n_s16(vget_low_s16(u), COEF_BU), 14),
+      vshrn_n_s32(vmull_n_s16(vget_high_s16(u), COEF_BU), 14));
+    int16x8_t ye = vreinterpretq_s16_u16(vmovl_u8(y0));
+    int16x8_t yo = vreinterpretq_s16_u16(vmovl_u8(y1));
+    uint8x8x2_t rz = vzip_u8(vqmovun_s16(vaddq_s16(ye, r)), vqmovun_s16(vaddq_s16(yo, r)));
+    uint8x8x2_t gz = vzip_u8(vqmovun_s16(vaddq_s16(ye, g)), vqmovun_s16(vaddq_s16(yo, g)));
+    uint8x8x2_t bz = vzip_u8(vqmovun_s16(vaddq_s16(ye, b)), vqmovun_s16(vaddq_s16(yo, b)));
+    uint8x16_t rr = vcombine_u8(rz.val[0], rz.val[1]);
+    uint8x16_t bb = vcombine_u8(bz.val[0], bz.val[1]);
+    uint8x16x3_t out;
+    out.val[0] = ((ORDER == ORDER_BGR) ? bb : rr);
+    out.val[1] = vcombine_u8(gz.val[0], gz.val[1]);
+    out.val[2] = ((ORDER == ORDER_BGR) ? rr : bb);
+    vst3q_u8(dst + 3*j, out);
+  }
+  rgb_row_scalar<LAYOUT, ORDER>(src + 2*j, dst + 3*j, npix - j);
+}
+
+void extract_row_neon(const uint8_t* src, uint8_t* dst, int npix, int offset) {
+  int j = 0;
+  for (; j+16 <= npix; j += 16) {
+    uint8x16x2_t p = vld2q_u8(src + 2*j);
+    vst1q_u8(dst + j, p.val[offset]);
+  }
+  extract_row_scalar(src + 2*j, dst + j, npix - j, offset);
+}
+
+void deinterleave_row_neon(
+  const uint8_t* src, const uint8_t* dark, uint8_t* dst_l, uint8_t* dst_r, int npix
+) {
+  int j = 0;
+  for (; j+16 <= npix; j += 16) {
+    uint8x16x2_t p = vld2q_u8(src + 2*j);
+    if (dark) {
+      uint8x16x2_t d = vld2q_u8(dark + 2*j);
+      p.val[0] = vqsubq_u8(p.val[0], d.val[0]);
+      p.val[1] = vqsubq_u8(p.val[1], d.val[1]);
+    }
+    vst1q_u8(dst_l + j, p.val[0]);
+    vst1q_u8(dst_r + j, p.val[1]);
+  }
+  deinterleave_row_scalar(src + 2*j, (dark ? dark + 2*j : nullptr), dst_l + j, dst_r + j, npix - j);
+}
+
+void subtract_row_neon(uint8_t* row, const uint8_t* dark, int n) {
+  int j = 0;
+  for (; j+16 <= n; j += 16) {
+    vst1q_u8(row + j, vqsubq_u8(vld1q_u8(row + j), vld1q_u8(dark + j)));
+  }
+  subtract_row_scalar(row + j, dark + j, n - j);
+}
+
+int find_at_least_row_neon(const uint8_t* row, int n, int start, uint8_t threshold) {
+  const uint8x16_t t = vdupq_n_u8(threshold);
+  int j = start;
+  for (; j+16 <= n; j += 16) {
+    uint64x2_t ge = vreinterpretq_u64_u8(vcgeq_u8(vld1q_u8(row + j), t));
+    if (vgetq_lane_u64(ge, 0) | vgetq_lane_u64(ge, 1)) break;
+  }
+  return find_at_least_row_scalar(row, n, j, threshold);
+}
+
+uint8_t max_row_neon(const uint8_t* row, int n) {
+  uint8x16_t best = vdupq_n_u8(0);
+  int j = 0;
+  for (; j+16 <= n; j += 16) best = vmaxq_u8(best, vld1q_u8(row + j));
+  uint8x8_t half = vmax_u8(vget_low_u8(best), vget_high_u8(best));
+  half = vpmax_u8(half, half);
+  half = vpmax_u8(half, half);
+  half = vpmax_u8(half, half);
+  return std::max(vget_lane_u8(half, 0), max_row_scalar(row + j, n - j));
+}
+
+#endif // RU_CONVERT_NEON
+
+struct kernel_set {
+  const char* name;
+  rgb_row_fn rgb[2][2]; // [layout][order]
+  extract_row_fn extract;
+  deinterleave_row_fn deinterleave;
+  subtract_row_fn subtract;
+  find_at_least_row_fn find_at_least;
+  max_row_fn max;
+  unpack_y10p_row_fn unpack_y10p;
+};
+
+#define RU_RGB_KERNELS(fn) { \
+  { fn<YUV422_YUYV, ORDER_RGB>, fn<YUV422_YUYV, ORDER_BGR> }, \
+  { fn<YUV422_UYVY, ORDER_RGB>, fn<YUV422_UYVY, ORDER_BGR> } \
+}
+
+const kernel_set scalar_kernels = { "scalar", RU_RGB_KERNELS(rgb_row_scalar), extract_row_scalar,
+  deinterleave_row_scalar, subtract_row_scalar, find_at_least_row_scalar, max_row_scalar,
+  unpack_y10p_row_scalar };
+
+const kernel_set* pick_kernels() {
+#if defined(RU_CONVERT_X86)
+  static const kernel_set avx2_kernels = { "avx2", RU_RGB_KERNELS(rgb_row_avx2), extract_row_sse2,
+    deinterleave_row_sse2, subtract_row_sse2, find_at_least_row_sse2, max_row_sse2,
+    unpack_y10p_row_ssse3 };
+  static const kernel_set ssse3_kernels = { "ssse3", RU_RGB_KERNELS(rgb_row_ssse3), extract_row_sse2,
+    deinterleave_row_sse2, subtract_row_sse2, find_at_least_row_sse2, max_row_sse2,
+    unpack_y10p_row_ssse3 };
+  if (cpu_has("avx2")) return &avx2_kernels;
+  if (cpu_has("ssse3")) return &ssse3_kernels;
+#elif defined(RU_CONVERT_NEON)
+  static const kernel_set neon_kernels = { "neon", RU_RGB_KERNELS(rgb_row_neon), extract_row_neon,
+    deinterleave_row_neon, subtract_row_neon, find_at_least_row_neon, max_row_neon,
+    unpack_y10p_row_scalar };
+  return &neon_kernels;
+#endif
+  return &scalar_kernels;
+}
+
+std::atomic<bool> force_scalar(false);
+std::atomic<int> parallel_min_pixels(640*480);
+std::atomic<int> parallel_band_rows(32);
+
+const kernel_set* kernels() {
+  static const kernel_set* best = pick_kernels();
+  return (force_scalar.load(std::memory_order_relaxed) ? &scalar_kernels : best);
+}
+
+void convert_mat(const cv::Mat& src, cv::Mat& dst, yuv422_layout layout, rgb_order order) {
+  if ((src.type() != CV_8UC2) || (src.dims != 2)) {
+    throw invalid_value_exception("YUV 4:2:2 conversion needs a CV_8UC2 source");
+  }
+  if (src.data == dst.data) {
+    throw invalid_value_exception("YUV 4:2:2 conversion can't work in place");
+  }
+  dst.create(src.rows, src.cols, CV_8UC3);
+  auto fn = kernels()->rgb[layout][order];
+  parallel_rows(src.rows, src.cols, [&](int row_begin, int row_end) {
+    for (int row = row_begin; row < row_end; ++row) {
+      fn(src.ptr<uint8_t>(row), dst.ptr<uint8_t>(row), src.cols);
+    }
+  });
+}
+
+} // end anon
+
+void yuv422_to_rgb_row(
+  const uint8_t* src, uint8_t* dst, int npix, yuv422_layout layout, rgb_order order
+) {
+  kernels()->rgb[layout][order](src, dst, npix);
+}
+
+void yuv422_extract_row(const uint8_t* src, uint8_t* dst, int npix, int offset) {
+  kernels()->extract(src, dst, npix, offset);
+}
+
+void deinterleave_row(
+  const uint8_t* src, const uint8_t* dark, uint8_t* dst_l, uint8_t* dst_r, int npix
+) {
+  kernels()->deinterleave(src, dark, dst_l, dst_r, npix);
+}
+
+void subtract_row(uint8_t* row, const uint8_t* dark, int n) {
+  kernels()->subtract(row, dark, n);
+}
+
+int find_at_least_row(const uint8_t* row, int n, int start, uint8_t threshold) {
+  return kernels()->find_at_least(row, n, start, threshold);
+}
+
+uint8_t max_row(const uint8_t* row, int n) {
+  return kernels()->max(row, n);
+}
+
+void unpack_y10p_row(const uint8_t* src, uint16_t* dst, int npix) {
+  kernels()->unpack_y10p(src, dst, npix);
+}
+
+const char* convert_kernel_name() {
+  return kernels()->name;
+}
+
+void convert_force_scalar(bool on) {
+  force_scalar = on;
+}
+
+histogram_banks::histogram_banks() {
+  memset(bank, 0, sizeof(bank));
+}
+
+void histogram_banks::add(const uint8_t* src, int n, int step) {
+  int j = 0;
+  for (int lim = (n - 3*step); j < lim; j += 4*step) {
+    ++bank[0][src[j]];
+    ++bank[1][src[j + step]];
+    ++bank[2][src[j + 2*step]];
+    ++bank[3][src[j + 3*step]];
+  }
+  for (; j < n; j += step) ++bank[0][src[j]];
+}
+
+void histogram_banks::add_pairs(const uint8_t* src, int n, int step) {
+  int j = 0;
+  for (int lim = (n - step - 1); j < lim; j += 2*step) {
+    ++bank[0][src[j]];
+    ++bank[1][src[j + 1]];
+    ++bank[2][src[j + step]];
+    ++bank[3][src[j + step + 1]];
+  }
+  for (; j + 1 < n; j += step) {
+    ++bank[0][src[j]];
+    ++bank[1][src[j + 1]];
+  }
+}
+
+void histogram_banks::add16(const uint16_t* src, int n, int step, int shift) {
+  int j = 0;
+  for (int lim = (n - 3*step); j < lim; j += 4*step) {
+    ++bank[0][std::min(255, src[j] >> shift)];
+    ++bank[1][std::min(255, src[j + step] >> shift)];
+    ++bank[2][std::min(255, src[j + 2*step] >> shift)];
+    ++bank[3][std::min(255, src[j + 3*step] >> shift)];
+  }
+  for (; j < n; j += step) ++bank[0][std::min(255, src[j] >> shift)];
+}
+
+uint32_t histogram_banks::merge_into(uint32_t* bins) const {
+  uint32_t total = 0;
+  for (int v = 0; v < 256; ++v) {
+    uint32_t count = (bank[0][v] + bank[1][v] + bank[2][v] + bank[3][v]);
+    bins[v] += count;
+    total += count;
+  }
+  return total;
+}
+
+void parallel_rows(int rows, int cols, const std::function<void(int, int)>& fn) {
+  int band = std::max(1, parallel_band_rows.load(std::memory_order_relaxed));
+  int min_pixels = parallel_min_pixels.load(std::memory_order_relaxed);
+  int nbands = ((rows + band - 1) / band);
+  if ((nbands <= 1) || ((int64_t)rows * cols < min_pixels)) {
+    if (rows > 0) fn(0, rows);
+    return;
+  }
+  cv::parallel_for_(cv::Range(0, nbands), [&](const cv::Range& r) {
+    fn(r.start * band, std::min(rows, r.end * band));
+  }, nbands);
+}
+
+void set_convert_parallelism(int min_pixels, int band_rows) {
+  parallel_min_pixels = std::max(0, min_pixels);
+  parallel_band_rows = std::max(1, band_rows);
+}
+
+void convert_yuyv_to_bgr(const cv::Mat& src, cv::Mat& dst) {
+  convert_mat(src, dst, YUV422_YUYV, ORDER_BGR);
+}
+
+void convert_yuyv_to_rgb(const cv::Mat& src, cv::Mat& dst) {
+  convert_mat(src, dst, YUV422_YUYV, ORDER_RGB);
+}
+
+void convert_uyvy_to_bgr(const cv::Mat& src, cv::Mat& dst) {
+  convert_mat(src, dst, YUV422_UYVY, ORDER_BGR);
+}
+
+void convert_uyvy_to_rgb(const cv::Mat& src, cv::Mat& dst) {
+  convert_mat(src, dst, YUV422_UYVY, ORDER_RGB);
+}
+
+void convert_yuyv_to_gray(const cv::Mat& src, cv::Mat& dst) {
+  if ((src.type() != CV_8UC2) || (src.dims != 2)) {
+    throw invalid_value_exception("YUV 4:2:2 conversion needs a CV_8UC2 source");
+  }
+  if (src.data == dst.data) {
+    throw invalid_value_exception("YUV 4:2:2 conversion can't work in place");
+  }
+  dst.create(src.rows, src.cols, CV_8UC1);
+  auto fn = kernels()->extract;
+  parallel_rows(src.rows, src.cols, [&](int row_begin, int row_end) {
+    for (int row = row_begin; row < row_end; ++row) {
+      fn(src.ptr<uint8_t>(row), dst.ptr<uint8_t>(row), src.cols, 0);
+    }
+  });
+}
+
+} // end librealuvc
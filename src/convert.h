@@ -0,0 +1,87 @@
+#ifndef LIBREALUVC_CONVERT_H
+#define LIBREALUVC_CONVERT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace librealuvc {
+
+// Row kernels shared by the libuvc frame conversions and the public
+// cv::Mat conversions.  They use the same fixed-point coefficients as
+// libuvc (22987, -5636, -11698, 29049, >>14), so every implementation
+// gives bit-identical output.
+
+enum yuv422_layout {
+  YUV422_YUYV, // Y0 U Y1 V
+  YUV422_UYVY  // U Y0 V Y1
+};
+
+enum rgb_order {
+  ORDER_RGB,
+  ORDER_BGR
+};
+
+// Convert npix pixels (npix/2 macropixels; an odd last pixel is dropped)
+void yuv422_to_rgb_row(
+  const uint8_t* src, uint8_t* dst, int npix, yuv422_layout layout, rgb_order order
+);
+
+// Pick every 2nd byte starting at offset 0 (Y of YUYV) or 1 (U/V of YUYV)
+void yuv422_extract_row(const uint8_t* src, uint8_t* dst, int npix, int offset);
+
+// Split npix L R pixel pairs into dst_l and dst_r.  If dark isn't null
+// it is subtracted first, with saturation; it has the layout of src.
+// dst_l may be src, leaving the L pixels in the first half of the row.
+void deinterleave_row(
+  const uint8_t* src, const uint8_t* dark, uint8_t* dst_l, uint8_t* dst_r, int npix
+);
+
+// row[j] = max(row[j] - dark[j], 0)
+void subtract_row(uint8_t* row, const uint8_t* dark, int n);
+
+// First j in [start, n) with row[j] >= threshold, or n
+int find_at_least_row(const uint8_t* row, int n, int start, uint8_t threshold);
+
+// Largest of row[0, n), 0 if n is 0
+uint8_t max_row(const uint8_t* row, int n);
+
+// Unpack npix pixels of MIPI-packed 10-bit gray (RU_FOURCC_Y10P) to
+// 16-bit values 0..1023.  Each 4 pixels take 5 bytes; a partial last
+// group is padded to 5 bytes, so src holds y10p_row_bytes(npix).
+void unpack_y10p_row(const uint8_t* src, uint16_t* dst, int npix);
+
+inline size_t y10p_row_bytes(size_t npix) { return (5 * ((npix + 3) / 4)); }
+
+// Name of the kernel set picked at startup: "avx2", "ssse3", "neon" or "scalar"
+const char* convert_kernel_name();
+
+// Testing hook: use the portable kernels even if SIMD is available
+void convert_force_scalar(bool on);
+
+// Byte histogram with four banks of counters, so runs of equal pixels
+// (dark background, saturated highlights) don't serialize on one counter.
+// Keep one per band and merge at the end.
+struct histogram_banks {
+  uint32_t bank[4][256];
+
+  histogram_banks();
+  // Count src[0], src[step], src[2*step] ... below n
+  void add(const uint8_t* src, int n, int step);
+  // Count the pairs src[j], src[j+1] for j = 0, step, 2*step ... below n,
+  // so that both eyes of an interleaved L R L R row are sampled
+  void add_pairs(const uint8_t* src, int n, int step);
+  // The same for 16-bit pixels, counting min(255, src[j] >> shift)
+  void add16(const uint16_t* src, int n, int step, int shift);
+  // Add the counts into bins[256], returning how many there were
+  uint32_t merge_into(uint32_t* bins) const;
+};
+
+// Call fn(row_begin, row_end) over bands of [0, rows) on OpenCV's thread
+// pool.  Frames below the set_convert_parallelism() cutover run as a
+// single band on the calling thread.
+void parallel_rows(int rows, int cols, const std::function<void(int, int)>& fn);
+
+} // end librealuvc
+
+#endif
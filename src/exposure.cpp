@@ -0,0 +1,103 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+#include <librealuvc/ru_exposure.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace librealuvc {
+
+FrameHistogram::FrameHistogram(int sub) :
+  count(0),
+  subsample(sub) {
+  memset(bins, 0, sizeof(bins));
+}
+
+void FrameHistogram::clear() {
+  memset(bins, 0, sizeof(bins));
+  count = 0;
+}
+
+int FrameHistogram::percentile(double p) const {
+  if (count == 0) return 0;
+  double want = std::max(1.0, p * count);
+  double seen = 0;
+  for (int v = 0; v < 256; ++v) {
+    seen += bins[v];
+    if (seen >= want) return v;
+  }
+  return 255;
+}
+
+double FrameHistogram::mean() const {
+  if (count == 0) return 0.0;
+  double sum = 0;
+  for (int v = 0; v < 256; ++v) sum += (double)v * bins[v];
+  return (sum / count);
+}
+
+AutoExposureSettings::AutoExposureSettings() :
+  target(160),
+  percentile(0.95),
+  tolerance(12),
+  max_ratio(1.5),
+  min_interval(1),
+  subsample(4) {
+}
+
+AutoExposure::AutoExposure(
+  const AutoExposureSettings& settings,
+  double exposure_min, double exposure_max,
+  double gain_min, double gain_max,
+  double exposure, double gain
+) :
+  settings_(settings),
+  exposure_min_(exposure_min),
+  exposure_max_(exposure_max),
+  gain_min_(gain_min),
+  gain_max_(gain_max),
+  exposure_(exposure),
+  gain_(gain),
+  frames_since_step_(0) {
+}
+
+bool AutoExposure::update(const FrameHistogram& hist, double& exposure, double& gain) {
+  if (hist.count == 0) return false;
+  if (++frames_since_step_ < settings_.min_interval) return false;
+  double level = hist.percentile(settings_.percentile);
+  if (std::fabs(level - settings_.target) <= settings_.tolerance) return false;
+  // +1 keeps a black frame finite; the step limit does the rest
+  double max_ratio = std::max(1.01, settings_.max_ratio);
+  double ratio = ((settings_.target + 1.0) / (level + 1.0));
+  ratio = std::max(1.0 / max_ratio, std::min(max_ratio, ratio));
+  // Devices take whole numbers; gain at 0 still has to be able to move
+  double e = exposure_;
+  double g = gain_;
+  if (ratio > 1.0) {
+    double want = (e * ratio);
+    if (want <= exposure_max_) {
+      e = want;
+    } else {
+      double rest = (want / std::max(1.0, exposure_max_));
+      e = exposure_max_;
+      g = std::min(gain_max_, std::max(g, 1.0) * rest);
+    }
+  } else {
+    double want = (std::max(g, 1.0) * ratio);
+    if ((g > gain_min_) && (std::round(want) < std::round(g))) {
+      g = std::max(gain_min_, want);
+    } else {
+      e = std::max(exposure_min_, e * ratio);
+    }
+  }
+  e = std::round(std::max(exposure_min_, std::min(exposure_max_, e)));
+  g = std::round(std::max(gain_min_, std::min(gain_max_, g)));
+  if ((e == std::round(exposure_)) && (g == std::round(gain_))) return false;
+  exposure_ = exposure = e;
+  gain_ = gain = g;
+  frames_since_step_ = 0;
+  return true;
+}
+
+} // end librealuvc
@@ -0,0 +1,205 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+#include <librealuvc/ru_imu.h>
+#include <algorithm>
+#include <cmath>
+
+namespace librealuvc {
+
+namespace { // anon
+
+// How far the clock offset may creep up per second of host time
+constexpr int64_t DRIFT_PPM = 100;
+
+// Retries when the writer laps a reader mid-copy
+constexpr int READ_ATTEMPTS = 4;
+
+size_t round_up_pow2(size_t n) {
+  size_t p = 16;
+  while (p < n) p *= 2;
+  return p;
+}
+
+} // end anon
+
+imu_ring::imu_ring(size_t capacity, uint32_t device_ts_ns) :
+  mask_(round_up_pow2(capacity) - 1),
+  slots_(new slot[mask_ + 1]),
+  count_(0),
+  claimed_(0),
+  have_offset_(false),
+  offset_ns_(0),
+  offset_time_(0),
+  last_ns_(0),
+  device_ts_ns_(device_ts_ns) {
+}
+
+// Readers that saw any of the new slot contents are guaranteed to see
+// claimed_ advanced, which is how they notice they were lapped.
+void imu_ring::push(const imu_sample& s) {
+  uint64_t n = count_.load(std::memory_order_relaxed);
+  claimed_.store(n+1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot& e = slots_[n & mask_];
+  e.monotonic_ns.store(s.monotonic_ns, std::memory_order_relaxed);
+  e.device_ts.store(s.device_ts, std::memory_order_relaxed);
+  e.x.store(s.x, std::memory_order_relaxed);
+  e.y.store(s.y, std::memory_order_relaxed);
+  e.z.store(s.z, std::memory_order_relaxed);
+  count_.store(n+1, std::memory_order_release);
+}
+
+void imu_ring::push(const hid_sample_batch& batch) {
+  if ((batch.count == 0) || (batch.data_size < sizeof(hid_sensor_data))) return;
+  // The newest sample of the batch was captured no later than the read
+  auto newest = (const hid_sensor_data*)batch.sample(batch.count-1);
+  uint64_t newest_ts = (((uint64_t)newest->ts_high << 32) | newest->ts_low);
+  int64_t observed = (batch.monotonic_ns - (int64_t)(newest_ts * device_ts_ns_));
+  if (!have_offset_) {
+    have_offset_ = true;
+    offset_ns_ = observed;
+  } else {
+    int64_t creep = (((batch.monotonic_ns - offset_time_) * DRIFT_PPM) / 1000000);
+    offset_ns_ = std::min(offset_ns_ + std::max<int64_t>(creep, 0), observed);
+  }
+  offset_time_ = batch.monotonic_ns;
+  for (uint32_t j = 0; j < batch.count; ++j) {
+    auto d = (const hid_sensor_data*)batch.sample(j);
+    imu_sample s;
+    s.device_ts = (((uint64_t)d->ts_high << 32) | d->ts_low);
+    s.monotonic_ns = (int64_t)(s.device_ts * device_ts_ns_) + offset_ns_;
+    // Keep the ring sorted even when the offset estimate steps back
+    if (s.monotonic_ns <= last_ns_) s.monotonic_ns = last_ns_ + 1;
+    last_ns_ = s.monotonic_ns;
+    s.x = d->x;
+    s.y = d->y;
+    s.z = d->z;
+    push(s);
+  }
+}
+
+void imu_ring::load(uint64_t j, imu_sample& s) const {
+  const slot& e = slots_[j & mask_];
+  s.monotonic_ns = e.monotonic_ns.load(std::memory_order_relaxed);
+  s.device_ts = e.device_ts.load(std::memory_order_relaxed);
+  s.x = e.x.load(std::memory_order_relaxed);
+  s.y = e.y.load(std::memory_order_relaxed);
+  s.z = e.z.load(std::memory_order_relaxed);
+}
+
+// Call after reading slots from index first onwards
+bool imu_ring::overwritten(uint64_t first) const {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return (claimed_.load(std::memory_order_relaxed) > first + capacity());
+}
+
+// First index with monotonic_ns >= t, within the window [begin, end)
+// seen at entry.  Slots overwritten during the search can mislead it,
+// which the callers catch by checking count_ again afterwards.
+bool imu_ring::lower_bound(ru_nsec_t t, uint64_t& index, uint64_t& end) const {
+  end = count_.load(std::memory_order_acquire);
+  uint64_t lo = ((end > capacity()) ? end - capacity() : 0);
+  uint64_t hi = end;
+  if (lo == hi) return false;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (slots_[mid & mask_].monotonic_ns.load(std::memory_order_relaxed) < t) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  index = lo;
+  return true;
+}
+
+size_t imu_ring::samples_between(ru_nsec_t t0, ru_nsec_t t1, vector<imu_sample>& out) const {
+  for (int attempt = 0; attempt < READ_ATTEMPTS; ++attempt) {
+    out.clear();
+    uint64_t first = 0, end = 0;
+    if (!lower_bound(t0, first, end)) return 0;
+    imu_sample s;
+    for (uint64_t j = first; j < end; ++j) {
+      load(j, s);
+      if (s.monotonic_ns > t1) break;
+      out.push_back(s);
+    }
+    if (!overwritten(first)) return out.size();
+  }
+  out.clear();
+  return 0;
+}
+
+bool imu_ring::interpolate_at(ru_nsec_t t, imu_sample& out) const {
+  for (int attempt = 0; attempt < READ_ATTEMPTS; ++attempt) {
+    uint64_t index = 0, end = 0;
+    if (!lower_bound(t, index, end)) return false;
+    uint64_t begin = ((end > capacity()) ? end - capacity() : 0);
+    if (index >= end) return false;
+    imu_sample b;
+    load(index, b);
+    bool exact = (b.monotonic_ns == t);
+    imu_sample a = b;
+    if (!exact) {
+      if (index == begin) return false;
+      load(index-1, a);
+    }
+    if (overwritten(exact ? index : index-1)) continue;
+    if (exact) {
+      out = b;
+      return true;
+    }
+    double f = ((double)(t - a.monotonic_ns) / (double)(b.monotonic_ns - a.monotonic_ns));
+    out.monotonic_ns = t;
+    out.device_ts = a.device_ts + (uint64_t)std::llround(f * (double)(b.device_ts - a.device_ts));
+    out.x = (float)(a.x + f * (b.x - a.x));
+    out.y = (float)(a.y + f * (b.y - a.y));
+    out.z = (float)(a.z + f * (b.z - a.z));
+    return true;
+  }
+  return false;
+}
+
+bool imu_ring::latest(imu_sample& out) const {
+  for (int attempt = 0; attempt < READ_ATTEMPTS; ++attempt) {
+    uint64_t end = count_.load(std::memory_order_acquire);
+    if (end == 0) return false;
+    load(end-1, out);
+    if (!overwritten(end-1)) return true;
+  }
+  return false;
+}
+
+imu_recorder::imu_recorder(const vector<string>& sensor_names, size_t capacity) {
+  for (auto& name : sensor_names) {
+    ids_.push_back(hid_sensor_intern(name));
+    rings_.push_back(std::make_shared<imu_ring>(capacity));
+  }
+}
+
+shared_ptr<imu_ring> imu_recorder::get_ring(const string& sensor_name) const {
+  return get_ring(hid_sensor_intern(sensor_name));
+}
+
+shared_ptr<imu_ring> imu_recorder::get_ring(hid_sensor_id id) const {
+  for (size_t j = 0; j < ids_.size(); ++j) {
+    if (ids_[j] == id) return rings_[j];
+  }
+  return nullptr;
+}
+
+hid_batch_callback imu_recorder::callback() {
+  auto ids = ids_;
+  auto rings = rings_;
+  return [ids, rings](const hid_sample_batch& batch) {
+    for (size_t j = 0; j < ids.size(); ++j) {
+      if (ids[j] == batch.sensor) {
+        rings[j]->push(batch);
+        return;
+      }
+    }
+  };
+}
+
+} // end librealuvc
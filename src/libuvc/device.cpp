@@ -314,7 +314,6 @@ uvc_error_t uvc_open2(
 
   is_opened = 1;
   uvc_ref_device(dev);
-  dev->ctx->kill_handler_thread = 0;
   internal_devh = (uvc_device_handle_t *)calloc(1, sizeof(*internal_devh));
   internal_devh->dev = dev;
   internal_devh->usb_devh = usb_devh;
@@ -1562,15 +1561,12 @@ void uvc_close(uvc_device_handle_t *devh) {
   uvc_release_if(devh, devh->info->ctrl_if.bInterfaceNumber);
 
   /* If we are managing the libusb context and this is the last open device,
-   * then we need to cancel the handler thread. When we call libusb_close,
-   * it'll cause a return from the thread's libusb_handle_events call, after
-   * which the handler thread will check the flag we set and then exit. */
+   * then we release our hold on the shared event threads. libusb_close
+   * makes their libusb_handle_events call return, so the last user's stop
+   * can join them. */
+  libusb_close(devh->usb_devh);
   if (ctx->own_usb_ctx && ctx->open_devices == devh && devh->next == NULL) {
-    ctx->kill_handler_thread = 1;
-    libusb_close(devh->usb_devh);
-    ctx->handler_thread.join();
-  } else {
-    libusb_close(devh->usb_devh);
+    uvc_stop_handler_thread(ctx);
   }
 
   DL_DELETE(ctx->open_devices, devh);
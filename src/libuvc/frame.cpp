@@ -37,6 +37,7 @@
  */
 #include "libuvc.h"
 #include "libuvc_internal.h"
+#include "../convert.h"
 
 uvc_frame::uvc_frame(size_t data_size, size_t meta_size) :
   weak_pool(),
@@ -46,6 +47,7 @@ uvc_frame::uvc_frame(size_t data_size, size_t meta_size) :
   metadata_max(0),
   metadata(nullptr),
   metadata_bytes(0),
+  capture_time_ns(0),
   source(nullptr),
   library_owns_data(0)
 {
@@ -154,10 +156,6 @@ void uvc_free_frame(uvc_frame_t *frame) {
 }
 #endif
 
-static inline unsigned char sat(int i) {
-  return (unsigned char)( i >= 255 ? 255 : (i < 0 ? 0 : i));
-}
-
 /** @brief Duplicate a frame, preserving color format
  * @ingroup frame
  *
@@ -173,6 +171,7 @@ uvc_error_t uvc_duplicate_frame(uvc_frame_t *in, uvc_frame_t *out) {
   out->step = in->step;
   out->sequence = in->sequence;
   out->capture_time = in->capture_time;
+  out->capture_time_ns = in->capture_time_ns;
   out->source = in->source;
 
   memcpy(out->data, in->data, in->data_bytes);
@@ -180,81 +179,63 @@ uvc_error_t uvc_duplicate_frame(uvc_frame_t *in, uvc_frame_t *out) {
   return UVC_SUCCESS;
 }
 
-#define YUYV2RGB_2(pyuv, prgb) { \
-    float r = 1.402f * ((pyuv)[3]-128); \
-    float g = -0.34414f * ((pyuv)[1]-128) - 0.71414f * ((pyuv)[3]-128); \
-    float b = 1.772f * ((pyuv)[1]-128); \
-    (prgb)[0] = sat(pyuv[0] + r); \
-    (prgb)[1] = sat(pyuv[0] + g); \
-    (prgb)[2] = sat(pyuv[0] + b); \
-    (prgb)[3] = sat(pyuv[2] + r); \
-    (prgb)[4] = sat(pyuv[2] + g); \
-    (prgb)[5] = sat(pyuv[2] + b); \
-    }
-#define IYUYV2RGB_2(pyuv, prgb) { \
-    int r = (22987 * ((pyuv)[3] - 128)) >> 14; \
-    int g = (-5636 * ((pyuv)[1] - 128) - 11698 * ((pyuv)[3] - 128)) >> 14; \
-    int b = (29049 * ((pyuv)[1] - 128)) >> 14; \
-    (prgb)[0] = sat(*(pyuv) + r); \
-    (prgb)[1] = sat(*(pyuv) + g); \
-    (prgb)[2] = sat(*(pyuv) + b); \
-    (prgb)[3] = sat((pyuv)[2] + r); \
-    (prgb)[4] = sat((pyuv)[2] + g); \
-    (prgb)[5] = sat((pyuv)[2] + b); \
-    }
-#define IYUYV2RGB_16(pyuv, prgb) IYUYV2RGB_8(pyuv, prgb); IYUYV2RGB_8(pyuv + 16, prgb + 24);
-#define IYUYV2RGB_8(pyuv, prgb) IYUYV2RGB_4(pyuv, prgb); IYUYV2RGB_4(pyuv + 8, prgb + 12);
-#define IYUYV2RGB_4(pyuv, prgb) IYUYV2RGB_2(pyuv, prgb); IYUYV2RGB_2(pyuv + 4, prgb + 6);
-
-/** @brief Convert a frame from YUYV to RGB
- * @ingroup frame
+/** @internal
+ * @brief Run a 4:2:2 row kernel over every row of a frame
  *
- * @param in YUYV frame
- * @param out RGB frame
+ * The kernels (src/convert.cpp) pick SSSE3/AVX2/NEON at runtime and give
+ * the same output as the old fixed-point macros.  Large frames are split
+ * into row bands across OpenCV's thread pool.
  */
-uvc_error_t uvc_yuyv2rgb(uvc_frame_t *in, uvc_frame_t *out) {
-  if (in->frame_format != UVC_FRAME_FORMAT_YUYV)
+static uvc_error_t _uvc_convert_yuv422(uvc_frame_t *in, uvc_frame_t *out,
+    enum uvc_frame_format in_format, enum uvc_frame_format out_format, int out_bpp,
+    librealuvc::yuv422_layout layout, librealuvc::rgb_order order, int extract_offset) {
+  if (in->frame_format != in_format)
     return UVC_ERROR_INVALID_PARAM;
 
-  if (uvc_ensure_frame_size(out, in->width * in->height * 3) < 0)
+  if (uvc_ensure_frame_size(out, in->width * in->height * out_bpp) < 0)
     return UVC_ERROR_NO_MEM;
 
   out->width = in->width;
   out->height = in->height;
-  out->frame_format = UVC_FRAME_FORMAT_RGB;
-  out->step = in->width * 3;
+  out->frame_format = out_format;
+  out->step = in->width * out_bpp;
   out->sequence = in->sequence;
   out->capture_time = in->capture_time;
+  out->capture_time_ns = in->capture_time_ns;
   out->source = in->source;
 
-  uint8_t *pyuv = static_cast<uint8_t *>(in->data);
-  uint8_t *prgb = static_cast<uint8_t *>(out->data);
-  uint8_t *prgb_end = prgb + out->data_bytes;
-
-  while (prgb < prgb_end) {
-    IYUYV2RGB_8(pyuv, prgb);
-
-    prgb += 3 * 8;
-    pyuv += 2 * 8;
-  }
+  size_t in_step = (in->step ? in->step : in->width * 2);
+  size_t out_step = out->step;
+  int width = in->width;
+  const uint8_t *in_data = static_cast<const uint8_t *>(in->data);
+  uint8_t *out_data = static_cast<uint8_t *>(out->data);
+
+  librealuvc::parallel_rows(in->height, width, [&](int row_begin, int row_end) {
+    const uint8_t *pyuv = in_data + row_begin * in_step;
+    uint8_t *pout = out_data + row_begin * out_step;
+    for (int row = row_begin; row < row_end; ++row) {
+      if (out_bpp == 3)
+        librealuvc::yuv422_to_rgb_row(pyuv, pout, width, layout, order);
+      else
+        librealuvc::yuv422_extract_row(pyuv, pout, width, extract_offset);
+      pyuv += in_step;
+      pout += out_step;
+    }
+  });
 
   return UVC_SUCCESS;
 }
 
-#define IYUYV2BGR_2(pyuv, pbgr) { \
-    int r = (22987 * ((pyuv)[3] - 128)) >> 14; \
-    int g = (-5636 * ((pyuv)[1] - 128) - 11698 * ((pyuv)[3] - 128)) >> 14; \
-    int b = (29049 * ((pyuv)[1] - 128)) >> 14; \
-    (pbgr)[0] = sat(*(pyuv) + b); \
-    (pbgr)[1] = sat(*(pyuv) + g); \
-    (pbgr)[2] = sat(*(pyuv) + r); \
-    (pbgr)[3] = sat((pyuv)[2] + b); \
-    (pbgr)[4] = sat((pyuv)[2] + g); \
-    (pbgr)[5] = sat((pyuv)[2] + r); \
-    }
-#define IYUYV2BGR_16(pyuv, pbgr) IYUYV2BGR_8(pyuv, pbgr); IYUYV2BGR_8(pyuv + 16, pbgr + 24);
-#define IYUYV2BGR_8(pyuv, pbgr) IYUYV2BGR_4(pyuv, pbgr); IYUYV2BGR_4(pyuv + 8, pbgr + 12);
-#define IYUYV2BGR_4(pyuv, pbgr) IYUYV2BGR_2(pyuv, pbgr); IYUYV2BGR_2(pyuv + 4, pbgr + 6);
+/** @brief Convert a frame from YUYV to RGB
+ * @ingroup frame
+ *
+ * @param in YUYV frame
+ * @param out RGB frame
+ */
+uvc_error_t uvc_yuyv2rgb(uvc_frame_t *in, uvc_frame_t *out) {
+  return _uvc_convert_yuv422(in, out, UVC_FRAME_FORMAT_YUYV, UVC_FRAME_FORMAT_RGB, 3,
+      librealuvc::YUV422_YUYV, librealuvc::ORDER_RGB, 0);
+}
 
 /** @brief Convert a frame from YUYV to BGR
  * @ingroup frame
@@ -263,38 +244,10 @@ uvc_error_t uvc_yuyv2rgb(uvc_frame_t *in, uvc_frame_t *out) {
  * @param out BGR frame
  */
 uvc_error_t uvc_yuyv2bgr(uvc_frame_t *in, uvc_frame_t *out) {
-  if (in->frame_format != UVC_FRAME_FORMAT_YUYV)
-    return UVC_ERROR_INVALID_PARAM;
-
-  if (uvc_ensure_frame_size(out, in->width * in->height * 3) < 0)
-    return UVC_ERROR_NO_MEM;
-
-  out->width = in->width;
-  out->height = in->height;
-  out->frame_format = UVC_FRAME_FORMAT_BGR;
-  out->step = in->width * 3;
-  out->sequence = in->sequence;
-  out->capture_time = in->capture_time;
-  out->source = in->source;
-
-  uint8_t *pyuv = static_cast<uint8_t *>(in->data);
-  uint8_t *pbgr = static_cast<uint8_t *>(out->data);
-  uint8_t *pbgr_end = pbgr + out->data_bytes;
-
-  while (pbgr < pbgr_end) {
-    IYUYV2BGR_8(pyuv, pbgr);
-
-    pbgr += 3 * 8;
-    pyuv += 2 * 8;
-  }
-
-  return UVC_SUCCESS;
+  return _uvc_convert_yuv422(in, out, UVC_FRAME_FORMAT_YUYV, UVC_FRAME_FORMAT_BGR, 3,
+      librealuvc::YUV422_YUYV, librealuvc::ORDER_BGR, 0);
 }
 
-#define IYUYV2Y(pyuv, py) { \
-    (py)[0] = (pyuv[0]); \
-    }
-
 /** @brief Convert a frame from YUYV to Y (GRAY8)
  * @ingroup frame
  *
@@ -302,38 +255,10 @@ uvc_error_t uvc_yuyv2bgr(uvc_frame_t *in, uvc_frame_t *out) {
  * @param out GRAY8 frame
  */
 uvc_error_t uvc_yuyv2y(uvc_frame_t *in, uvc_frame_t *out) {
-  if (in->frame_format != UVC_FRAME_FORMAT_YUYV)
-    return UVC_ERROR_INVALID_PARAM;
-
-  if (uvc_ensure_frame_size(out, in->width * in->height) < 0)
-    return UVC_ERROR_NO_MEM;
-
-  out->width = in->width;
-  out->height = in->height;
-  out->frame_format = UVC_FRAME_FORMAT_GRAY8;
-  out->step = in->width;
-  out->sequence = in->sequence;
-  out->capture_time = in->capture_time;
-  out->source = in->source;
-
-  uint8_t *pyuv = static_cast<uint8_t *>(in->data);
-  uint8_t *py = static_cast<uint8_t *>(out->data);
-  uint8_t *py_end = py + out->data_bytes;
-
-  while (py < py_end) {
-    IYUYV2Y(pyuv, py);
-
-    py += 1;
-    pyuv += 2;
-  }
-
-  return UVC_SUCCESS;
+  return _uvc_convert_yuv422(in, out, UVC_FRAME_FORMAT_YUYV, UVC_FRAME_FORMAT_GRAY8, 1,
+      librealuvc::YUV422_YUYV, librealuvc::ORDER_RGB, 0);
 }
 
-#define IYUYV2UV(pyuv, puv) { \
-    (puv)[0] = (pyuv[1]); \
-    }
-
 /** @brief Convert a frame from YUYV to UV (GRAY8)
  * @ingroup frame
  *
@@ -341,130 +266,28 @@ uvc_error_t uvc_yuyv2y(uvc_frame_t *in, uvc_frame_t *out) {
  * @param out GRAY8 frame
  */
 uvc_error_t uvc_yuyv2uv(uvc_frame_t *in, uvc_frame_t *out) {
-  if (in->frame_format != UVC_FRAME_FORMAT_YUYV)
-    return UVC_ERROR_INVALID_PARAM;
-
-  if (uvc_ensure_frame_size(out, in->width * in->height) < 0)
-    return UVC_ERROR_NO_MEM;
-
-  out->width = in->width;
-  out->height = in->height;
-  out->frame_format = UVC_FRAME_FORMAT_GRAY8;
-  out->step = in->width;
-  out->sequence = in->sequence;
-  out->capture_time = in->capture_time;
-  out->source = in->source;
-
-  uint8_t *pyuv = static_cast<uint8_t *>(in->data);
-  uint8_t *puv = static_cast<uint8_t *>(out->data);
-  uint8_t *puv_end = puv + out->data_bytes;
-
-  while (puv < puv_end) {
-    IYUYV2UV(pyuv, puv);
-
-    puv += 1;
-    pyuv += 2;
-  }
-
-  return UVC_SUCCESS;
+  return _uvc_convert_yuv422(in, out, UVC_FRAME_FORMAT_YUYV, UVC_FRAME_FORMAT_GRAY8, 1,
+      librealuvc::YUV422_YUYV, librealuvc::ORDER_RGB, 1);
 }
 
-#define IUYVY2RGB_2(pyuv, prgb) { \
-    int r = (22987 * ((pyuv)[2] - 128)) >> 14; \
-    int g = (-5636 * ((pyuv)[0] - 128) - 11698 * ((pyuv)[2] - 128)) >> 14; \
-    int b = (29049 * ((pyuv)[0] - 128)) >> 14; \
-    (prgb)[0] = sat((pyuv)[1] + r); \
-    (prgb)[1] = sat((pyuv)[1] + g); \
-    (prgb)[2] = sat((pyuv)[1] + b); \
-    (prgb)[3] = sat((pyuv)[3] + r); \
-    (prgb)[4] = sat((pyuv)[3] + g); \
-    (prgb)[5] = sat((pyuv)[3] + b); \
-    }
-#define IUYVY2RGB_16(pyuv, prgb) IUYVY2RGB_8(pyuv, prgb); IUYVY2RGB_8(pyuv + 16, prgb + 24);
-#define IUYVY2RGB_8(pyuv, prgb) IUYVY2RGB_4(pyuv, prgb); IUYVY2RGB_4(pyuv + 8, prgb + 12);
-#define IUYVY2RGB_4(pyuv, prgb) IUYVY2RGB_2(pyuv, prgb); IUYVY2RGB_2(pyuv + 4, prgb + 6);
-
 /** @brief Convert a frame from UYVY to RGB
  * @ingroup frame
  * @param ini UYVY frame
  * @param out RGB frame
  */
 uvc_error_t uvc_uyvy2rgb(uvc_frame_t *in, uvc_frame_t *out) {
-  if (in->frame_format != UVC_FRAME_FORMAT_UYVY)
-    return UVC_ERROR_INVALID_PARAM;
-
-  if (uvc_ensure_frame_size(out, in->width * in->height * 3) < 0)
-    return UVC_ERROR_NO_MEM;
-
-  out->width = in->width;
-  out->height = in->height;
-  out->frame_format = UVC_FRAME_FORMAT_RGB;
-  out->step = in->width *3;
-  out->sequence = in->sequence;
-  out->capture_time = in->capture_time;
-  out->source = in->source;
-
-  uint8_t *pyuv = static_cast<uint8_t *>(in->data);
-  uint8_t *prgb = static_cast<uint8_t *>(out->data);
-  uint8_t *prgb_end = prgb + out->data_bytes;
-
-  while (prgb < prgb_end) {
-    IUYVY2RGB_8(pyuv, prgb);
-
-    prgb += 3 * 8;
-    pyuv += 2 * 8;
-  }
-
-  return UVC_SUCCESS;
+  return _uvc_convert_yuv422(in, out, UVC_FRAME_FORMAT_UYVY, UVC_FRAME_FORMAT_RGB, 3,
+      librealuvc::YUV422_UYVY, librealuvc::ORDER_RGB, 0);
 }
 
-#define IUYVY2BGR_2(pyuv, pbgr) { \
-    int r = (22987 * ((pyuv)[2] - 128)) >> 14; \
-    int g = (-5636 * ((pyuv)[0] - 128) - 11698 * ((pyuv)[2] - 128)) >> 14; \
-    int b = (29049 * ((pyuv)[0] - 128)) >> 14; \
-    (pbgr)[0] = sat((pyuv)[1] + b); \
-    (pbgr)[1] = sat((pyuv)[1] + g); \
-    (pbgr)[2] = sat((pyuv)[1] + r); \
-    (pbgr)[3] = sat((pyuv)[3] + b); \
-    (pbgr)[4] = sat((pyuv)[3] + g); \
-    (pbgr)[5] = sat((pyuv)[3] + r); \
-    }
-#define IUYVY2BGR_16(pyuv, pbgr) IUYVY2BGR_8(pyuv, pbgr); IUYVY2BGR_8(pyuv + 16, pbgr + 24);
-#define IUYVY2BGR_8(pyuv, pbgr) IUYVY2BGR_4(pyuv, pbgr); IUYVY2BGR_4(pyuv + 8, pbgr + 12);
-#define IUYVY2BGR_4(pyuv, pbgr) IUYVY2BGR_2(pyuv, pbgr); IUYVY2BGR_2(pyuv + 4, pbgr + 6);
-
 /** @brief Convert a frame from UYVY to BGR
  * @ingroup frame
  * @param ini UYVY frame
  * @param out BGR frame
  */
 uvc_error_t uvc_uyvy2bgr(uvc_frame_t *in, uvc_frame_t *out) {
-  if (in->frame_format != UVC_FRAME_FORMAT_UYVY)
-    return UVC_ERROR_INVALID_PARAM;
-
-  if (uvc_ensure_frame_size(out, in->width * in->height * 3) < 0)
-    return UVC_ERROR_NO_MEM;
-
-  out->width = in->width;
-  out->height = in->height;
-  out->frame_format = UVC_FRAME_FORMAT_BGR;
-  out->step = in->width *3;
-  out->sequence = in->sequence;
-  out->capture_time = in->capture_time;
-  out->source = in->source;
-
-  uint8_t *pyuv = static_cast<uint8_t *>(in->data);
-  uint8_t *pbgr = static_cast<uint8_t *>(out->data);
-  uint8_t *pbgr_end = pbgr + out->data_bytes;
-
-  while (pbgr < pbgr_end) {
-    IUYVY2BGR_8(pyuv, pbgr);
-
-    pbgr += 3 * 8;
-    pyuv += 2 * 8;
-  }
-
-  return UVC_SUCCESS;
+  return _uvc_convert_yuv422(in, out, UVC_FRAME_FORMAT_UYVY, UVC_FRAME_FORMAT_BGR, 3,
+      librealuvc::YUV422_UYVY, librealuvc::ORDER_BGR, 0);
 }
 
 /** @brief Convert a frame to RGB
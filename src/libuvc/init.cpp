@@ -78,19 +78,141 @@ YUV stream from a UVC device such as a standard webcam.
 #include "libuvc.h"
 #include "libuvc_internal.h"
 
+// uvc_usb_service methods
+
+uvc_usb_service::uvc_usb_service() :
+  usb_ctx_(NULL),
+  ctx_refs_(0),
+  event_refs_(0),
+  num_event_threads_(LIBUVC_EVENT_THREADS),
+  kill_events_(0),
+  executor_refs_(0),
+  num_callback_threads_(LIBUVC_CALLBACK_THREADS),
+  executor_stopping_(false) {
+}
+
+uvc_usb_service& uvc_usb_service::get() {
+  static uvc_usb_service single;
+  return single;
+}
+
+uvc_error_t uvc_usb_service::acquire_context(struct libusb_context **usb_ctx) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (ctx_refs_ == 0) {
+    int ret = libusb_init(&usb_ctx_);
+    if (ret != UVC_SUCCESS) {
+      usb_ctx_ = NULL;
+      return (uvc_error_t)ret;
+    }
+  }
+  ++ctx_refs_;
+  *usb_ctx = usb_ctx_;
+  return UVC_SUCCESS;
+}
+
+void uvc_usb_service::release_context() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (--ctx_refs_ == 0) {
+    libusb_exit(usb_ctx_);
+    usb_ctx_ = NULL;
+  }
+}
+
 /** @internal
  * @brief Event handler thread
- * There's one of these per UVC context.
- * @todo We shouldn't run this if we don't own the USB context
+ * There's a small pool of these for the shared USB context.
  */
-void *_uvc_handle_events(void *arg) {
-  uvc_context_t *ctx = (uvc_context_t *) arg;
+void uvc_usb_service::start_events() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (event_refs_++ > 0) return;
+  kill_events_ = 0;
+  auto usb_ctx = usb_ctx_;
+  for (int j = 0; j < num_event_threads_; ++j) {
+    event_threads_.emplace_back([this, usb_ctx]() {
+      while (!kill_events_) {
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+        libusb_handle_events_completed(usb_ctx, &kill_events_);
+#else
+        /* no libusb_interrupt_event_handler, so look at the flag now and then */
+        struct timeval tv = { 0, 100000 };
+        libusb_handle_events_timeout_completed(usb_ctx, &tv, &kill_events_);
+#endif
+      }
+    });
+  }
+}
+
+void uvc_usb_service::stop_events() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (--event_refs_ > 0) return;
+  /* The caller has just closed its last device, which also makes
+   * libusb_handle_events return so the threads see the flag. */
+  kill_events_ = 1;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+  libusb_interrupt_event_handler(usb_ctx_);
+#endif
+  for (auto& t : event_threads_) t.join();
+  event_threads_.clear();
+}
 
-  while (!ctx->kill_handler_thread)
+void uvc_usb_service::start_executor() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (executor_refs_++ > 0) return;
+  executor_stopping_ = false;
+  for (int j = 0; j < num_callback_threads_; ++j) {
+    workers_.emplace_back([this]() { executor_loop(); });
+  }
+}
+
+void uvc_usb_service::stop_executor() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (--executor_refs_ > 0) return;
   {
-    libusb_handle_events_completed(ctx->usb_ctx, &ctx->kill_handler_thread);
+    std::lock_guard<std::mutex> elock(executor_mutex_);
+    executor_stopping_ = true;
+    executor_cond_.notify_all();
+  }
+  for (auto& t : workers_) t.join();
+  workers_.clear();
+}
+
+void uvc_usb_service::schedule(uvc_stream_handle_t *strmh) {
+  std::lock_guard<std::mutex> lock(executor_mutex_);
+  ready_.push_back(strmh);
+  executor_cond_.notify_one();
+}
+
+void uvc_usb_service::executor_loop() {
+  for (;;) {
+    uvc_stream_handle_t *strmh;
+    {
+      std::unique_lock<std::mutex> lock(executor_mutex_);
+      executor_cond_.wait(lock, [this]() { return executor_stopping_ || !ready_.empty(); });
+      if (ready_.empty()) return;
+      strmh = ready_.front();
+      ready_.pop_front();
+    }
+    _uvc_run_callbacks(strmh);
   }
-  return NULL;
+}
+
+void uvc_usb_service::set_threads(int event_threads, int callback_threads) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (event_threads > 0) num_event_threads_ = event_threads;
+  if (callback_threads > 0) num_callback_threads_ = callback_threads;
+}
+
+/** @brief Size the shared thread pools
+ * @ingroup init
+ *
+ * Applies to contexts created without a USB context of their own, the
+ * next time their threads are started.
+ *
+ * @param event_threads Threads handling libusb events, 0 to leave unchanged
+ * @param callback_threads Threads running frame callbacks, 0 to leave unchanged
+ */
+void uvc_set_thread_pools(int event_threads, int callback_threads) {
+  uvc_usb_service::get().set_threads(event_threads, callback_threads);
 }
 
 /** @brief Initializes the UVC context
@@ -108,7 +230,7 @@ uvc_error_t uvc_init(uvc_context_t **pctx, struct libusb_context *usb_ctx) {
   uvc_context_t *ctx = (uvc_context_t *)calloc(1, sizeof(*ctx));
 
   if (usb_ctx == NULL) {
-    ret = libusb_init(&ctx->usb_ctx);
+    ret = uvc_usb_service::get().acquire_context(&ctx->usb_ctx);
     ctx->own_usb_ctx = 1;
     if (ret != UVC_SUCCESS) {
       free(ctx);
@@ -132,8 +254,8 @@ uvc_error_t uvc_init(uvc_context_t **pctx, struct libusb_context *usb_ctx) {
  * @note This function invalides any existing references to the context's
  * cameras.
  *
- * If no USB context was provided to #uvc_init, the UVC-specific USB
- * context will be destroyed.
+ * If no USB context was provided to #uvc_init, the reference to the shared
+ * USB context is dropped; the last one destroys it.
  *
  * @param ctx UVC context to shut down
  */
@@ -145,21 +267,32 @@ void uvc_exit(uvc_context_t *ctx) {
   }
 
   if (ctx->own_usb_ctx)
-    libusb_exit(ctx->usb_ctx);
+    uvc_usb_service::get().release_context();
 
   free(ctx);
 }
 
 /**
  * @internal
- * @brief Spawns a handler thread for the context
+ * @brief Starts event handling for the context
  * @ingroup init
  *
  * This should be called at the end of a successful uvc_open if no devices
  * are already open (and being handled).
  */
 void uvc_start_handler_thread(uvc_context_t *ctx) {
-    if (ctx->own_usb_ctx)
-        ctx->handler_thread = std::thread([ctx]() {_uvc_handle_events((void*)ctx); });
+  if (ctx->own_usb_ctx)
+    uvc_usb_service::get().start_events();
 }
 
+/**
+ * @internal
+ * @brief Ends event handling for the context
+ * @ingroup init
+ *
+ * Called by uvc_close after closing the last open device.
+ */
+void uvc_stop_handler_thread(uvc_context_t *ctx) {
+  if (ctx->own_usb_ctx)
+    uvc_usb_service::get().stop_events();
+}
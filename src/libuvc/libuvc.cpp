@@ -4,6 +4,7 @@
 #ifdef RS2_USE_LIBUVC_BACKEND
 #include "../include/librealuvc/ru_common.h"     // Inherit all type definitions in the public API
 #include "../types.h"
+#include "../trace.h"
 #include "backend.h"
 #include "types.h"
 
@@ -60,6 +61,112 @@ namespace librealuvc
 
         static void internal_uvc_callback(uvc_frame_t *frame, void *ptr);
 
+        // Devices asked to power down stay open for a grace period, in case
+        // they are turned on again right away.  One timer thread serves every
+        // device; it sleeps until the earliest deadline and not at all while
+        // nothing is pending.
+        class idle_power_manager
+        {
+        public:
+            typedef std::chrono::steady_clock clock;
+
+            static idle_power_manager& get()
+            {
+                static idle_power_manager single;
+                return single;
+            }
+
+            void set_idle_timeout(std::chrono::milliseconds timeout) { _idle_timeout = timeout; }
+            std::chrono::milliseconds get_idle_timeout() const { return _idle_timeout; }
+
+            // Run action once the idle timeout passes, replacing any pending one for key
+            void schedule(const void* key, std::function<void()> action)
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _pending[key] = { clock::now() + _idle_timeout.load(), action };
+                if (!_thread.joinable())
+                    _thread = std::thread([this]() { run(); });
+                _cv.notify_all();
+            }
+
+            // Drop the pending action for key.  With wait, also wait for it to
+            // finish if it is running, so the caller can go away.
+            void cancel(const void* key, bool wait)
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _pending.erase(key);
+                if (wait)
+                    _cv.wait(lock, [&]() { return _running_key != key; });
+            }
+
+            ~idle_power_manager()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _stopping = true;
+                    _pending.clear();
+                    _cv.notify_all();
+                }
+                if (_thread.joinable())
+                    _thread.join();
+            }
+
+        private:
+            struct pending_action
+            {
+                clock::time_point deadline;
+                std::function<void()> action;
+            };
+
+            idle_power_manager() : _idle_timeout(std::chrono::seconds(1)) {}
+
+            void run()
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                while (!_stopping)
+                {
+                    if (_pending.empty())
+                    {
+                        _cv.wait(lock);
+                        continue;
+                    }
+                    auto next = std::min_element(_pending.begin(), _pending.end(),
+                        [](const std::pair<const void* const, pending_action>& a,
+                           const std::pair<const void* const, pending_action>& b)
+                        { return a.second.deadline < b.second.deadline; });
+                    if (clock::now() < next->second.deadline)
+                    {
+                        _cv.wait_until(lock, next->second.deadline);
+                        continue;
+                    }
+                    auto key = next->first;
+                    auto action = next->second.action;
+                    _pending.erase(next);
+                    _running_key = key;
+                    lock.unlock();
+                    try
+                    {
+                        action();
+                    }
+                    catch (const std::exception& e)
+                    {
+                        LOG_ERROR("idle power transition failed: " << e.what());
+                    }
+                    lock.lock();
+                    _running_key = nullptr;
+                    _cv.notify_all();
+                }
+            }
+
+            std::mutex _mutex;
+            std::condition_variable _cv;
+            std::thread _thread;
+            std::unordered_map<const void*, pending_action> _pending;
+            const void* _running_key = nullptr;
+            bool _stopping = false;
+            std::atomic<std::chrono::milliseconds> _idle_timeout;
+        };
+
         static std::tuple<std::string,uint16_t>  get_usb_descriptors(libusb_device* usb_device)
         {
             auto usb_bus = std::to_string(libusb_get_bus_number(usb_device));
@@ -283,15 +390,11 @@ namespace librealuvc
                     throw linux_backend_exception("device is no longer connected!");
                 }
 
-                _state_change_time = 0;
-                _is_power_thread_alive = true;
-                _thread_handle = std::thread(std::bind(&libuvc_uvc_device::power_thread,this));
             }
 
             ~libuvc_uvc_device()
             {
-                _is_power_thread_alive = false;
-                _thread_handle.join();
+                idle_power_manager::get().cancel(this, true);
                 _is_capturing = false;
                 uvc_exit(_ctx);
             }
@@ -325,6 +428,7 @@ namespace librealuvc
                 _profiles.push_back(profile);
                 _callbacks.push_back(callback);
                 _stream_ctrls.push_back(ctrl);
+                _stream_buffers.push_back(buffers);
             }
 
             /* request to start streaming*/
@@ -338,13 +442,20 @@ namespace librealuvc
                     context->_this = this;
                     context->_profile = _profiles[i];
 
-                    res = uvc_start_streaming(_device_handle,
-                                              &_stream_ctrls[i],
-                                              internal_uvc_callback,
-                                              context,
-                                              0);
+                    uvc_stream_handle_t *strmh = nullptr;
+                    res = uvc_stream_open_ctrl(_device_handle, &strmh, &_stream_ctrls[i]);
+                    if (res == UVC_SUCCESS) {
+                        // as with V4L2, "buffers" bounds the frames in flight
+                        uvc_stream_set_frame_pool_size(strmh, std::max(_stream_buffers[i], 2));
+                        res = uvc_stream_start(strmh, internal_uvc_callback, context, 0);
+                        if (res != UVC_SUCCESS) {
+                            uvc_stream_close(strmh);
+                            strmh = nullptr;
+                        }
+                    }
 
                     if (res < 0) throw linux_backend_exception("fail to start streaming.");
+                    _streams.push_back(strmh);
                 }
             }
 
@@ -366,8 +477,23 @@ namespace librealuvc
                     _is_capturing = false;
                     _is_started = false;
                 }
+                for (auto strmh : _streams) {
+                    uvc_frame_pool_stats_t stats;
+                    uvc_stream_get_frame_pool_stats(strmh, &stats);
+                    if (stats.exhausted > 0) {
+                        LOG_WARNING("dropped " << stats.exhausted << " frames, all "
+                                    << stats.capacity << " frame buffers were in use");
+                    }
+                    uint64_t dropped = 0;
+                    uvc_stream_get_handoff_stats(strmh, nullptr, &dropped);
+                    if (dropped > 0) {
+                        LOG_WARNING("dropped " << dropped << " frames while the frame callback was busy");
+                    }
+                }
+                _streams.clear();
                 uvc_stop_streaming(_device_handle);
                 _stream_ctrls.clear();
+                _stream_buffers.clear();
                 _profiles.clear();
                 _callbacks.clear();
                 
@@ -429,16 +555,16 @@ namespace librealuvc
                 if (state == D0 && _state == D3) {
 
                     // disable change state aggregation in case exists at the moment.
-                    _state_change_time = 0;
+                    idle_power_manager::get().cancel(this, false);
 
                     if ( _real_state == D3) {
                         power_D0();
                     }
                 }
-                else {
-                    // we have been asked to close the device. queue the request for several seconds
+                else if (state == D3 && _state == D0) {
+                    // we have been asked to close the device. queue the request
                     // just in case a quick turn on come right over.
-                    _state_change_time = std::clock();
+                    idle_power_manager::get().schedule(this, [this]() { idle_power_down(); });
                 }
 
               _state = state;
@@ -772,44 +898,29 @@ namespace librealuvc
                 frame_object fo{ frame->data_bytes,
                                  frame->metadata_bytes,
                                  frame->data,
-                                 frame->metadata };
+                                 frame->metadata,
+                                 frame->capture_time_ns };
 
                 callback(profile, fo, 
-                  [=](){ frame->release(); }
+                  [=](){
+                    RU_TRACE(TRACE_REQUEUE, frame->capture_time_ns);
+                    frame->release();
+                  }
                 );
             }
 
-          void power_thread() {
-              do {
-                std::this_thread::sleep_for(std::chrono::seconds(1));
-
-                std::lock_guard<std::mutex> lock(_power_mutex);
-
-                if (_state_change_time != 0) {
-                    clock_t now_time = std::clock();
-
-                    if (now_time - _state_change_time > 1000 ) {
-
-                        // power state should change.
-                        _state_change_time = 0;
-
-                        if (_real_state == D0) {
-                            power_D3();
-                            _real_state = D3;
-
-                        }
-                    }
-                }
-            } while(_is_power_thread_alive);
+          void idle_power_down() {
+              std::lock_guard<std::mutex> lock(_power_mutex);
+              // a D0 request may have slipped in after the timer fired
+              if (_state == D3 && _real_state == D0) {
+                  power_D3();
+              }
           }
 
         private:
 
             std::mutex _power_mutex;
-            std::thread _thread_handle;
-            std::atomic<bool> _is_power_thread_alive;
             power_state _real_state = D3;
-            std::clock_t _state_change_time;
 
             power_state _state = D3;
             std::string _name = "";
@@ -820,6 +931,8 @@ namespace librealuvc
             std::vector<stream_profile> _profiles;
             std::vector<frame_callback> _callbacks;
             std::vector<uvc_stream_ctrl_t> _stream_ctrls;
+            std::vector<int> _stream_buffers;
+            std::vector<uvc_stream_handle_t*> _streams;
             mutable std::unordered_map<uint32_t, uint32_t> _substitute_4cc;
             std::atomic<bool> _is_capturing;
             std::atomic<bool> _is_alive;
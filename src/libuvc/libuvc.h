@@ -458,6 +458,8 @@ class uvc_frame {
     uint32_t sequence;
     /** Estimate of system time when the device started capturing the image */
     struct timeval capture_time;
+    /** Monotonic time (ns) at which the last payload of the frame arrived */
+    int64_t capture_time_ns;
     /** Handle on the device that produced the image.
      * @warning You must not call any uvc_* functions during a callback. */
     uvc_device_handle_t *source;
@@ -486,6 +488,22 @@ class uvc_frame {
 
 typedef uvc_frame uvc_frame_t;
 
+/** Frame pool usage of a stream
+ * @ingroup streaming
+ */
+typedef struct uvc_frame_pool_stats {
+    /** Most frames the pool will hand out at once */
+    size_t capacity;
+    /** Frames currently allocated */
+    size_t allocated;
+    /** Frames currently held by the stream or the user */
+    size_t in_use;
+    /** Largest in_use seen */
+    size_t high_water;
+    /** Frames dropped because no pool frame was free */
+    uint64_t exhausted;
+} uvc_frame_pool_stats_t;
+
 /** A callback function to handle incoming assembled UVC frames
  * @ingroup streaming
  */
@@ -544,6 +562,7 @@ typedef struct uvc_stream_info {
 
 uvc_error_t uvc_init(uvc_context_t **ctx, struct libusb_context *usb_ctx);
 void uvc_exit(uvc_context_t *ctx);
+void uvc_set_thread_pools(int event_threads, int callback_threads);
 
 uvc_error_t uvc_get_device_list(
         uvc_context_t *ctx,
@@ -653,6 +672,11 @@ void uvc_stop_streaming(uvc_device_handle_t *devh);
 
 uvc_error_t uvc_stream_open_ctrl(uvc_device_handle_t *devh, uvc_stream_handle_t **strmh, uvc_stream_ctrl_t *ctrl);
 uvc_error_t uvc_stream_ctrl(uvc_stream_handle_t *strmh, uvc_stream_ctrl_t *ctrl);
+uvc_error_t uvc_stream_set_transfers(uvc_stream_handle_t *strmh, int num_transfers, size_t transfer_size);
+uvc_error_t uvc_stream_set_frame_pool_size(uvc_stream_handle_t *strmh, size_t num_frames);
+uvc_error_t uvc_stream_get_frame_pool_stats(uvc_stream_handle_t *strmh, uvc_frame_pool_stats_t *stats);
+uvc_error_t uvc_stream_set_handoff_depth(uvc_stream_handle_t *strmh, size_t depth);
+uvc_error_t uvc_stream_get_handoff_stats(uvc_stream_handle_t *strmh, uint64_t *delivered, uint64_t *dropped);
 uvc_error_t uvc_stream_start(uvc_stream_handle_t *strmh,
                              uvc_frame_callback_t *cb,
                              void *user_ptr,
@@ -12,6 +12,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <condition_variable>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <thread>
@@ -263,26 +264,33 @@ typedef struct uvc_device_info {
 } uvc_device_info_t;
 
 /*
-  set a high number of transfer buffers. This uses a lot of ram, but
-  avoids problems with scheduling delays on slow boards causing missed
-  transfers. A better approach may be to make the transfer thread FIFO
-  scheduled (if we have root).
-  We could/should change this to allow reduce it to, say, 5 by default
-  and then allow the user to change the number of buffers as required.
+  Several bulk transfers are kept queued so the bus can keep delivering
+  payloads while the event thread is busy processing a completed one.
+  By default the count is derived from the negotiated payload and frame
+  sizes (see _uvc_size_transfers); uvc_stream_set_transfers() overrides it.
  */
-#define LIBUVC_NUM_TRANSFER_BUFS 1
+#define LIBUVC_NUM_TRANSFER_BUFS 4
+#define LIBUVC_MAX_TRANSFER_BUFS 32
 
-#define LIBUVC_XFER_BUF_SIZE	( 16 * 1024 * 1024 )
+/* upper bound on memory held by queued transfer buffers of one stream */
+#define LIBUVC_MAX_TRANSFER_BYTES ( 32 * 1024 * 1024 )
 
 /*
   librealuvc allows downstream user code to use frame data until it
-  is explicitly released, so we need a frame pool.
+  is explicitly released, so we need a frame pool.  The pool is bounded:
+  once all of its frames are out, grab_frame() fails and the stream drops
+  the incoming frame rather than allocating more.
  */
+#define LIBUVC_FRAME_POOL_SIZE 8
 
 class uvc_frame_pool : public std::enable_shared_from_this<uvc_frame_pool> {
  private:
   std::mutex mutex_;
   std::vector<uvc_frame*> free_frames_;
+  size_t capacity_;
+  size_t allocated_;
+  size_t high_water_;
+  uint64_t exhausted_;
   
   uvc_frame_pool& operator=(const uvc_frame_pool& b) = delete;
 
@@ -290,10 +298,61 @@ class uvc_frame_pool : public std::enable_shared_from_this<uvc_frame_pool> {
   uvc_frame_pool();
   
   ~uvc_frame_pool();
+
+  // Allocate frames up to capacity, each with room for data_size bytes
+  void reserve(size_t capacity, size_t data_size, size_t meta_size);
   
+  // Returns nullptr when all frames are in use
   uvc_frame* grab_frame(size_t data_size, size_t meta_size);
   
   void release_frame(uvc_frame* f);
+
+  void get_stats(uvc_frame_pool_stats_t* stats);
+};
+
+/*
+  Completed frames travel from the USB event thread to the consumer (the
+  user-caller thread or uvc_stream_get_frame) through a single-producer,
+  single-consumer ring.  The producer never blocks: when the consumer is
+  behind and the ring is full, the new frame is dropped and counted.
+  The mutex and condition variable are only touched to wake a consumer
+  that has gone to sleep.
+ */
+#define LIBUVC_HANDOFF_DEPTH 2
+
+class uvc_frame_ring {
+ private:
+  std::vector<uvc_frame*> slots_;
+  std::atomic<size_t> head_; // next slot to pop, written by the consumer
+  std::atomic<size_t> tail_; // next slot to push, written by the producer
+  std::atomic<bool> waiting_;
+  std::atomic<uint64_t> delivered_;
+  std::atomic<uint64_t> dropped_;
+  std::mutex wait_mutex_;
+  std::condition_variable wait_cond_;
+
+  uvc_frame_ring& operator=(const uvc_frame_ring& b) = delete;
+
+ public:
+  uvc_frame_ring();
+
+  // Only while neither end is active; the ring must be empty
+  void reset(size_t depth);
+
+  // Producer side.  Returns false, and counts a drop, when full.
+  bool push(uvc_frame* f);
+
+  // Consumer side.  pop() returns nullptr when empty; pop_wait() sleeps
+  // until a frame arrives, running drops to 0, or timeout_us (if >= 0) passes.
+  uvc_frame* pop();
+  uvc_frame* pop_wait(const std::atomic<uint8_t>& running, int64_t timeout_us);
+
+  // Wake a sleeping consumer, e.g. to let it see the stream stopping
+  void wake();
+
+  bool empty() const { return head_.load() == tail_.load(); }
+  uint64_t delivered() const { return delivered_; }
+  uint64_t dropped() const { return dropped_; }
 };
 
 class uvc_stream_handle {
@@ -307,32 +366,41 @@ class uvc_stream_handle {
     /** Current control block */
     struct uvc_stream_ctrl cur_ctrl;
     
-    /** Accumulate current frame into outbuf and metadata */
-    uint8_t* outbuf;
+    /** Payloads are assembled in place into cur_frame, which is
+     * pushed onto handoff once complete */
+    uvc_frame* cur_frame;
     size_t got_bytes;
+    /** no pool frame was free when this frame started, discard its payloads */
+    bool dropping;
+    size_t frame_pool_size;
     size_t metadata_max;
-    uint8_t* metadata_buf;
-    size_t metadata_bytes;
 
-    /* listeners may only access hold*, and only when holding a
-     * lock on cb_mutex (probably signaled with cb_cond) */
     std::shared_ptr<uvc_frame_pool> frame_pool;
-    uvc_frame* full_frame;
+    /** complete frames waiting for the consumer */
+    uvc_frame_ring handoff;
+    size_t handoff_depth;
     uint8_t fid;
     uint32_t seq;
     uint32_t pts;
     uint32_t last_scr;
     
-    //uint8_t *outbuf, *holdbuf;
+    /** held by the USB callback while it processes a transfer */
     std::mutex cb_mutex;
-    std::condition_variable cb_cond;
-    std::thread cb_thread;
+    /** set while the stream is queued on or running in the callback executor */
+    std::atomic<bool> cb_scheduled;
+    /** executor runs not yet finished, guarded by cb_idle_mutex */
+    int cb_runs;
+    std::mutex cb_idle_mutex;
+    std::condition_variable cb_idle;
     uint32_t last_polled_seq;
     uvc_frame_callback_t *user_cb;
     void *user_ptr;
-    struct libusb_transfer *transfers[LIBUVC_NUM_TRANSFER_BUFS];
-    uint8_t *transfer_bufs[LIBUVC_NUM_TRANSFER_BUFS];
-    std::condition_variable transfer_cancel[LIBUVC_NUM_TRANSFER_BUFS];
+    /** requested transfer count and size, 0 picks them from cur_ctrl */
+    int num_transfer_bufs;
+    size_t transfer_buf_size;
+    /** a transfer is NULL once it has been freed */
+    std::vector<struct libusb_transfer *> transfers;
+    std::condition_variable transfer_cancel;
     enum uvc_frame_format frame_format;
 
   public:
@@ -342,13 +410,17 @@ class uvc_stream_handle {
         next(nullptr),
         stream_if(nullptr),
         running(0),
-        outbuf(nullptr),
+        cur_frame(nullptr),
         got_bytes(0),
+        dropping(false),
+        frame_pool_size(LIBUVC_FRAME_POOL_SIZE),
         metadata_max(0),
-        metadata_buf(nullptr),
-        metadata_bytes(0),
         frame_pool(std::make_shared<uvc_frame_pool>()),
-        full_frame(nullptr) {
+        handoff_depth(LIBUVC_HANDOFF_DEPTH),
+        cb_scheduled(false),
+        cb_runs(0),
+        num_transfer_bufs(0),
+        transfer_buf_size(0) {
     }
 };
 
@@ -384,8 +456,61 @@ struct uvc_context {
     uint8_t own_usb_ctx;
     /** List of open devices in this context */
     uvc_device_handle_t *open_devices;
-    std::thread handler_thread;
-    int kill_handler_thread;
+};
+
+/*
+  Every context created without a caller-supplied USB context shares one
+  process-wide libusb context.  Its events are handled by a small pool of
+  threads that runs while any such context has an open device, and user
+  frame callbacks of all streams run on a shared executor rather than on a
+  thread per stream.  A stream is never called back from two executor
+  threads at once, so its frames stay in order.
+
+  libusb lets only one thread handle events at a time; extra event threads
+  only take over while another is stuck in a transfer callback.
+ */
+#define LIBUVC_EVENT_THREADS 1
+#define LIBUVC_CALLBACK_THREADS 2
+
+class uvc_usb_service {
+ private:
+  std::mutex mutex_;
+  struct libusb_context *usb_ctx_;
+  int ctx_refs_;
+  int event_refs_;
+  int num_event_threads_;
+  int kill_events_;
+  std::vector<std::thread> event_threads_;
+
+  int executor_refs_;
+  int num_callback_threads_;
+  bool executor_stopping_;
+  std::mutex executor_mutex_;
+  std::condition_variable executor_cond_;
+  std::deque<uvc_stream_handle_t*> ready_;
+  std::vector<std::thread> workers_;
+
+  uvc_usb_service();
+  void executor_loop();
+
+ public:
+  static uvc_usb_service& get();
+
+  // Shared libusb context, initialized on first use
+  uvc_error_t acquire_context(struct libusb_context **usb_ctx);
+  void release_context();
+
+  // Event threads run between the first start and the matching last stop
+  void start_events();
+  void stop_events();
+
+  // Executor threads run while any stream delivers frames by callback
+  void start_executor();
+  void stop_executor();
+  void schedule(uvc_stream_handle_t *strmh);
+
+  // Take effect the next time the threads are started
+  void set_threads(int event_threads, int callback_threads);
 };
 
 uvc_error_t uvc_query_stream_ctrl(
@@ -395,6 +520,8 @@ uvc_error_t uvc_query_stream_ctrl(
         enum uvc_req_code req);
 
 void uvc_start_handler_thread(uvc_context_t *ctx);
+void uvc_stop_handler_thread(uvc_context_t *ctx);
+void _uvc_run_callbacks(uvc_stream_handle_t *strmh);
 uvc_error_t uvc_claim_if(uvc_device_handle_t *devh, int idx);
 uvc_error_t uvc_release_if(uvc_device_handle_t *devh, int idx);
 
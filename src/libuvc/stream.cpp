@@ -38,7 +38,9 @@
 
 #include "libuvc.h"
 #include "libuvc_internal.h"
+#include "../trace.h"
 #include "errno.h"
+#include <algorithm>
 #include <chrono>
 
 #ifdef _MSC_VER
@@ -71,8 +73,8 @@ uvc_frame_desc_t *uvc_find_frame_desc_stream(uvc_stream_handle_t *strmh,
     uint16_t format_id, uint16_t frame_id);
 uvc_frame_desc_t *uvc_find_frame_desc(uvc_device_handle_t *devh,
     uint16_t format_id, uint16_t frame_id);
-void *_uvc_user_caller(void *arg);
-void _uvc_populate_frame(uvc_stream_handle_t *strmh);
+void _uvc_populate_frame(uvc_stream_handle_t *strmh, uvc_frame_t *frame);
+static void _uvc_schedule_callbacks(uvc_stream_handle_t *strmh);
 
 struct format_table_entry {
   enum uvc_frame_format format;
@@ -702,27 +704,62 @@ uvc_error_t uvc_probe_stream_ctrl(
 
 uvc_frame_pool::uvc_frame_pool() :
   mutex_(),
-  free_frames_() {
+  free_frames_(),
+  capacity_(LIBUVC_FRAME_POOL_SIZE),
+  allocated_(0),
+  high_water_(0),
+  exhausted_(0) {
 }
 
 uvc_frame_pool::~uvc_frame_pool() {
   for (auto f : free_frames_) delete f;
 }
 
+void uvc_frame_pool::reserve(size_t capacity, size_t data_size, size_t meta_size) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  capacity_ = capacity;
+  // Grow the idle frames now so that grabbing one never allocates
+  for (auto f : free_frames_) {
+    f->resize_data(data_size);
+    f->resize_metadata(meta_size);
+  }
+  auto self = shared_from_this();
+  while (allocated_ < capacity_) {
+    auto f = new uvc_frame(data_size, meta_size);
+    f->weak_pool = self;
+    free_frames_.push_back(f);
+    ++allocated_;
+  }
+  // Surplus idle frames from a larger previous capacity
+  while ((allocated_ > capacity_) && !free_frames_.empty()) {
+    delete free_frames_.back();
+    free_frames_.pop_back();
+    --allocated_;
+  }
+}
+
 uvc_frame* uvc_frame_pool::grab_frame(size_t data_size, size_t meta_size) {
   std::unique_lock<std::mutex> lock(mutex_);
-  auto nfree = free_frames_.size();
   uvc_frame* f;
-  if (nfree <= 0) {
-    f = new uvc_frame(data_size, meta_size);
+  if (!free_frames_.empty()) {
+    f = free_frames_.back();
+    free_frames_.pop_back();
+  } else if (allocated_ < capacity_) {
+    f = new uvc_frame(0, 0);
+    f->weak_pool = shared_from_this();
+    ++allocated_;
   } else {
-    f = free_frames_[nfree-1];
-    free_frames_.resize(nfree-1);
-    f->resize_data(data_size);
-    f->resize_metadata(meta_size);
-    return f;
+    ++exhausted_;
+    return nullptr;
   }
-  f->weak_pool = shared_from_this();
+  auto in_use = allocated_ - free_frames_.size();
+  if (high_water_ < in_use) high_water_ = in_use;
+  lock.unlock();
+  // only reallocates when the frame is smaller than asked for
+  if (f->data_max < data_size) f->resize_data(data_size);
+  if (f->metadata_max < meta_size) f->resize_metadata(meta_size);
+  f->data_bytes = data_size;
+  f->metadata_bytes = (uint8_t)meta_size;
   return f;
 }
 
@@ -730,25 +767,137 @@ void uvc_frame_pool::release_frame(uvc_frame* f) {
   std::unique_lock<std::mutex> lock(mutex_);
   f->data_bytes = 0;
   f->metadata_bytes = 0;
+  if (allocated_ > capacity_) {
+    // capacity was reduced while this frame was out
+    --allocated_;
+    lock.unlock();
+    delete f;
+    return;
+  }
   free_frames_.push_back(f);
 }
 
+void uvc_frame_pool::get_stats(uvc_frame_pool_stats_t* stats) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  stats->capacity = capacity_;
+  stats->allocated = allocated_;
+  stats->in_use = allocated_ - free_frames_.size();
+  stats->high_water = high_water_;
+  stats->exhausted = exhausted_;
+}
+
+// uvc_frame_ring methods
+
+uvc_frame_ring::uvc_frame_ring() :
+  slots_(LIBUVC_HANDOFF_DEPTH, nullptr),
+  head_(0),
+  tail_(0),
+  waiting_(false),
+  delivered_(0),
+  dropped_(0) {
+}
+
+void uvc_frame_ring::reset(size_t depth) {
+  slots_.assign(depth, nullptr);
+  head_ = 0;
+  tail_ = 0;
+}
+
+bool uvc_frame_ring::push(uvc_frame* f) {
+  size_t tail = tail_.load(std::memory_order_relaxed);
+  if (tail - head_.load(std::memory_order_acquire) >= slots_.size()) {
+    ++dropped_;
+    return false;
+  }
+  slots_[tail % slots_.size()] = f;
+  // seq_cst pairs with the consumer's waiting_ store: either it sees this
+  // frame before sleeping or we see it waiting and wake it
+  tail_.store(tail + 1);
+  ++delivered_;
+  if (waiting_.load()) wake();
+  return true;
+}
+
+uvc_frame* uvc_frame_ring::pop() {
+  size_t head = head_.load(std::memory_order_relaxed);
+  if (head == tail_.load(std::memory_order_acquire)) return nullptr;
+  auto f = slots_[head % slots_.size()];
+  head_.store(head + 1, std::memory_order_release);
+  return f;
+}
+
+uvc_frame* uvc_frame_ring::pop_wait(const std::atomic<uint8_t>& running, int64_t timeout_us) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_us);
+  for (;;) {
+    auto f = pop();
+    if (f || !running) return f;
+    std::unique_lock<std::mutex> lock(wait_mutex_);
+    waiting_.store(true);
+    if ((head_.load() == tail_.load()) && running) {
+      if (timeout_us < 0) {
+        wait_cond_.wait(lock);
+      } else if (wait_cond_.wait_until(lock, deadline) == std::cv_status::timeout) {
+        waiting_.store(false);
+        lock.unlock();
+        return pop();
+      }
+    }
+    waiting_.store(false);
+  }
+}
+
+void uvc_frame_ring::wake() {
+  std::lock_guard<std::mutex> lock(wait_mutex_);
+  wait_cond_.notify_all();
+}
+
 /** @internal
- * @brief Swap the working buffer with the presented buffer and notify consumers
+ * @brief Frame that incoming payloads are assembled into
+ *
+ * Frames come out of the pool with room for dwMaxVideoFrameSize, so the
+ * payloads land in the buffer that is eventually handed to the consumer.
+ */
+static uvc_frame* _uvc_current_frame(uvc_stream_handle_t *strmh) {
+  if (!strmh->cur_frame && !strmh->dropping) {
+    auto f = strmh->frame_pool->grab_frame(strmh->cur_ctrl.dwMaxVideoFrameSize, strmh->metadata_max);
+    if (!f) {
+      UVC_DEBUG("frame pool exhausted, dropping frame");
+      strmh->dropping = true;
+      return nullptr;
+    }
+    f->data_bytes = 0;
+    f->metadata_bytes = 0;
+    strmh->cur_frame = f;
+  }
+  return strmh->cur_frame;
+}
+
+/** @internal
+ * @brief Hand the frame being assembled to the consumer
  */
 void _uvc_swap_buffers(uvc_stream_handle_t *strmh) {
-  auto f = strmh->frame_pool->grab_frame(strmh->got_bytes, strmh->metadata_bytes);
-  memcpy(f->data, strmh->outbuf, strmh->got_bytes);
-  memcpy(f->metadata, strmh->metadata_buf, strmh->metadata_bytes);
-  f->sequence = strmh->seq++;
-  auto drop_frame = strmh->full_frame;
-  strmh->full_frame = f;
-  strmh->cb_cond.notify_all();
+  auto f = _uvc_current_frame(strmh);
+  auto got_bytes = strmh->got_bytes;
+  strmh->cur_frame = nullptr;
   strmh->got_bytes = 0;
   strmh->last_scr = 0;
   strmh->pts = 0;
-  if (drop_frame) {
-    strmh->frame_pool->release_frame(drop_frame);
+  if (!f) {
+    /* the frame had no buffer; the next one gets a fresh chance */
+    strmh->dropping = false;
+    strmh->seq++;
+    return;
+  }
+  f->data_bytes = got_bytes;
+  f->sequence = strmh->seq++;
+  f->capture_time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+  RU_TRACE(TRACE_DQBUF, f->capture_time_ns);
+  if (!strmh->handoff.push(f)) {
+    UVC_DEBUG("consumer is behind, dropping frame %u", f->sequence);
+    strmh->frame_pool->release_frame(f);
+  } else if (strmh->user_cb) {
+    _uvc_schedule_callbacks(strmh);
   }
 }
 
@@ -800,11 +949,6 @@ void _uvc_process_payload(uvc_stream_handle_t *strmh, uint8_t *payload, size_t p
             return;
         }
 
-        if (header_len <= strmh->metadata_max) {
-            memcpy(strmh->metadata_buf, payload, header_len);
-            strmh->metadata_bytes = header_len;
-        }
-
     if (strmh->devh->is_isight)
       data_len = 0;
     else
@@ -833,6 +977,13 @@ void _uvc_process_payload(uvc_stream_handle_t *strmh, uint8_t *payload, size_t p
 
     strmh->fid = header_info & 1;
 
+    /* the latest header of a frame is kept as its metadata */
+    auto f = _uvc_current_frame(strmh);
+    if (f && (header_len <= strmh->metadata_max)) {
+      memcpy(f->metadata, payload, header_len);
+      f->metadata_bytes = (uint8_t)header_len;
+    }
+
     if (header_info & (1 << 2)) {
       strmh->pts = DW_TO_INT(payload + variable_offset);
       variable_offset += 4;
@@ -846,7 +997,16 @@ void _uvc_process_payload(uvc_stream_handle_t *strmh, uint8_t *payload, size_t p
   }
 
   if (data_len > 0) {
-    memcpy(strmh->outbuf + strmh->got_bytes, payload + header_len, data_len);
+    /* a dropped frame still counts its bytes, to detect the frame boundary */
+    auto f = _uvc_current_frame(strmh);
+    if (f) {
+      if (strmh->got_bytes + data_len > f->data_max) {
+        /* larger than dwMaxVideoFrameSize promised */
+        f->data_bytes = strmh->got_bytes;
+        f->resize_data(strmh->got_bytes + data_len);
+      }
+      memcpy((uint8_t *)f->data + strmh->got_bytes, payload + header_len, data_len);
+    }
     strmh->got_bytes += data_len;
 
     if (header_info & (1 << 1)) {
@@ -856,6 +1016,54 @@ void _uvc_process_payload(uvc_stream_handle_t *strmh, uint8_t *payload, size_t p
   }
 }
 
+/** @internal
+ * @brief Free a transfer that will not be resubmitted
+ * must be called with stream cb lock held!
+ */
+static void _uvc_free_transfer(uvc_stream_handle_t *strmh, struct libusb_transfer *transfer) {
+  auto it = std::find(strmh->transfers.begin(), strmh->transfers.end(), transfer);
+  if (it == strmh->transfers.end()) {
+    UVC_DEBUG("transfer %p not found; not freeing!", transfer);
+    return;
+  }
+  UVC_DEBUG("Freeing transfer %d (%p)", (int)(it - strmh->transfers.begin()), transfer);
+  free(transfer->buffer);
+  libusb_free_transfer(transfer);
+  *it = NULL;
+  strmh->transfer_cancel.notify_all();
+}
+
+/** @internal
+ * @brief Pick the number and size of the bulk transfers kept in flight
+ *
+ * A bulk payload ends with a short packet, which completes the transfer,
+ * so each transfer only has to hold one dwMaxPayloadTransferSize payload.
+ * Enough of them are queued to cover a whole frame, within
+ * LIBUVC_MAX_TRANSFER_BUFS and LIBUVC_MAX_TRANSFER_BYTES.
+ */
+static void _uvc_size_transfers(uvc_stream_handle_t *strmh, int *num_transfers, size_t *transfer_size) {
+  size_t payload = strmh->cur_ctrl.dwMaxPayloadTransferSize;
+  size_t frame = strmh->cur_ctrl.dwMaxVideoFrameSize;
+  size_t size = strmh->transfer_buf_size;
+  if (size < payload) size = payload;
+  if (size == 0) size = frame;
+
+  int count = strmh->num_transfer_bufs;
+  if (count <= 0) {
+    count = LIBUVC_NUM_TRANSFER_BUFS;
+    if (size > 0) {
+      int per_frame = (int)((frame + size - 1) / size) + 1;
+      if (count < per_frame) count = per_frame;
+      int budget = (int)(LIBUVC_MAX_TRANSFER_BYTES / size);
+      if (count > budget) count = budget;
+    }
+    if (count < 2) count = 2;
+  }
+  if (count > LIBUVC_MAX_TRANSFER_BUFS) count = LIBUVC_MAX_TRANSFER_BUFS;
+  *num_transfers = count;
+  *transfer_size = size;
+}
+
 /** @internal
  * @brief Stream transfer callback
  *
@@ -907,26 +1115,9 @@ void LIBUSB_CALL _uvc_stream_callback(struct libusb_transfer *transfer) {
         
   case LIBUSB_TRANSFER_CANCELLED:
   case LIBUSB_TRANSFER_NO_DEVICE: {
-    int i;
     UVC_DEBUG("not retrying transfer, status = %d", transfer->status);    
-    {
-        /* Mark transfer as deleted. */
-        for (i = 0; i < LIBUVC_NUM_TRANSFER_BUFS; i++) {
-            if (strmh->transfers[i] == transfer) {
-                UVC_DEBUG("Freeing transfer %d (%p)", i, transfer);
-                free(transfer->buffer);
-                libusb_free_transfer(transfer);
-                strmh->transfers[i] = NULL;
-                strmh->transfer_cancel[i].notify_all();
-                break;
-            }
-        }
-        if (i == LIBUVC_NUM_TRANSFER_BUFS) {
-            UVC_DEBUG("transfer %p not found; not freeing!", transfer);
-        }
-        resubmit = 0;
-    }
-
+    _uvc_free_transfer(strmh, transfer);
+    resubmit = 0;
     break;
   }
   case LIBUSB_TRANSFER_TIMED_OUT:
@@ -937,31 +1128,12 @@ void LIBUSB_CALL _uvc_stream_callback(struct libusb_transfer *transfer) {
     break;
   }
   
-    if ( resubmit )
-    {
-        if ( strmh->running )
-        {
-            libusb_submit_transfer(transfer);
-        }
-        else
-        {
-            int i;
-            /* Mark transfer as deleted. */
-            for(i=0; i < LIBUVC_NUM_TRANSFER_BUFS; i++) {
-                if(strmh->transfers[i] == transfer) {
-                    UVC_DEBUG("Freeing orphan transfer %d (%p)", i, transfer);
-                    free(transfer->buffer);
-                    libusb_free_transfer(transfer);
-                    strmh->transfers[i] = NULL;
-                    strmh->transfer_cancel[i].notify_all();
-
-                }
-            }
-            if(i == LIBUVC_NUM_TRANSFER_BUFS ) {
-                UVC_DEBUG("orphan transfer %p not found; not freeing!", transfer);
-            }
-        }
+  if (resubmit) {
+    if (!strmh->running || libusb_submit_transfer(transfer) < 0) {
+      /* Nobody will see this transfer complete again */
+      _uvc_free_transfer(strmh, transfer);
     }
+  }
 }
 
 /** Begin streaming video from the camera into the callback function.
@@ -1086,10 +1258,8 @@ uvc_error_t uvc_stream_open_ctrl(uvc_device_handle_t *devh, uvc_stream_handle_t
 
  // Set up the streaming status and data space
  strmh->running = 0;
-  /** @todo take only what we need */
-  strmh->outbuf = (uint8_t *)malloc(LIBUVC_XFER_BUF_SIZE);
-  strmh->metadata_max = 2048;
-  strmh->metadata_buf = (uint8_t *)malloc(strmh->metadata_max);
+  /* a payload header is at most 255 bytes */
+  strmh->metadata_max = 256;
 
   DL_APPEND(devh->streams, strmh);
 
@@ -1105,6 +1275,89 @@ fail:
   return ret;
 }
 
+/** Configure the bulk transfers used by the stream.
+ * @ingroup streaming
+ *
+ * Takes effect at the next uvc_stream_start().
+ *
+ * @param strmh UVC stream
+ * @param num_transfers Number of transfers kept queued, 0 to derive it from the frame size
+ * @param transfer_size Bytes per transfer, 0 for the negotiated dwMaxPayloadTransferSize.
+ *        Smaller values are raised to dwMaxPayloadTransferSize.
+ */
+uvc_error_t uvc_stream_set_transfers(uvc_stream_handle_t *strmh, int num_transfers, size_t transfer_size) {
+  if (num_transfers < 0 || num_transfers > LIBUVC_MAX_TRANSFER_BUFS)
+    return UVC_ERROR_INVALID_PARAM;
+  if (strmh->running)
+    return UVC_ERROR_BUSY;
+  strmh->num_transfer_bufs = num_transfers;
+  strmh->transfer_buf_size = transfer_size;
+  return UVC_SUCCESS;
+}
+
+/** Set the number of frames the stream may have outstanding.
+ * @ingroup streaming
+ *
+ * This covers the frame being received, the latest complete frame, and
+ * every frame the user has not yet released.  When all are in use, new
+ * frames are dropped.  Takes effect at the next uvc_stream_start().
+ *
+ * @param strmh UVC stream
+ * @param num_frames Pool capacity, at least 2
+ */
+uvc_error_t uvc_stream_set_frame_pool_size(uvc_stream_handle_t *strmh, size_t num_frames) {
+  if (num_frames < 2)
+    return UVC_ERROR_INVALID_PARAM;
+  if (strmh->running)
+    return UVC_ERROR_BUSY;
+  strmh->frame_pool_size = num_frames;
+  return UVC_SUCCESS;
+}
+
+/** Get frame pool usage, including how many frames were dropped for lack of a free frame.
+ * @ingroup streaming
+ *
+ * @param strmh UVC stream
+ * @param[out] stats Pool counters
+ */
+uvc_error_t uvc_stream_get_frame_pool_stats(uvc_stream_handle_t *strmh, uvc_frame_pool_stats_t *stats) {
+  if (!stats)
+    return UVC_ERROR_INVALID_PARAM;
+  strmh->frame_pool->get_stats(stats);
+  return UVC_SUCCESS;
+}
+
+/** Set how many complete frames may wait for the consumer.
+ * @ingroup streaming
+ *
+ * Frames arriving while this many are already waiting are dropped and
+ * counted.  Takes effect at the next uvc_stream_start().
+ *
+ * @param strmh UVC stream
+ * @param depth Number of waiting frames, at least 1
+ */
+uvc_error_t uvc_stream_set_handoff_depth(uvc_stream_handle_t *strmh, size_t depth) {
+  if (depth < 1)
+    return UVC_ERROR_INVALID_PARAM;
+  if (strmh->running)
+    return UVC_ERROR_BUSY;
+  strmh->handoff_depth = depth;
+  return UVC_SUCCESS;
+}
+
+/** Count frames handed to the consumer and frames dropped because it was behind.
+ * @ingroup streaming
+ *
+ * @param strmh UVC stream
+ * @param[out] delivered Frames queued for the consumer
+ * @param[out] dropped Frames dropped with the handoff queue full
+ */
+uvc_error_t uvc_stream_get_handoff_stats(uvc_stream_handle_t *strmh, uint64_t *delivered, uint64_t *dropped) {
+  if (delivered) *delivered = strmh->handoff.delivered();
+  if (dropped) *dropped = strmh->handoff.dropped();
+  return UVC_SUCCESS;
+}
+
 /** Begin streaming video from the stream into the callback function.
  * @ingroup streaming
  *
@@ -1129,6 +1382,7 @@ uvc_error_t uvc_stream_start(
   int ret;
   /* Total amount of data per transfer */
   size_t total_transfer_size;
+  int num_transfers;
   struct libusb_transfer *transfer;
   int transfer_id;
 
@@ -1146,6 +1400,9 @@ uvc_error_t uvc_stream_start(
   strmh->fid = 0;
   strmh->pts = 0;
   strmh->last_scr = 0;
+  strmh->got_bytes = 0;
+  strmh->dropping = false;
+  strmh->handoff.reset(strmh->handoff_depth);
 
   frame_desc = uvc_find_frame_desc_stream(strmh, ctrl->bFormatIndex, ctrl->bFrameIndex);
   if (!frame_desc) {
@@ -1156,6 +1413,9 @@ uvc_error_t uvc_stream_start(
 
   strmh->frame_format = uvc_frame_format_for_guid(format_desc->guidFormat);
 
+  /* Allocate every frame the stream may use before data starts flowing */
+  strmh->frame_pool->reserve(strmh->frame_pool_size, strmh->cur_ctrl.dwMaxVideoFrameSize, strmh->metadata_max);
+
   // Get the interface that provides the chosen format and frame configuration
   interface_id = strmh->stream_if->bInterfaceNumber;
   interface = &strmh->devh->info->config->interface[interface_id];
@@ -1164,37 +1424,63 @@ uvc_error_t uvc_stream_start(
    * (UVC 1.5: 2.4.3. VideoStreaming Interface) */
   isochronous = interface->num_altsetting > 1;
 
-  for (transfer_id = 0; transfer_id < LIBUVC_NUM_TRANSFER_BUFS;
-      ++transfer_id) {
+  _uvc_size_transfers(strmh, &num_transfers, &total_transfer_size);
+  strmh->transfers.assign(num_transfers, NULL);
+  for (transfer_id = 0; transfer_id < num_transfers; ++transfer_id) {
+    uint8_t *buf = (uint8_t *)malloc(total_transfer_size);
     transfer = libusb_alloc_transfer(0);
+    if (!buf || !transfer) {
+      free(buf);
+      if (transfer) libusb_free_transfer(transfer);
+      break;
+    }
     strmh->transfers[transfer_id] = transfer;
-    strmh->transfer_bufs[transfer_id] = (uint8_t *)malloc (
-        strmh->cur_ctrl.dwMaxPayloadTransferSize );
     libusb_fill_bulk_transfer ( transfer, strmh->devh->usb_devh,
         format_desc->parent->bEndpointAddress,
-        strmh->transfer_bufs[transfer_id],
-        strmh->cur_ctrl.dwMaxPayloadTransferSize, _uvc_stream_callback,
+        buf, (int)total_transfer_size, _uvc_stream_callback,
         ( void* ) strmh, 5000 );
   }
+  if (transfer_id == 0) {
+    strmh->transfers.clear();
+    ret = UVC_ERROR_NO_MEM;
+    goto fail;
+  }
+  strmh->transfers.resize(transfer_id);
+  UVC_DEBUG("%d transfers of %zu bytes", transfer_id, total_transfer_size);
 
   strmh->user_cb = cb;
   strmh->user_ptr = user_ptr;
 
-  /* If the user wants it, set up a thread that calls the user's function
-   * with the contents of each frame.
+  /* If the user wants it, have the shared executor call the user's
+   * function with the contents of each frame.
    */
   if (cb) {
-      strmh->cb_thread = std::thread([&]() {_uvc_user_caller((void*)strmh); });
+    strmh->cb_scheduled = false;
+    uvc_usb_service::get().start_executor();
   }
 
-  for (transfer_id = 0; transfer_id < LIBUVC_NUM_TRANSFER_BUFS;
-      transfer_id++) {
-    ret = libusb_submit_transfer(strmh->transfers[transfer_id]);
-    if (ret != UVC_SUCCESS) {
-      UVC_DEBUG("libusb_submit_transfer id %d failed: %s", transfer_id, uvc_strerror((uvc_error_t)ret));
-      break;
+  /* Queue every transfer up front so the device always has somewhere to
+   * put the next payload while a completed one is being processed */
+  {
+    std::unique_lock<std::mutex> lock(strmh->cb_mutex);
+    int submitted = 0;
+    int last_error = UVC_SUCCESS;
+    for (transfer_id = 0; transfer_id < (int)strmh->transfers.size(); transfer_id++) {
+      transfer = strmh->transfers[transfer_id];
+      int res = libusb_submit_transfer(transfer);
+      if (res < 0) {
+        UVC_DEBUG("libusb_submit_transfer id %d failed: %s", transfer_id, uvc_strerror((uvc_error_t)res));
+        _uvc_free_transfer(strmh, transfer);
+        last_error = res;
+      } else {
+        ++submitted;
+      }
     }
+    /* The stream runs as long as any transfer is in flight */
+    ret = (submitted > 0) ? UVC_SUCCESS : last_error;
   }
+  if (ret != UVC_SUCCESS)
+    uvc_stream_stop(strmh);
 
   UVC_EXIT(ret);
   return (uvc_error_t)ret;
@@ -1224,37 +1510,47 @@ uvc_error_t uvc_stream_start_iso(
 }
 
 /** @internal
- * @brief User callback runner thread
- * @note There should be at most one of these per currently streaming device
- * @param arg Device handle
+ * @brief Deliver waiting frames to the user callback
+ * Runs on an executor thread; the cb_scheduled flag keeps it to one
+ * thread per stream at a time.
  */
-void *_uvc_user_caller(void *arg) {
-  uvc_stream_handle_t *strmh = (uvc_stream_handle_t *) arg;
-  uvc_frame* frame = nullptr;
-
+void _uvc_run_callbacks(uvc_stream_handle_t *strmh) {
   for (;;) {
-    {
-      std::unique_lock<std::mutex> lock(strmh->cb_mutex);
-      for (;;) {
-        if (!strmh->running) return nullptr;
-        if (strmh->full_frame) break;
-        strmh->cb_cond.wait(lock);
-      }
-      frame = strmh->full_frame;
-      strmh->full_frame = nullptr;
+    while (strmh->running) {
+      auto frame = strmh->handoff.pop();
+      if (!frame) break;
+      strmh->user_cb(frame, strmh->user_ptr);
     }
-    strmh->user_cb(frame, strmh->user_ptr);
+    strmh->cb_scheduled.store(false);
+    /* A frame pushed after our last pop but before the flag cleared did
+     * not reschedule us, so look again */
+    if (!strmh->running || strmh->handoff.empty())
+      break;
+    if (strmh->cb_scheduled.exchange(true))
+      break;
   }
-  return nullptr; // return value ignored
+  std::lock_guard<std::mutex> lock(strmh->cb_idle_mutex);
+  --strmh->cb_runs;
+  strmh->cb_idle.notify_all();
+}
+
+/** @internal
+ * @brief Make sure the executor will look at the stream's waiting frames
+ */
+static void _uvc_schedule_callbacks(uvc_stream_handle_t *strmh) {
+  if (strmh->cb_scheduled.exchange(true))
+    return;
+  {
+    std::lock_guard<std::mutex> lock(strmh->cb_idle_mutex);
+    ++strmh->cb_runs;
+  }
+  uvc_usb_service::get().schedule(strmh);
 }
 
 /** @internal
  * @brief Populate the fields of a frame to be handed to user code
- * must be called with stream cb lock held!
  */
-void _uvc_populate_frame(uvc_stream_handle_t *strmh) {
-  size_t alloc_size = strmh->cur_ctrl.dwMaxVideoFrameSize;
-  uvc_frame_t *frame = strmh->full_frame;
+void _uvc_populate_frame(uvc_stream_handle_t *strmh, uvc_frame_t *frame) {
   uvc_frame_desc_t *frame_desc;
 
   /** @todo this stuff that hits the main config cache should really happen
@@ -1295,11 +1591,6 @@ void _uvc_populate_frame(uvc_stream_handle_t *strmh) {
 uvc_error_t uvc_stream_get_frame(uvc_stream_handle_t *strmh,
 			  uvc_frame_t **frame,
 			  int32_t timeout_us) {
-  time_t add_secs;
-  time_t add_nsecs;
-  struct timespec ts;
-  struct timeval tv;
-
   auto old_frame = *frame;
   if (old_frame) {
     strmh->frame_pool->release_frame(old_frame);
@@ -1312,70 +1603,18 @@ uvc_error_t uvc_stream_get_frame(uvc_stream_handle_t *strmh,
   if (strmh->user_cb)
     return UVC_ERROR_CALLBACK_EXISTS;
 
-  {
-      std::unique_lock<std::mutex> lock(strmh->cb_mutex);
-      
-      if (!strmh->running) {
-        return UVC_ERROR_INVALID_PARAM;
-      } else if (strmh->full_frame) {
-        *frame = strmh->full_frame;
-        strmh->full_frame = nullptr;
-      } else if (timeout_us != -1) {
-          if (timeout_us == 0) {
-              strmh->cb_cond.wait(lock);
-          }
-          else {
-              add_secs = timeout_us / 1000000;
-              add_nsecs = (timeout_us % 1000000) * 1000;
-              ts.tv_sec = 0;
-              ts.tv_nsec = 0;
-
-#if _POSIX_TIMERS > 0
-              clock_gettime(CLOCK_REALTIME, &ts);
-#else
-              gettimeofday(&tv, NULL);
-              ts.tv_sec = tv.tv_sec;
-              ts.tv_nsec = tv.tv_usec * 1000;
-#endif
-
-              ts.tv_sec += add_secs;
-              ts.tv_nsec += add_nsecs;
-
-              /* pthread_cond_timedwait FAILS with EINVAL if ts.tv_nsec > 1000000000 (1 billion)
-               * Since we are just adding values to the timespec, we have to increment the seconds if nanoseconds is greater than 1 billion,
-               * and then re-adjust the nanoseconds in the correct range.
-               * */
-              ts.tv_sec += ts.tv_nsec / 1000000000;
-              ts.tv_nsec = ts.tv_nsec % 1000000000;
-
-              auto d = std::chrono::seconds{ ts.tv_sec }
-              + std::chrono::nanoseconds{ ts.tv_nsec };
-
-              std::chrono::time_point<std::chrono::system_clock> tp{ std::chrono::duration_cast<std::chrono::system_clock::duration>(d) };
-              std::cv_status err{ std::cv_status::no_timeout };
-              try {
-                  err = strmh->cb_cond.wait_until(lock, tp);
-              }
-              catch (...)
-              {
-                  return UVC_ERROR_OTHER;
-              }
-
-              //TODO: How should we handle EINVAL?
-              switch (err) {
-                  case std::cv_status::timeout:
-                      return UVC_ERROR_TIMEOUT;
-              }
-          }
-
-          if (strmh->full_frame) {
-              *frame = strmh->full_frame;
-              strmh->full_frame = nullptr;
-          }
-      }
-
+  if (timeout_us == -1) {
+    *frame = strmh->handoff.pop();
+    return UVC_SUCCESS;
   }
 
+  *frame = strmh->handoff.pop_wait(strmh->running, (timeout_us == 0) ? -1 : timeout_us);
+  if (!*frame) {
+    if (!strmh->running)
+      return UVC_ERROR_INVALID_PARAM;
+    if (timeout_us > 0)
+      return UVC_ERROR_TIMEOUT;
+  }
   return UVC_SUCCESS;
 }
 
@@ -1402,48 +1641,44 @@ void uvc_stop_streaming(uvc_device_handle_t *devh) {
  * @param devh UVC device
  */
 uvc_error_t uvc_stream_stop(uvc_stream_handle_t *strmh) {
-  int i;
-
   if (!strmh->running)
     return UVC_ERROR_INVALID_PARAM;
     
   {
     std::unique_lock<std::mutex> lock(strmh->cb_mutex);
     strmh->running = 0;
-    for (i = 0; i < LIBUVC_NUM_TRANSFER_BUFS; i++)
-    {
-        if (strmh->transfers[i] != NULL)
-        {
-            int res = libusb_cancel_transfer(strmh->transfers[i]);
-            if (res < 0)
-            {
-                free(strmh->transfers[i]->buffer);
-                libusb_free_transfer(strmh->transfers[i]);
-                strmh->transfers[i] = NULL;
-            }
-        }
-    }
-      
-    for (i = 0; i < LIBUVC_NUM_TRANSFER_BUFS; i++)
-    {
-        if (strmh->transfers[i] != NULL)
-            strmh->transfer_cancel[i].wait(lock);
+    for (auto transfer : strmh->transfers) {
+      if (transfer && libusb_cancel_transfer(transfer) < 0) {
+        /* not in flight, so no callback will free it */
+        _uvc_free_transfer(strmh, transfer);
+      }
     }
-  
-    
-   // Kick the user thread awake
-   strmh->cb_cond.notify_all();
+    strmh->transfer_cancel.wait(lock, [strmh]() {
+      return std::all_of(strmh->transfers.begin(), strmh->transfers.end(),
+                         [](struct libusb_transfer *t) { return t == NULL; });
+    });
+    strmh->transfers.clear();
+
   }
+  // Kick the user thread awake
+  strmh->handoff.wake();
   /** @todo stop the actual stream, camera side? */
 
   if (strmh->user_cb) {
-    /* wait for the thread to stop (triggered by
-     * LIBUSB_TRANSFER_CANCELLED transfer) */
-      strmh->cb_thread.join();
+    /* wait until no executor thread is calling back for this stream */
+    {
+      std::unique_lock<std::mutex> lock(strmh->cb_idle_mutex);
+      strmh->cb_idle.wait(lock, [strmh]() { return strmh->cb_runs == 0; });
     }
+    uvc_usb_service::get().stop_executor();
+  }
   
   auto res = libusb_clear_halt(strmh->devh->usb_devh,strmh->stream_if->bEndpointAddress);
 
+  /* Frames nobody will consume */
+  while (auto f = strmh->handoff.pop())
+    strmh->frame_pool->release_frame(f);
+
   return UVC_SUCCESS;
 }
 
@@ -1460,18 +1695,10 @@ void uvc_stream_close(uvc_stream_handle_t *strmh) {
 
   uvc_release_if(strmh->devh, strmh->stream_if->bInterfaceNumber);
   
-  if (strmh->full_frame) {
-    auto f = strmh->full_frame;
-    strmh->full_frame = nullptr;
-    delete f;
-  }
-  if (strmh->outbuf) {
-    free(strmh->outbuf);
-    strmh->outbuf = nullptr;
-  }
-  if (strmh->metadata_buf) {
-    free(strmh->metadata_buf);
-    strmh->metadata_buf = nullptr;
+  if (strmh->cur_frame) {
+    auto f = strmh->cur_frame;
+    strmh->cur_frame = nullptr;
+    strmh->frame_pool->release_frame(f);
   }
 
   DL_DELETE(strmh->devh->streams, strmh);
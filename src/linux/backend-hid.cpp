@@ -41,6 +41,8 @@
 #include <list>
 
 #include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <signal.h>
 
 #pragma GCC diagnostic ignored "-Woverflow"
@@ -173,14 +175,258 @@ namespace librealuvc
             device_enabled_file.close();
         }
 
+        hid_reader::hid_reader()
+            : _destroyed(nullptr),
+              _epoll_fd(-1),
+              _wake_fd(-1),
+              _next_cookie(1),
+              _running(0),
+              _stopping(false)
+        {
+            _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            if (_epoll_fd < 0)
+                throw linux_backend_exception("hid_reader: epoll_create1 failed");
+
+            _wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if (_wake_fd < 0)
+            {
+                ::close(_epoll_fd);
+                throw linux_backend_exception("hid_reader: eventfd failed");
+            }
+
+            // cookie 0 is the wakeup
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.u64 = 0;
+            if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _wake_fd, &ev) < 0)
+            {
+                ::close(_wake_fd);
+                ::close(_epoll_fd);
+                throw linux_backend_exception("hid_reader: epoll_ctl(_wake_fd) failed");
+            }
+        }
+
+        hid_reader::~hid_reader()
+        {
+            _stopping = true;
+            uint64_t one = 1;
+            if (write(_wake_fd, &one, sizeof(one)) < 0)
+                LOG_ERROR("hid_reader: could not wake the reader thread");
+
+            // The last reference may go away at the end of a dispatch, on
+            // the reader thread itself. run() sees its flag and returns
+            // without touching the reader again.
+            if (_thread.get_id() == std::this_thread::get_id())
+            {
+                if (_destroyed)
+                    *_destroyed = true;
+                _thread.detach();
+            }
+            else if (_thread.joinable())
+            {
+                _thread.join();
+            }
+
+            ::close(_wake_fd);
+            ::close(_epoll_fd);
+        }
+
+        std::shared_ptr<hid_reader> hid_reader::create()
+        {
+            std::shared_ptr<hid_reader> reader(new hid_reader());
+            reader->_self = reader;
+            auto raw = reader.get();
+            reader->_thread = std::thread([raw]() { raw->run(); });
+            return reader;
+        }
+
+        std::shared_ptr<hid_reader> hid_reader::get()
+        {
+            static std::mutex instance_mutex;
+            static std::weak_ptr<hid_reader> instance;
+
+            std::lock_guard<std::mutex> lock(instance_mutex);
+            auto reader = instance.lock();
+            if (!reader)
+            {
+                reader = create();
+                instance = reader;
+            }
+            return reader;
+        }
+
+        void hid_reader::add(int fd, handler on_readable)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_cookies.count(fd))
+                throw linux_backend_exception(to_string() << "hid_reader: fd " << fd << " is already watched");
+
+            auto cookie = _next_cookie++;
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.u64 = cookie;
+            if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+                throw linux_backend_exception(to_string() << "hid_reader: epoll_ctl(" << fd << ") failed");
+
+            _entries[cookie] = entry{ fd, std::make_shared<handler>(std::move(on_readable)) };
+            _cookies[fd] = cookie;
+        }
+
+        void hid_reader::remove(int fd)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto it = _cookies.find(fd);
+            if (it == _cookies.end())
+                return;
+
+            auto cookie = it->second;
+            erase_locked(cookie);
+
+            if (_thread.get_id() == std::this_thread::get_id())
+                return;
+
+            _idle.wait(lock, [&]() { return _running != cookie; });
+        }
+
+        size_t hid_reader::size()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _entries.size();
+        }
+
+        void hid_reader::erase_locked(uint64_t cookie)
+        {
+            auto it = _entries.find(cookie);
+            if (it == _entries.end())
+                return;
+
+            epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+            _cookies.erase(it->second.fd);
+            _entries.erase(it);
+        }
+
+        void hid_reader::run()
+        {
+            const int max_events = 16;
+            epoll_event events[max_events];
+            bool destroyed = false;
+            _destroyed = &destroyed;
+
+            while (!_stopping)
+            {
+                auto val = epoll_wait(_epoll_fd, events, max_events, 5000);
+                if (val < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    LOG_ERROR("hid_reader: epoll_wait failed, errno " << errno);
+                    return;
+                }
+
+                if (val == 0)
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    if (!_entries.empty())
+                        LOG_WARNING("hid_reader: Frames didn't arrived within 5 seconds");
+                    continue;
+                }
+
+                for (int i = 0; i < val; ++i)
+                {
+                    auto cookie = events[i].data.u64;
+                    if (cookie == 0)
+                    {
+                        uint64_t count;
+                        if (read(_wake_fd, &count, sizeof(count)) < 0)
+                            LOG_DEBUG("hid_reader: wakeup already drained");
+                        continue;
+                    }
+
+                    // Hold the reader for the dispatch. When this is the last
+                    // reference its release destroys the reader, right here.
+                    auto self = _self.lock();
+                    if (!self)
+                        return; // being destroyed by another thread, which joins us
+                    dispatch(cookie);
+                    self.reset();
+                    if (destroyed)
+                        return;
+                }
+            }
+        }
+
+        void hid_reader::dispatch(uint64_t cookie)
+        {
+            entry e;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                auto it = _entries.find(cookie);
+                // removed since epoll_wait returned
+                if (it == _entries.end())
+                    return;
+                e = it->second;
+                _running = cookie;
+            }
+
+            auto keep = false;
+            try
+            {
+                keep = (*e.on_readable)(e.fd);
+            }
+            catch (const std::exception& ex)
+            {
+                LOG_ERROR("hid_reader: handler for fd " << e.fd << " threw: " << ex.what());
+            }
+            catch (...)
+            {
+                LOG_ERROR("hid_reader: handler for fd " << e.fd << " threw");
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _running = 0;
+                if (!keep && _entries.count(cookie))
+                {
+                    LOG_WARNING("hid_reader: fd " << e.fd << " closed or failed, no longer watched");
+                    erase_locked(cookie);
+                }
+            }
+            _idle.notify_all();
+            // A removed entry's handler, and what it captured, goes with e
+        }
+
+        hid_scan_decoder::hid_scan_decoder(const hid_sample_batch& layout, uint32_t max_scans, hid_batch_callback callback)
+            : _raw_data(layout.stride * max_scans),
+              _batch(layout),
+              _callback(std::move(callback))
+        {
+            _batch.count = 0;
+            _batch.samples = _raw_data.data();
+        }
+
+        bool hid_scan_decoder::read_from(int fd)
+        {
+            auto read_size = read(fd, _raw_data.data(), _raw_data.size());
+            if (read_size < 0)
+                return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+            if (read_size == 0)
+                return false;
+
+            _batch.count = (uint32_t)(read_size / _batch.stride);
+            _batch.monotonic_ns = monotonic_now_ns();
+            if (_batch.count > 0)
+                _callback(_batch);
+            return true;
+        }
+
         hid_custom_sensor::hid_custom_sensor(const std::string& device_path, const std::string& sensor_name)
             : _custom_device_path(device_path),
               _custom_sensor_name(sensor_name),
+              _sensor_id(0),
               _callback(nullptr),
               _is_capturing(false),
               _custom_device_name(""),
-              _fd(0),
-              _stop_pipe_fd{}
+              _fd(0)
         {
             init();
         }
@@ -220,7 +466,7 @@ namespace librealuvc
 
 
         // start capturing and polling.
-        void hid_custom_sensor::start_capture(hid_callback sensor_callback)
+        void hid_custom_sensor::start_capture(hid_batch_callback sensor_callback)
         {
             if (_is_capturing)
                 return;
@@ -258,76 +504,36 @@ namespace librealuvc
                 throw linux_backend_exception("open() failed with all retries!");
             }
 
-            if (pipe(_stop_pipe_fd) < 0)
+            _sensor_id = hid_sensor_intern(get_sensor_name());
+            _callback = sensor_callback;
+
+            static const uint32_t buf_len = 128;
+            const uint32_t channel_size = 24; // TODO: why 24?
+
+            // Custom reports are passed on whole, as both data and metadata
+            hid_sample_batch layout{};
+            layout.sensor = _sensor_id;
+            layout.stride = channel_size;
+            layout.data_size = channel_size;
+            layout.metadata_offset = 0;
+            layout.metadata_size = channel_size;
+            _decoder.reset(new hid_scan_decoder(layout, buf_len, _callback));
+
+            try
+            {
+                _reader = hid_reader::get();
+                auto decoder = _decoder;
+                _reader->add(_fd, [decoder](int fd) { return decoder->read_from(fd); });
+            }
+            catch (...)
             {
+                _reader.reset();
+                _decoder.reset();
                 close(_fd);
                 enable(false);
-                throw linux_backend_exception("hid_custom_sensor: Cannot create pipe!");
+                throw;
             }
-
-            _callback = sensor_callback;
             _is_capturing = true;
-            _hid_thread = std::unique_ptr<std::thread>(new std::thread([this, read_device_path_str](){
-                static const uint32_t buf_len = 128;
-                const uint32_t channel_size = 24; // TODO: why 24?
-                std::vector<uint8_t> raw_data(channel_size * buf_len);
-
-                do {
-                    fd_set fds;
-                    FD_ZERO(&fds);
-                    FD_SET(_fd, &fds);
-                    FD_SET(_stop_pipe_fd[0], &fds);
-
-                    int max_fd = std::max(_stop_pipe_fd[0], _fd);
-                    size_t read_size = 0;
-
-                    struct timeval tv = {5,0};
-                    auto val = select(max_fd + 1, &fds, NULL, NULL, &tv);
-                    if (val < 0)
-                    {
-                        // TODO: write to log?
-                        continue;
-                    }
-                    else if (val > 0)
-                    {
-                        if(FD_ISSET(_stop_pipe_fd[0], &fds))
-                        {
-                            if(!_is_capturing)
-                            {
-                                LOG_INFO("hid_custom_sensor: Stream finished");
-                                return;
-                            }
-                        }
-                        else if (FD_ISSET(_fd, &fds))
-                        {
-                            read_size = read(_fd, raw_data.data(), raw_data.size());
-                            if (read_size <= 0 )
-                                continue;
-                        }
-                        else
-                        {
-                            // TODO: write to log?
-                            continue;
-                        }
-
-                        for (auto i = 0; i < read_size / channel_size; ++i)
-                        {
-                            auto p_raw_data = raw_data.data() + channel_size * i;
-
-                            // TODO: code refactoring to reduce latency
-                            sensor_data sens_data{};
-                            sens_data.sensor = hid_sensor{get_sensor_name()};
-
-                            sens_data.fo = {channel_size, channel_size, p_raw_data, p_raw_data};
-                            this->_callback(sens_data);
-                        }
-                    }
-                    else
-                    {
-                        LOG_WARNING("hid_custom_sensor: Frames didn't arrived within 5 seconds");
-                    }
-                } while(this->_is_capturing);
-            }));
         }
 
         void hid_custom_sensor::stop_capture()
@@ -339,21 +545,17 @@ namespace librealuvc
             }
 
             _is_capturing = false;
-            signal_stop();
-            _hid_thread->join();
+            _reader->remove(_fd);
+            _reader.reset();
+            _decoder.reset();
+            LOG_INFO("hid_custom_sensor: Stream finished");
             enable(false);
             _callback = NULL;
 
-            if(::close(_fd) < 0)
-                throw linux_backend_exception("hid_custom_sensor: close(_fd) failed");
-
-            if(::close(_stop_pipe_fd[0]) < 0)
-               throw linux_backend_exception("hid_custom_sensor: close(_stop_pipe_fd[0]) failed");
-            if(::close(_stop_pipe_fd[1]) < 0)
-               throw linux_backend_exception("hid_custom_sensor: close(_stop_pipe_fd[1]) failed");
-
+            auto fd = _fd;
             _fd = 0;
-            _stop_pipe_fd[0] = _stop_pipe_fd[1] = 0;
+            if(::close(fd) < 0)
+                throw linux_backend_exception("hid_custom_sensor: close(_fd) failed");
         }
 
         std::vector<uint8_t> hid_custom_sensor::read_report(const std::string& name_report_path)
@@ -445,24 +647,14 @@ namespace librealuvc
 //            }
         }
 
-        void hid_custom_sensor::signal_stop()
-        {
-            char buff[1];
-            buff[0] = 0;
-            if (write(_stop_pipe_fd[1], buff, 1) < 0)
-            {
-                 throw linux_backend_exception("hid_custom_sensor: Could not signal video capture thread to stop. Error write to pipe.");
-            }
-        }
-
         iio_hid_sensor::iio_hid_sensor(const std::string& device_path, uint32_t frequency)
             : _iio_device_path(device_path),
               _sensor_name(""),
+              _sensor_id(0),
               _callback(nullptr),
               _is_capturing(false),
               _sampling_frequency_name(""),
-              _fd(0),
-              _stop_pipe_fd{}
+              _fd(0)
         {
             init(frequency);
         }
@@ -483,7 +675,7 @@ namespace librealuvc
         }
 
         // start capturing and polling.
-        void iio_hid_sensor::start_capture(hid_callback sensor_callback)
+        void iio_hid_sensor::start_capture(hid_batch_callback sensor_callback)
         {
             if (_is_capturing)
                 return;
@@ -522,80 +714,33 @@ namespace librealuvc
                 throw linux_backend_exception("open() failed with all retries!");
             }
 
-            if (pipe(_stop_pipe_fd) < 0)
+            _sensor_id = hid_sensor_intern(get_sensor_name());
+            _callback = sensor_callback;
+
+            const uint32_t channel_size = get_channel_size();
+            hid_sample_batch layout{};
+            layout.sensor = _sensor_id;
+            layout.stride = channel_size;
+            layout.data_size = channel_size - HID_METADATA_SIZE;
+            layout.metadata_offset = layout.data_size;
+            layout.metadata_size = (has_metadata() ? HID_METADATA_SIZE : 0);
+            _decoder.reset(new hid_scan_decoder(layout, buf_len, _callback));
+
+            try
+            {
+                _reader = hid_reader::get();
+                auto decoder = _decoder;
+                _reader->add(_fd, [decoder](int fd) { return decoder->read_from(fd); });
+            }
+            catch (...)
             {
+                _reader.reset();
+                _decoder.reset();
                 close(_fd);
                 _channels.clear();
-                throw linux_backend_exception("iio_hid_sensor: Cannot create pipe!");
+                throw;
             }
-
-            _callback = sensor_callback;
             _is_capturing = true;
-            _hid_thread = std::unique_ptr<std::thread>(new std::thread([this](){
-                const uint32_t channel_size = get_channel_size();
-                auto raw_data_size = channel_size*buf_len;
-
-                std::vector<uint8_t> raw_data(raw_data_size);
-                auto metadata = has_metadata();
-
-                do {
-                    fd_set fds;
-                    FD_ZERO(&fds);
-                    FD_SET(_fd, &fds);
-                    FD_SET(_stop_pipe_fd[0], &fds);
-
-                    int max_fd = std::max(_stop_pipe_fd[0], _fd);
-                    auto read_size = 0;
-
-                    struct timeval tv = {5, 0};
-                    auto val = select(max_fd + 1, &fds, NULL, NULL, &tv);
-                    if (val < 0)
-                    {
-                        // TODO: write to log?
-                        continue;
-                    }
-                    else if (val > 0)
-                    {
-                        if(FD_ISSET(_stop_pipe_fd[0], &fds))
-                        {
-                            if(!_is_capturing)
-                            {
-                                LOG_INFO("iio_hid_sensor: Stream finished");
-                                return;
-                            }
-                        }
-                        else if (FD_ISSET(_fd, &fds))
-                        {
-                            read_size = read(_fd, raw_data.data(), raw_data_size);
-                            if (read_size < 0 )
-                                continue;
-                        }
-                        else
-                        {
-                            // TODO: write to log?
-                            continue;
-                        }
-
-                        // TODO: code refactoring to reduce latency
-                        for (auto i = 0; i < read_size / channel_size; ++i)
-                        {
-                            auto p_raw_data = raw_data.data() + channel_size * i;
-                            sensor_data sens_data{};
-                            sens_data.sensor = hid_sensor{get_sensor_name()};
-
-                            auto hid_data_size = channel_size - HID_METADATA_SIZE;
-
-                            sens_data.fo = {hid_data_size, metadata?HID_METADATA_SIZE: uint8_t(0),  p_raw_data,  metadata?p_raw_data + hid_data_size:nullptr};
-
-                            this->_callback(sens_data);
-                        }
-                    }
-                    else
-                    {
-                        LOG_WARNING("iio_hid_sensor: Frames didn't arrived within 5 seconds");
-                    }
-                } while(this->_is_capturing);
-            }));
         }
 
         void iio_hid_sensor::stop_capture()
@@ -604,21 +749,17 @@ namespace librealuvc
                 return;
 
             _is_capturing = false;
-            signal_stop();
-            _hid_thread->join();
+            _reader->remove(_fd);
+            _reader.reset();
+            _decoder.reset();
+            LOG_INFO("iio_hid_sensor: Stream finished");
             _callback = NULL;
             _channels.clear();
 
-            if(::close(_fd) < 0)
-                throw linux_backend_exception("iio_hid_sensor: close(_fd) failed");
-
-            if(::close(_stop_pipe_fd[0]) < 0)
-               throw linux_backend_exception("iio_hid_sensor: close(_stop_pipe_fd[0]) failed");
-            if(::close(_stop_pipe_fd[1]) < 0)
-               throw linux_backend_exception("iio_hid_sensor: close(_stop_pipe_fd[1]) failed");
-
+            auto fd = _fd;
             _fd = 0;
-            _stop_pipe_fd[0] = _stop_pipe_fd[1] = 0;
+            if(::close(fd) < 0)
+                throw linux_backend_exception("iio_hid_sensor: close(_fd) failed");
         }
 
         void iio_hid_sensor::clear_buffer()
@@ -673,16 +814,6 @@ namespace librealuvc
             iio_device_file.close();
         }
 
-        void iio_hid_sensor::signal_stop()
-        {
-            char buff[1];
-            buff[0] = 0;
-            if (write(_stop_pipe_fd[1], buff, 1) < 0)
-            {
-                 throw linux_backend_exception("iio_hid_sensor: Could not signal video capture thread to stop. Error write to pipe.");
-            }
-        }
-
         bool iio_hid_sensor::has_metadata()
         {
             if(get_output_size() == HID_DATA_ACTUAL_SIZE + HID_METADATA_SIZE)
@@ -991,6 +1122,28 @@ namespace librealuvc
         }
 
         void v4l_hid_device::start_capture(hid_callback callback)
+        {
+            // Each sensor gets its own sensor_data, so the name is copied
+            // once per sensor rather than once per sample.
+            start_sensors([callback](const std::string& sensor_name) -> hid_batch_callback {
+                sensor_data sens_data{};
+                sens_data.sensor = hid_sensor{sensor_name};
+                return [callback, sens_data](const hid_sample_batch& batch) mutable {
+                    for (uint32_t i = 0; i < batch.count; ++i)
+                    {
+                        sens_data.fo = batch.frame(i);
+                        callback(sens_data);
+                    }
+                };
+            });
+        }
+
+        void v4l_hid_device::start_batch_capture(hid_batch_callback callback)
+        {
+            start_sensors([callback](const std::string&) { return callback; });
+        }
+
+        void v4l_hid_device::start_sensors(std::function<hid_batch_callback(const std::string&)> make_callback)
         {
             for (auto& profile : _hid_profiles)
             {
@@ -1020,7 +1173,7 @@ namespace librealuvc
                 try{
                 for (auto& elem : _streaming_iio_sensors)
                 {
-                    elem->start_capture(callback);
+                    elem->start_capture(make_callback(elem->get_sensor_name()));
                     captured_sensors.push_back(elem);
                 }
                 }
@@ -1040,7 +1193,7 @@ namespace librealuvc
                 try{
                 for (auto& elem : _streaming_custom_sensors)
                 {
-                    elem->start_capture(callback);
+                    elem->start_capture(make_callback(elem->get_sensor_name()));
                     captured_sensors.push_back(elem);
                 }
                 }
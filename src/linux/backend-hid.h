@@ -37,6 +37,9 @@
 #include <fts.h>
 #include <regex>
 #include <list>
+#include <map>
+#include <mutex>
+#include <condition_variable>
 
 namespace librealuvc
 {
@@ -78,6 +81,80 @@ namespace librealuvc
             hid_input_info info;
         };
 
+        // One thread and one epoll set serving the capture fds of every HID
+        // sensor in the process. A handler runs on the reader thread each time
+        // its fd becomes readable (or hangs up); returning false drops the fd.
+        // Any pollable fd works, so pipes can stand in for the IIO devices.
+        //
+        // A handler may drop the last reference to the reader, or remove its
+        // own fd: the reader stays alive until the handler returns, and so
+        // does the handler with everything it captured.
+        class hid_reader
+        {
+        public:
+            typedef std::function<bool(int fd)> handler;
+
+            ~hid_reader();
+
+            // A reader of its own, with its thread running
+            static std::shared_ptr<hid_reader> create();
+
+            // The process-wide reader: started on first use, stopped when the
+            // last sensor lets go of it.
+            static std::shared_ptr<hid_reader> get();
+
+            void add(int fd, handler on_readable);
+
+            // When this returns the fd's handler is not running and won't be
+            // called again (except when called from that handler).
+            void remove(int fd);
+
+            // number of fds being watched
+            size_t size();
+
+        private:
+            struct entry
+            {
+                int fd;
+                std::shared_ptr<handler> on_readable;
+            };
+
+            hid_reader();
+
+            void run();
+            void dispatch(uint64_t cookie);
+            void erase_locked(uint64_t cookie);
+
+            std::weak_ptr<hid_reader> _self;
+            bool* _destroyed; // run()'s flag, set when the last reference goes in a handler
+            int _epoll_fd;
+            int _wake_fd;
+            std::mutex _mutex;
+            std::condition_variable _idle;
+            std::map<uint64_t, entry> _entries; // keyed by epoll cookie
+            std::map<int, uint64_t> _cookies;
+            uint64_t _next_cookie;
+            uint64_t _running; // cookie of the handler in progress, 0 if none
+            std::atomic<bool> _stopping;
+            std::thread _thread;
+        };
+
+        // Reads whole scans from a sensor fd into a buffer of max_scans scans
+        // and hands each read on as one batch shaped like layout.
+        class hid_scan_decoder
+        {
+        public:
+            hid_scan_decoder(const hid_sample_batch& layout, uint32_t max_scans, hid_batch_callback callback);
+
+            // false once the fd is at EOF or failed
+            bool read_from(int fd);
+
+        private:
+            std::vector<uint8_t> _raw_data;
+            hid_sample_batch _batch;
+            hid_batch_callback _callback;
+        };
+
         class hid_custom_sensor {
         public:
             hid_custom_sensor(const std::string& device_path, const std::string& sensor_name);
@@ -89,7 +166,7 @@ namespace librealuvc
             const std::string& get_sensor_name() const { return _custom_sensor_name; }
 
             // start capturing and polling.
-            void start_capture(hid_callback sensor_callback);
+            void start_capture(hid_batch_callback sensor_callback);
 
             void stop_capture();
         private:
@@ -99,17 +176,16 @@ namespace librealuvc
 
             void enable(bool state);
 
-            void signal_stop();
-
-            int _stop_pipe_fd[2]; // write to _stop_pipe_fd[1] and read from _stop_pipe_fd[0]
             int _fd;
             std::map<std::string, std::string> _reports;
             std::string _custom_device_path;
             std::string _custom_sensor_name;
             std::string _custom_device_name;
-            hid_callback _callback;
+            hid_sensor_id _sensor_id;
+            hid_batch_callback _callback;
             std::atomic<bool> _is_capturing;
-            std::unique_ptr<std::thread> _hid_thread;
+            std::shared_ptr<hid_reader> _reader;
+            std::shared_ptr<hid_scan_decoder> _decoder; // shared with the reader's handler
         };
 
         // declare device sensor with all of its inputs.
@@ -120,7 +196,7 @@ namespace librealuvc
             ~iio_hid_sensor();
 
             // start capturing and polling.
-            void start_capture(hid_callback sensor_callback);
+            void start_capture(hid_batch_callback sensor_callback);
 
             void stop_capture();
 
@@ -131,8 +207,6 @@ namespace librealuvc
 
             void set_frequency(uint32_t frequency);
 
-            void signal_stop();
-
             bool has_metadata();
 
             static bool sort_hids(hid_input* first, hid_input* second);
@@ -157,7 +231,6 @@ namespace librealuvc
             void write_integer_to_param(const std::string& param,int value);
 
             static const uint32_t buf_len = 128; // TODO
-            int _stop_pipe_fd[2]; // write to _stop_pipe_fd[1] and read from _stop_pipe_fd[0]
             int _fd;
             int _iio_device_number;
             std::string _iio_device_path;
@@ -165,9 +238,11 @@ namespace librealuvc
             std::string _sampling_frequency_name;
             std::list<hid_input*> _inputs;
             std::list<hid_input*> _channels;
-            hid_callback _callback;
+            hid_sensor_id _sensor_id;
+            hid_batch_callback _callback;
             std::atomic<bool> _is_capturing;
-            std::unique_ptr<std::thread> _hid_thread;
+            std::shared_ptr<hid_reader> _reader;
+            std::shared_ptr<hid_scan_decoder> _decoder; // shared with the reader's handler
         };
 
         class v4l_hid_device : public hid_device
@@ -185,6 +260,8 @@ namespace librealuvc
 
             void start_capture(hid_callback callback);
 
+            void start_batch_capture(hid_batch_callback callback);
+
             void stop_capture();
 
             std::vector<uint8_t> get_custom_report_data(const std::string& custom_sensor_name,
@@ -196,6 +273,9 @@ namespace librealuvc
         private:
             static bool get_hid_device_info(const char* dev_path, hid_device_info& device_info);
 
+            // make_callback gives each streaming sensor its own callback
+            void start_sensors(std::function<hid_batch_callback(const std::string&)> make_callback);
+
             std::vector<hid_profile> _hid_profiles;
             std::vector<hid_device_info> _hid_device_infos;
             std::vector<std::unique_ptr<iio_hid_sensor>> _iio_hid_sensors;
@@ -0,0 +1,356 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+#include "backend-uevent.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace librealuvc
+{
+    namespace platform
+    {
+        static const uint32_t UDEV_MONITOR_MAGIC = 0xfeedcafe;
+        static const size_t UEVENT_BUFFER_SIZE = 8192;
+
+        // Header prepended by udevd to the messages it re-broadcasts.
+        struct udev_monitor_netlink_header
+        {
+            char prefix[8];             // "libudev\0"
+            uint32_t magic;             // UDEV_MONITOR_MAGIC, network byte order
+            uint32_t header_size;
+            uint32_t properties_off;
+            uint32_t properties_len;
+            uint32_t filter_subsystem_hash;
+            uint32_t filter_devtype_hash;
+            uint32_t filter_tag_bloom_hi;
+            uint32_t filter_tag_bloom_lo;
+        };
+
+        bool uevent::parse(const char* buf, size_t len, uevent& ev)
+        {
+            ev = uevent();
+            const char* props = buf;
+            const char* end = buf + len;
+
+            if (len >= sizeof(udev_monitor_netlink_header) && !memcmp(buf, "libudev", 8))
+            {
+                udev_monitor_netlink_header hdr;
+                memcpy(&hdr, buf, sizeof(hdr));
+                if (ntohl(hdr.magic) != UDEV_MONITOR_MAGIC)
+                    return false;
+                if (hdr.properties_off < sizeof(hdr) || hdr.properties_off + hdr.properties_len > len)
+                    return false;
+                props = buf + hdr.properties_off;
+                end = props + hdr.properties_len;
+            }
+            else
+            {
+                // kernel format: "action@devpath\0KEY=value\0..."
+                auto head_len = strnlen(buf, len);
+                if (head_len == len || !memchr(buf, '@', head_len))
+                    return false;
+                props = buf + head_len + 1;
+            }
+
+            while (props < end)
+            {
+                auto n = strnlen(props, end - props);
+                std::string kv(props, n);
+                props += n + 1;
+
+                auto eq = kv.find('=');
+                if (eq == std::string::npos)
+                    continue;
+                auto key = kv.substr(0, eq);
+                auto value = kv.substr(eq + 1);
+                if (key == "ACTION") ev.action = value;
+                else if (key == "DEVPATH") ev.devpath = value;
+                else if (key == "SUBSYSTEM") ev.subsystem = value;
+                else if (key == "DEVTYPE") ev.devtype = value;
+                else if (key == "DEVNAME") ev.devname = value;
+            }
+            return !ev.action.empty() && !ev.devpath.empty();
+        }
+
+        netlink_uevent_source::netlink_uevent_source(group grp)
+            : _group(grp), _fd(-1), _stop_pipe_fd{-1, -1}, _buf(UEVENT_BUFFER_SIZE)
+        {
+            _fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+            if (_fd < 0)
+                throw linux_backend_exception(to_string() << "uevent socket failed, error " << errno);
+
+            // Plug-in of a composite device produces a burst of events
+            int rcvbuf = 1 << 20;
+            setsockopt(_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+            int on = 1;
+            setsockopt(_fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
+
+            sockaddr_nl addr = {};
+            addr.nl_family = AF_NETLINK;
+            addr.nl_groups = (uint32_t)_group;
+            if (bind(_fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+            {
+                auto err = errno;
+                ::close(_fd);
+                throw linux_backend_exception(to_string() << "uevent bind failed, error " << err);
+            }
+
+            if (pipe2(_stop_pipe_fd, O_CLOEXEC | O_NONBLOCK) < 0)
+            {
+                ::close(_fd);
+                throw linux_backend_exception("uevent stop pipe failed");
+            }
+        }
+
+        netlink_uevent_source::~netlink_uevent_source()
+        {
+            for (auto fd : { _fd, _stop_pipe_fd[0], _stop_pipe_fd[1] })
+            {
+                if (fd >= 0)
+                    ::close(fd);
+            }
+        }
+
+        void netlink_uevent_source::interrupt()
+        {
+            char buff[1] = {};
+            if (write(_stop_pipe_fd[1], buff, 1) < 0)
+                LOG_WARNING("uevent stop pipe write failed, error " << errno);
+        }
+
+        bool netlink_uevent_source::receive(uevent& ev)
+        {
+            iovec iov = { _buf.data(), _buf.size() };
+            sockaddr_nl src = {};
+            char cred_msg[CMSG_SPACE(sizeof(ucred))];
+            msghdr msg = {};
+            msg.msg_name = &src;
+            msg.msg_namelen = sizeof(src);
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = cred_msg;
+            msg.msg_controllen = sizeof(cred_msg);
+
+            auto len = recvmsg(_fd, &msg, 0);
+            if (len <= 0 || (msg.msg_flags & MSG_TRUNC))
+                return false;
+
+            // Only trust the kernel (nl_pid 0) or root's udevd
+            if (_group == kernel_group && src.nl_pid != 0)
+                return false;
+            auto cmsg = CMSG_FIRSTHDR(&msg);
+            if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS)
+                return false;
+            ucred cred;
+            memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+            if (cred.uid != 0)
+                return false;
+
+            return uevent::parse(_buf.data(), (size_t)len, ev);
+        }
+
+        bool netlink_uevent_source::next_event(uevent& ev, int timeout_ms)
+        {
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+            for (;;)
+            {
+                // drain whatever is already queued before sleeping
+                if (receive(ev))
+                    return true;
+
+                int wait_ms = timeout_ms;
+                if (timeout_ms >= 0)
+                {
+                    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        deadline - std::chrono::steady_clock::now()).count();
+                    if (left <= 0)
+                        return false;
+                    wait_ms = (int)left;
+                }
+
+                pollfd fds[2] = { { _fd, POLLIN, 0 }, { _stop_pipe_fd[0], POLLIN, 0 } };
+                auto val = poll(fds, 2, wait_ms);
+                if (val < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    throw linux_backend_exception(to_string() << "uevent poll failed, error " << errno);
+                }
+                if (val == 0)
+                    return false;
+                if (fds[1].revents & POLLIN)
+                {
+                    char buff[1];
+                    while (read(_stop_pipe_fd[0], buff, 1) > 0) {}
+                    return false;
+                }
+            }
+        }
+
+        void fake_uevent_source::inject(const uevent& ev)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _events.push_back(ev);
+            _cv.notify_one();
+        }
+
+        bool fake_uevent_source::next_event(uevent& ev, int timeout_ms)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto ready = [this]() { return _interrupted || !_events.empty(); };
+            if (timeout_ms < 0)
+                _cv.wait(lock, ready);
+            else
+                _cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready);
+
+            if (_interrupted)
+            {
+                _interrupted = false;
+                return false;
+            }
+            if (_events.empty())
+                return false;
+            ev = _events.front();
+            _events.pop_front();
+            return true;
+        }
+
+        void fake_uevent_source::interrupt()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _interrupted = true;
+            _cv.notify_all();
+        }
+
+        uevent_device_watcher::uevent_device_watcher(const backend* backend,
+                                                     std::shared_ptr<uevent_source> source,
+                                                     std::chrono::milliseconds settle_time)
+            : _backend(backend), _source(source), _settle_time(settle_time), _is_running(false)
+        {
+        }
+
+        uevent_device_watcher::~uevent_device_watcher()
+        {
+            stop();
+        }
+
+        void uevent_device_watcher::start(device_changed_callback callback)
+        {
+            stop();
+            _callback = callback;
+            _last = backend_device_group(_backend->query_uvc_devices(),
+                                         _backend->query_usb_devices(),
+                                         _backend->query_hid_devices());
+            _is_running = true;
+            _thread = std::unique_ptr<std::thread>(new std::thread([this]() { watch_loop(); }));
+        }
+
+        void uevent_device_watcher::stop()
+        {
+            if (!_thread)
+                return;
+            _is_running = false;
+            _source->interrupt();
+            _thread->join();
+            _thread.reset();
+        }
+
+        bool uevent_device_watcher::apply(const uevent& ev, backend_device_group& next, unsigned& dirty) const
+        {
+            if (ev.action != "add" && ev.action != "remove")
+                return false;
+
+            if (ev.subsystem == "video4linux")
+            {
+                if (ev.action == "add")
+                {
+                    dirty |= dirty_uvc;
+                    return true;
+                }
+                // A removed node can be dropped without re-reading sysfs.
+                // The kernel names it relative to /dev, libudev in full.
+                auto sys_path = "/sys" + ev.devpath;
+                auto dev_name = ev.devname;
+                if (!dev_name.empty() && dev_name[0] != '/')
+                    dev_name = "/dev/" + dev_name;
+                auto& uvc = next.uvc_devices;
+                auto it = std::remove_if(uvc.begin(), uvc.end(), [&](const uvc_device_info& info)
+                {
+                    return info.device_path == sys_path ||
+                           (!dev_name.empty() && (info.id == dev_name ||
+                            (info.has_metadata_node && info.metadata_node_id == dev_name)));
+                });
+                if (it == uvc.end())
+                {
+                    // Not a node we know by name, so let enumeration decide
+                    dirty |= dirty_uvc;
+                    return true;
+                }
+                uvc.erase(it, uvc.end());
+                return true;
+            }
+            if (ev.subsystem == "usb" && ev.devtype == "usb_device")
+            {
+                dirty |= dirty_usb;
+                return true;
+            }
+            if (ev.subsystem == "iio" || ev.subsystem == "hid")
+            {
+                dirty |= dirty_hid;
+                return true;
+            }
+            return false;
+        }
+
+        void uevent_device_watcher::watch_loop()
+        {
+            while (_is_running)
+            {
+                try
+                {
+                    uevent ev;
+                    if (!_source->next_event(ev, -1))
+                        continue;
+
+                    auto next = _last;
+                    unsigned dirty = 0;
+                    if (!apply(ev, next, dirty))
+                        continue;
+
+                    // Coalesce the burst of events from one plug/unplug
+                    auto deadline = std::chrono::steady_clock::now() + 10 * _settle_time;
+                    while (_is_running && std::chrono::steady_clock::now() < deadline &&
+                           _source->next_event(ev, (int)_settle_time.count()))
+                    {
+                        apply(ev, next, dirty);
+                    }
+                    if (!_is_running)
+                        break;
+
+                    if (dirty & dirty_uvc) next.uvc_devices = _backend->query_uvc_devices();
+                    if (dirty & dirty_usb) next.usb_devices = _backend->query_usb_devices();
+                    if (dirty & dirty_hid) next.hid_devices = _backend->query_hid_devices();
+
+                    if (next == _last)
+                        continue;
+                    auto prev = _last;
+                    _last = next;
+                    _callback(prev, next);
+                }
+                catch (const std::exception& e)
+                {
+                    LOG_ERROR("uevent device watcher: " << e.what());
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,126 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+#pragma once
+
+#include "backend.h"
+#include "types.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace librealuvc
+{
+    namespace platform
+    {
+        // The subset of a kernel uevent that the device watcher cares about.
+        struct uevent
+        {
+            std::string action;     // "add", "remove", "change", "bind", ...
+            std::string devpath;    // sysfs path, without the leading "/sys"
+            std::string subsystem;  // "video4linux", "usb", "iio", "hid", ...
+            std::string devtype;    // e.g. "usb_device" or "usb_interface"
+            std::string devname;    // node name if any: relative to /dev from the kernel, absolute from libudev
+
+            // Parse a raw netlink datagram, either the kernel's "action@devpath"
+            // format or the "libudev" format re-broadcast by udevd.
+            static bool parse(const char* buf, size_t len, uevent& ev);
+        };
+
+        class uevent_source
+        {
+        public:
+            virtual ~uevent_source() = default;
+
+            // Wait up to timeout_ms (negative means forever) for the next event.
+            // Returns false on timeout, or when woken by interrupt().
+            virtual bool next_event(uevent& ev, int timeout_ms) = 0;
+
+            virtual void interrupt() = 0;
+        };
+
+        // Reads uevents from a NETLINK_KOBJECT_UEVENT socket. The udev group
+        // is delivered after udevd has applied its rules (so device nodes are
+        // accessible); the kernel group is for systems without udevd.
+        class netlink_uevent_source : public uevent_source
+        {
+        public:
+            enum group
+            {
+                kernel_group = 1,
+                udev_group = 2
+            };
+
+            explicit netlink_uevent_source(group grp = udev_group);
+            ~netlink_uevent_source();
+
+            bool next_event(uevent& ev, int timeout_ms) override;
+            void interrupt() override;
+
+        private:
+            bool receive(uevent& ev);
+
+            group _group;
+            int _fd;
+            int _stop_pipe_fd[2]; // write to _stop_pipe_fd[1] and read from _stop_pipe_fd[0]
+            std::vector<char> _buf;
+        };
+
+        // Events are injected by the caller, e.g. from a test or a recorded trace.
+        class fake_uevent_source : public uevent_source
+        {
+        public:
+            void inject(const uevent& ev);
+
+            bool next_event(uevent& ev, int timeout_ms) override;
+            void interrupt() override;
+
+        private:
+            std::mutex _mutex;
+            std::condition_variable _cv;
+            std::deque<uevent> _events;
+            bool _interrupted = false;
+        };
+
+        // Keeps a backend_device_group up to date from uevents. Only the
+        // subsystem named in an event is re-enumerated, and removals of video
+        // nodes are applied without touching sysfs at all.
+        class uevent_device_watcher : public device_watcher
+        {
+        public:
+            uevent_device_watcher(const backend* backend,
+                                  std::shared_ptr<uevent_source> source,
+                                  std::chrono::milliseconds settle_time = std::chrono::milliseconds(20));
+            ~uevent_device_watcher();
+
+            void start(device_changed_callback callback) override;
+            void stop() override;
+
+        private:
+            enum dirty_flags
+            {
+                dirty_uvc = 1,
+                dirty_usb = 2,
+                dirty_hid = 4
+            };
+
+            void watch_loop();
+            bool apply(const uevent& ev, backend_device_group& next, unsigned& dirty) const;
+
+            const backend* _backend;
+            std::shared_ptr<uevent_source> _source;
+            std::chrono::milliseconds _settle_time;
+            device_changed_callback _callback;
+            backend_device_group _last;
+            std::atomic<bool> _is_running;
+            std::unique_ptr<std::thread> _thread;
+        };
+    }
+}
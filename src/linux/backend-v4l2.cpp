@@ -5,7 +5,9 @@
 
 #include "backend-v4l2.h"
 #include "backend-hid.h"
+#include "backend-uevent.h"
 #include "backend.h"
+#include "trace.h"
 #include "types.h"
 
 #include <cassert>
@@ -771,6 +773,7 @@ namespace librealuvc
                 }
 
                 set_format(profile);
+                apply_crop(profile);
 
                 v4l2_streamparm parm = {};
                 parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -961,10 +964,8 @@ namespace librealuvc
                                         buf.bytesused > 0)
                                 {
                                     auto percentage = (100 * buf.bytesused) / buffer->get_full_length();
-                                    std::stringstream s;
-                                    s << "Incomplete video frame detected!\nSize " << buf.bytesused
-                                      << " out of " << buffer->get_full_length() << " bytes (" << percentage << "%)";
-                                    LOG_WARNING(s.str());
+                                    LOG_WARNING("Incomplete video frame detected!\nSize " << buf.bytesused
+                                                << " out of " << buffer->get_full_length() << " bytes (" << percentage << "%)");
 #if 0
                                     librealuvc::notification n = { RS2_NOTIFICATION_CATEGORY_FRAME_CORRUPTED, 0, RS2_LOG_SEVERITY_WARN, s.str()};
 
@@ -975,8 +976,10 @@ namespace librealuvc
                                 {
                                     if (buf.bytesused > 0)
                                     {
-                                        auto timestamp = (double)buf.timestamp.tv_sec*1000.f + (double)buf.timestamp.tv_usec/1000.f;
-                                        timestamp = monotonic_to_realtime(timestamp);
+                                        // The kernel stamps buffers with CLOCK_MONOTONIC; keep it exact
+                                        ru_nsec_t timestamp = (ru_nsec_t)buf.timestamp.tv_sec * 1000000000LL +
+                                                              (ru_nsec_t)buf.timestamp.tv_usec * 1000LL;
+                                        RU_TRACE(TRACE_DQBUF, timestamp);
 
                                         // read metadata from the frame appendix
                                         acquire_metadata(buf_mgr,fds);
@@ -991,7 +994,8 @@ namespace librealuvc
 
                                          //Invoke user callback and enqueue next frame
                                          _callback(_profile, fo,
-                                                   [buf_mgr]() mutable {
+                                                   [buf_mgr, timestamp]() mutable {
+                                             RU_TRACE(TRACE_REQUEUE, timestamp);
                                              buf_mgr.request_next_frame();
                                          });
                                     }
@@ -1420,6 +1424,12 @@ namespace librealuvc
                 throw linux_backend_exception(_name + " does not support streaming I/O");
 
             // Select video input, video standard and tune here.
+            reset_crop();
+        }
+
+        void v4l_uvc_device::reset_crop()
+        {
+            _active_crop = {};
             v4l2_cropcap cropcap = {};
             cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
             if(xioctl(_fd, VIDIOC_CROPCAP, &cropcap) == 0)
@@ -1438,6 +1448,89 @@ namespace librealuvc
             } else {} // Errors ignored
         }
 
+        bool v4l_uvc_device::get_crop(crop_rect& rect) const
+        {
+            if (_active_crop.empty())
+                return false;
+            rect = _active_crop;
+            return true;
+        }
+
+        // Crop on the device so that only the requested region crosses the bus.
+        // On success the profile is updated to the size of the cropped frames.
+        bool v4l_uvc_device::apply_crop(stream_profile& profile)
+        {
+            auto& req = _requested_crop;
+            if (req.empty())
+            {
+                // The sensor keeps its crop across streams, so a full-frame
+                // commit after a cropped one must undo it
+                auto was_cropped = !_active_crop.empty();
+                reset_crop();
+                if (was_cropped)
+                    set_format(profile);
+                return false;
+            }
+            _active_crop = {};
+
+            v4l2_rect actual = {};
+            v4l2_selection sel = {};
+            sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            sel.target = V4L2_SEL_TGT_CROP;
+            sel.flags = V4L2_SEL_FLAG_GE; // may grow, but must cover the request
+            sel.r.left = req.x;
+            sel.r.top = req.y;
+            sel.r.width = req.width;
+            sel.r.height = req.height;
+            if (xioctl(_fd, VIDIOC_S_SELECTION, &sel) == 0)
+            {
+                actual = sel.r;
+            }
+            else
+            {
+                v4l2_crop crop = {};
+                crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                crop.c = sel.r;
+                if (xioctl(_fd, VIDIOC_S_CROP, &crop) < 0 || xioctl(_fd, VIDIOC_G_CROP, &crop) < 0)
+                {
+                    LOG_INFO("Hardware crop not supported on " << _name);
+                    return false;
+                }
+                actual = crop.c;
+            }
+
+            // S_CROP has no alignment flags, so the driver may have shrunk it
+            if (actual.left > req.x || actual.top > req.y ||
+                actual.left + (int32_t)actual.width < req.x + req.width ||
+                actual.top + (int32_t)actual.height < req.y + req.height)
+            {
+                LOG_INFO("Hardware crop on " << _name << " does not cover the requested region");
+                reset_crop();
+                return false;
+            }
+
+            // Ask for unscaled frames of the cropped size
+            v4l2_format fmt = {};
+            fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            fmt.fmt.pix.width       = actual.width;
+            fmt.fmt.pix.height      = actual.height;
+            fmt.fmt.pix.pixelformat = (const big_endian<int> &)profile.format;
+            fmt.fmt.pix.field       = V4L2_FIELD_NONE;
+            if (xioctl(_fd, VIDIOC_S_FMT, &fmt) < 0 ||
+                fmt.fmt.pix.width != actual.width || fmt.fmt.pix.height != actual.height)
+            {
+                LOG_INFO("Device " << _name << " scales cropped frames, using full frames");
+                reset_crop();
+                set_format(profile);
+                return false;
+            }
+
+            _active_crop = { actual.left, actual.top, (int32_t)actual.width, (int32_t)actual.height };
+            profile.width = actual.width;
+            profile.height = actual.height;
+            return true;
+        }
+
         void v4l_uvc_device::unmap_device_descriptor()
         {
             if(::close(_fd) < 0)
@@ -1740,7 +1833,21 @@ namespace librealuvc
 
         std::shared_ptr<device_watcher> v4l_backend::create_device_watcher() const
         {
-            return nullptr /*std::make_shared<polling_device_watcher>(this)*/;
+            // udevd re-broadcasts events once device nodes are ready; fall back
+            // to the raw kernel events where no udevd is running
+            struct stat st = {};
+            auto grp = (stat("/run/udev/control", &st) == 0) ? netlink_uevent_source::udev_group
+                                                              : netlink_uevent_source::kernel_group;
+            try
+            {
+                auto source = std::make_shared<netlink_uevent_source>(grp);
+                return std::make_shared<uevent_device_watcher>(this, source);
+            }
+            catch (const std::exception& e)
+            {
+                LOG_WARNING("Device hotplug notifications unavailable: " << e.what());
+                return nullptr;
+            }
         }
 
         std::shared_ptr<backend> create_backend()
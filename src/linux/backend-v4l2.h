@@ -314,6 +314,9 @@ namespace librealuvc
             std::string get_device_location() const override { return _device_path; }
             usb_spec get_usb_specification() const override { return _device_usb_spec; }
 
+            void set_crop(const crop_rect& rect) override { _requested_crop = rect; }
+            bool get_crop(crop_rect& rect) const override;
+
         protected:
             static uint32_t get_cid(rs2_option option);
 
@@ -329,6 +332,8 @@ namespace librealuvc
             virtual void map_device_descriptor();
             virtual void unmap_device_descriptor();
             virtual void set_format(stream_profile profile);
+            virtual bool apply_crop(stream_profile& profile);
+            virtual void reset_crop();
             virtual void prepare_capture_buffers();
             virtual void stop_data_capture();
             virtual void acquire_metadata(buffers_mgr & buf_mgr,fd_set &fds);
@@ -350,6 +355,8 @@ namespace librealuvc
             bool _use_memory_map;
             int _max_fd = 0;                    // specifies the maximal pipe number the polling process will monitor
             std::vector<int>  _fds;             // list the file descriptors to be monitored during frames polling
+            crop_rect _requested_crop = {};
+            crop_rect _active_crop = {};        // empty unless the device accepted _requested_crop
 
         private:
             int _fd = 0;          // prevent unintentional abuse in derived class
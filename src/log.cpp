@@ -1,27 +1,89 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstdio>
 #include <mutex>
+#include <thread>
 
 #include "types.h"
 
 namespace librealuvc {
-  
+
+// Lowest severity wanted by any sink; checked by LOG_WITH_SEVERITY
+// before a message is formatted.
+std::atomic<int> log_enabled_severity(RU_SEVERITY_ERROR);
+
 namespace { // anon
 
+// Messages are handed to a writer thread through a bounded lock-free ring
+// (Vyukov's MPMC queue, used here with a single consumer).  Producers
+// never block: when the ring is full the message is counted and dropped.
+
+constexpr size_t LOG_RING_SIZE = 256; // must be a power of 2
+constexpr size_t LOG_ENTRY_SIZE = 480;
+
+struct log_entry {
+  std::atomic<size_t> seq;
+  ru_severity sev;
+  size_t len;
+  char text[LOG_ENTRY_SIZE];
+};
+
 class single_logger {
  public:
-  std::mutex mutex_;
-  ru_severity sev_console_;
-  ru_severity sev_file_;
+  std::mutex mutex_; // guards the sinks
+  std::atomic<int> sev_console_;
+  std::atomic<int> sev_file_;
   FILE* log_;
- 
+ private:
+  log_entry ring_[LOG_RING_SIZE];
+  std::atomic<size_t> tail_;
+  size_t head_;
+  std::atomic<size_t> dropped_;
+  std::once_flag start_once_;
+  std::thread writer_;
+  std::mutex wakeup_mutex_;
+  std::condition_variable wakeup_;
+  std::atomic<bool> writer_waiting_;
+  std::atomic<bool> stopping_;
+
  public:
   single_logger() :
     mutex_(),
     sev_console_(RU_SEVERITY_ERROR),
     sev_file_(RU_SEVERITY_NONE),
-    log_(nullptr) {
+    log_(nullptr),
+    tail_(0),
+    head_(0),
+    dropped_(0),
+    writer_waiting_(false),
+    stopping_(false) {
+    for (size_t j = 0; j < LOG_RING_SIZE; ++j) {
+      ring_[j].seq.store(j, std::memory_order_relaxed);
+    }
+  }
+
+  ~single_logger() {
+    stopping_ = true;
+    if (writer_.joinable()) {
+      wake_writer();
+      writer_.join();
+    }
+    drain();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (log_) fclose(log_);
   }
-  
+
+  void update_enabled() {
+    int sev = std::min(sev_console_.load(), sev_file_.load());
+    log_enabled_severity.store(sev, std::memory_order_relaxed);
+  }
+
+  void log_to_console(ru_severity min_sev) {
+    sev_console_ = min_sev;
+    update_enabled();
+  }
+
   void log_to_file(ru_severity min_sev, const char* file_path) {
     std::lock_guard<std::mutex> lock(mutex_);
     if (log_) fclose(log_);
@@ -31,8 +93,9 @@ class single_logger {
       exit(1);
     }
     sev_file_ = min_sev;
+    update_enabled();
   }
-  
+
   static const char* sev2str(ru_severity sev) {
     switch (sev) {
       case RU_SEVERITY_DEBUG:   return "DEBUG";
@@ -43,24 +106,113 @@ class single_logger {
       default: return "UNKNOWN";
     }
   }
-  
-  void log_msg(ru_severity sev, const std::string& msg) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    bool want_console = (sev >= sev_console_);
-    bool want_file = ((sev >= sev_file_) && log_);
-    if (!want_console && !want_file) return;
+
+  bool push(ru_severity sev, const std::string& msg) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    log_entry* e;
+    for (;;) {
+      e = &ring_[pos & (LOG_RING_SIZE-1)];
+      size_t seq = e->seq.load(std::memory_order_acquire);
+      auto diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+      } else if (diff < 0) {
+        return false; // full
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+    e->sev = sev;
+    e->len = std::min(msg.length(), LOG_ENTRY_SIZE);
+    memcpy(e->text, msg.data(), e->len);
+    e->seq.store(pos+1, std::memory_order_release);
+    return true;
+  }
+
+  void write_locked(ru_severity sev, const char* msg, size_t len) {
     auto sev_str = sev2str(sev);
-    if (want_console) {
+    if (sev >= sev_console_) {
       printf("%s: librealuvc: ", sev_str);
-      fwrite(msg.data(), 1, msg.length(), stdout);
+      fwrite(msg, 1, len, stdout);
       fputc('\n', stdout);
-      fflush(stdout);
     }
-    if (want_file) {
+    if ((sev >= sev_file_) && log_) {
       fprintf(log_, "%s: librealuvc: ", sev_str);
-      fwrite(msg.data(), 1, msg.length(), log_);
-      fputc('\n', stdout);
-      fflush(log_);
+      fwrite(msg, 1, len, log_);
+      fputc('\n', log_);
+    }
+  }
+
+  // Write out everything queued so far; the sink mutex keeps this single-consumer
+  bool drain() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool any = false;
+    size_t dropped = dropped_.exchange(0);
+    if (dropped > 0) {
+      auto note = std::to_string(dropped) + " log messages dropped";
+      write_locked(RU_SEVERITY_WARNING, note.data(), note.length());
+      any = true;
+    }
+    for (;;) {
+      log_entry& e = ring_[head_ & (LOG_RING_SIZE-1)];
+      if (e.seq.load(std::memory_order_acquire) != head_+1) break;
+      write_locked(e.sev, e.text, e.len);
+      e.seq.store(head_ + LOG_RING_SIZE, std::memory_order_release);
+      ++head_;
+      any = true;
+    }
+    if (any) {
+      fflush(stdout);
+      if (log_) fflush(log_);
+    }
+    return any;
+  }
+
+  bool pending() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const log_entry& e = ring_[head_ & (LOG_RING_SIZE-1)];
+    return ((e.seq.load(std::memory_order_acquire) == head_+1) || (dropped_ > 0));
+  }
+
+  // The writer sleeps without a timeout.  It announces itself in
+  // writer_waiting_ before a last look at the ring, and a producer looks
+  // at writer_waiting_ after its push, so one of the two always sees the
+  // other.  Only the first message after the ring went empty pays for
+  // the notify.
+  void writer_loop() {
+    while (!stopping_) {
+      if (drain()) continue;
+      std::unique_lock<std::mutex> lock(wakeup_mutex_);
+      writer_waiting_ = true;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (pending() || stopping_) {
+        writer_waiting_ = false;
+        continue;
+      }
+      wakeup_.wait(lock, [this]() { return !writer_waiting_; });
+    }
+  }
+
+  void wake_writer() {
+    std::lock_guard<std::mutex> lock(wakeup_mutex_);
+    writer_waiting_ = false;
+    wakeup_.notify_one();
+  }
+
+  void log_msg(ru_severity sev, const std::string& msg) {
+    bool want_console = (sev >= sev_console_);
+    bool want_file = (sev >= sev_file_);
+    if (!want_console && !want_file) return;
+    std::call_once(start_once_, [this]() {
+      writer_ = std::thread([this]() { writer_loop(); });
+    });
+    if (!push(sev, msg)) ++dropped_;
+    if (sev >= RU_SEVERITY_FATAL) {
+      // the process may be about to die, don't leave this in the ring
+      drain();
+    } else {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (writer_waiting_) wake_writer();
     }
   }
 };
@@ -73,7 +225,7 @@ single_logger* get_single_logger() {
 } // end anon
 
 void log_to_console(ru_severity min_sev) {
-  get_single_logger()->sev_console_ = min_sev;
+  get_single_logger()->log_to_console(min_sev);
 }
 
 void log_to_file(ru_severity min_sev, const char* file_path) {
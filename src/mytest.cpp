@@ -38,20 +38,14 @@ void show_blowup(const cv::Mat& mat) {
   // Show small region around brightest pixel
   static int old_x = 0;
   static int old_y = 0;
-  uint8_t brightest = 0;
-  int best_row = 0;
-  int best_col = 0;
-  for (int row = 0; row < mat.rows; ++row) {
-    const uint8_t* p = mat.ptr(row);
-    for (int col = 0; col < mat.cols/2; ++col) {
-      if (brightest < p[col]) {
-        brightest = p[col];
-        best_row = row;
-        best_col = col;
-      }
-    }
-  }
-  printf("DEBUG: brightest %3d at %3d, %3d\n", brightest, best_col, best_row);
+  // Brightest pixel of the left eye
+  StereoBlobs blobs;
+  find_stereo_blobs(mat, blobs);
+  uint8_t brightest = blobs.peak[0];
+  int best_row = blobs.peak_at[0].y;
+  int best_col = blobs.peak_at[0].x;
+  printf("DEBUG: brightest %3d at %3d, %3d, %d blobs\n",
+    brightest, best_col, best_row, (int)blobs.eye[0].size());
   fflush(stdout);
   int dx = 64;
   int dy = 64;
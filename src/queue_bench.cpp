@@ -0,0 +1,104 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+// Microbenchmark: the ring-based single_consumer_queue against the
+// deque + mutex + condition_variable queue it replaced.
+//
+//   queue_bench [items_per_producer]
+
+#include "concurrency.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <vector>
+
+namespace { // anon
+
+// The previous single_consumer_queue, kept here as the baseline
+template<class T>
+class locked_queue {
+ private:
+  std::deque<T> queue_;
+  std::mutex mutex_;
+  std::condition_variable deq_cv_;
+  std::condition_variable enq_cv_;
+  unsigned int cap_;
+
+ public:
+  explicit locked_queue(unsigned int cap) : cap_(cap) { }
+
+  void enqueue(T&& item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(item));
+    if (queue_.size() > cap_) queue_.pop_front();
+    lock.unlock();
+    deq_cv_.notify_one();
+  }
+
+  void blocking_enqueue(T&& item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    enq_cv_.wait(lock, [this]() { return queue_.size() <= cap_; });
+    queue_.push_back(std::move(item));
+    lock.unlock();
+    deq_cv_.notify_one();
+  }
+
+  bool dequeue(T* item, unsigned int timeout_ms = 5000) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const auto ready = [this]() { return !queue_.empty(); };
+    if (!ready() && !deq_cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready)) {
+      return false;
+    }
+    *item = std::move(queue_.front());
+    queue_.pop_front();
+    enq_cv_.notify_one();
+    return true;
+  }
+};
+
+typedef std::function<void(int)> task;
+
+// Every item must arrive, so producers use blocking_enqueue
+template<class Queue>
+double run(int nproducer, int nitem, unsigned int cap) {
+  Queue q(cap);
+  long sum = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  std::vector<std::thread> producers;
+  for (int p = 0; p < nproducer; ++p) {
+    producers.emplace_back([&q, nitem]() {
+      for (int j = 0; j < nitem; ++j) {
+        q.blocking_enqueue(task([j](int k) { (void)k; (void)j; }));
+      }
+    });
+  }
+  task t;
+  for (long j = 0; j < (long)nproducer*nitem; ++j) {
+    if (!q.dequeue(&t)) {
+      fprintf(stderr, "dequeue timed out\n");
+      exit(1);
+    }
+    t((int)j);
+    ++sum;
+  }
+  for (auto& th : producers) th.join();
+  auto t1 = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+  return (ns / sum);
+}
+
+} // end anon
+
+int main(int argc, char* argv[]) {
+  int nitem = ((argc > 1) ? atoi(argv[1]) : 200000);
+  printf("%-9s %4s %12s %12s\n", "producers", "cap", "locked ns", "ring ns");
+  for (unsigned int cap : { 10u, 256u }) {
+    for (int nproducer : { 1, 2, 4 }) {
+      double a = run<locked_queue<task>>(nproducer, nitem, cap);
+      double b = run<single_consumer_queue<task>>(nproducer, nitem, cap);
+      printf("%-9d %4u %12.1f %12.1f\n", nproducer, cap, a, b);
+    }
+  }
+  return 0;
+}
@@ -1,4 +1,8 @@
 #include <librealuvc/realuvc_driver.h>
+#include <librealuvc/ru_convert.h>
+#include "blobs.h"
+#include "convert.h"
+#include "trace.h"
 #include <condition_variable>
 
 #if 0
@@ -133,6 +137,12 @@ DevFrameQueue::DevFrameQueue(DevFrameFixup fixup, size_t max_size) {
   size_ = 0;
   front_ = 0;
   queue_.resize(max_size_);
+  convert_rgb_ = false;
+  ambient_subtract_ = false;
+  dark_step_ = 0;
+  dark_rows_ = 0;
+  dark_begin_ = 0;
+  dark_end_ = 0;
 }
   
 DevFrameQueue::~DevFrameQueue() {
@@ -154,6 +164,7 @@ void DevFrameQueue::push_back(
 ) {
   std::unique_lock<std::mutex> lock(mutex_);
   D("DevFrameQueue::push_back() frame.frame_size %d", (int)frame.frame_size);
+  RU_TRACE(TRACE_QUEUE_PUSH, frame.monotonic_ns);
   while (size_ >= max_size_) drop_front_locked();
   size_t back = ((front_ + size_) % max_size_);
   queue_[back] = new DevFrame(profile, frame, release_func);
@@ -197,34 +208,318 @@ void print_mat(const char* what, const cv::Mat& mat) {
   fflush(stdout);
 }
   
-void DevFrameQueue::pop_front(ru_time_t& ts, cv::Mat& mat) {
+namespace {
+
+// Histogram of every sub-th row in [row_begin, row_end), counting n bytes
+// from offset with col_step between them.  With pairs set each sample is
+// a byte pair, as for the interleaved eyes of a raw Peripheral frame.
+void histogram_rows(
+  const uchar* data, size_t step, int row_begin, int row_end,
+  int offset, int n, int col_step, FrameHistogram* hist, bool pairs = false
+) {
+  int sub = std::max(1, hist->subsample);
+  histogram_banks banks;
+  int row = (((row_begin + sub - 1) / sub) * sub);
+  for (; row < row_end; row += sub) {
+    const uchar* src = (data + (size_t)row * step + offset);
+    if (pairs) {
+      banks.add_pairs(src, n - offset, col_step);
+    } else {
+      banks.add(src, n - offset, col_step);
+    }
+  }
+  hist->count += banks.merge_into(hist->bins);
+}
+
+// How a FIXUP_NORMAL frame of each format becomes a Mat
+enum frame_layout {
+  LAYOUT_8BIT,  // CV_8UC1 in place
+  LAYOUT_YUV,   // CV_8UC2 in place, one column per pixel (or converted to BGR)
+  LAYOUT_16BIT, // CV_16UC1 in place, little-endian words
+  LAYOUT_Y10P   // unpacked to a new CV_16UC1
+};
+
+frame_layout layout_of(uint32_t fourcc) {
+  switch (fourcc) {
+    case RU_FOURCC_Y10:
+    case RU_FOURCC_Y12:
+    case RU_FOURCC_Y16:
+      return LAYOUT_16BIT;
+    case RU_FOURCC_YUY2:
+    case RU_FOURCC_UYVY:
+      return LAYOUT_YUV;
+    case RU_FOURCC_Y10P:
+      return LAYOUT_Y10P;
+    default:
+      return LAYOUT_8BIT;
+  }
+}
+
+size_t frame_bytes(frame_layout layout, size_t width, size_t height) {
+  switch (layout) {
+    case LAYOUT_YUV:
+    case LAYOUT_16BIT: return (2 * width * height);
+    case LAYOUT_Y10P:  return (y10p_row_bytes(width) * height);
+    default:           return 0;
+  }
+}
+
+// Significant bits of each pixel
+int bits_of(uint32_t fourcc) {
+  switch (fourcc) {
+    case RU_FOURCC_Y10:
+    case RU_FOURCC_Y10P:
+      return 10;
+    case RU_FOURCC_Y12:
+      return 12;
+    case RU_FOURCC_Y16:
+      return 16;
+    default:
+      return 8;
+  }
+}
+
+// histogram_rows() for 16-bit pixels, counting their top 8 bits
+void histogram_rows16(
+  const uint16_t* data, int cols, int row_begin, int row_end,
+  int sub, int shift, FrameHistogram* hist
+) {
+  histogram_banks banks;
+  int row = (((row_begin + sub - 1) / sub) * sub);
+  for (; row < row_end; row += sub) {
+    banks.add16(data + (size_t)row * cols, cols, sub, shift);
+  }
+  hist->count += banks.merge_into(hist->bins);
+}
+
+// A frame whose sampled mean is below this fraction of the recent lit
+// frames is a dark frame.  The LEDs make lit frames several times brighter.
+constexpr double kDarkFraction = 0.5;
+
+// Dark frames are within this of the recent ones: twice as bright, plus
+// a few gray levels for sensor noise in a dark room
+constexpr double kDarkSpread = 2.0;
+constexpr double kDarkNoise = 8.0;
+
+// One dropped lit frame can put two dark ones together, but no more
+constexpr int kMaxDarkRun = 2;
+
+} // end anon
+
+// StrobeLevels methods
+
+StrobeLevels::StrobeLevels() {
+  reset();
+}
+
+void StrobeLevels::reset() {
+  lit_ = 0.0;
+  dark_ = 0.0;
+  dark_run_ = 0;
+}
+
+bool StrobeLevels::is_dark(double level) {
+  bool dark = ((lit_ > 0.0) && (level < kDarkFraction * lit_));
+  // Far brighter than the dark frames: the lit frames dimmed, or the dark
+  // ones brightened.  Take it as lit and relearn the dark level from the
+  // next dark frame.
+  if (dark && (dark_ > 0.0) && (level > kDarkSpread * dark_ + kDarkNoise)) {
+    dark = false;
+    dark_ = 0.0;
+  }
+  // Darker for longer than the strobe allows: the lit frames dimmed
+  if (dark && (dark_run_ >= kMaxDarkRun)) dark = false;
+  if (dark) {
+    dark_ = ((dark_ > 0.0) ? (dark_ + (level - dark_) / 4) : level);
+    ++dark_run_;
+    return true;
+  }
+  // Follow drift slowly, but jump to a step in either direction
+  if ((lit_ > 0.0) && (level >= kDarkFraction * lit_) && (kDarkFraction * level <= lit_)) {
+    lit_ += (level - lit_) / 8;
+  } else {
+    lit_ = level;
+  }
+  dark_run_ = 0;
+  return false;
+}
+
+// Called with ambient_mutex_ held.  Classifies the frame by a sparse
+// sample of [row_begin, row_end) and keeps those rows if it is dark.
+bool DevFrameQueue::take_dark_frame(const DevFrame* f, int row_begin, int row_end) {
+  int rows = (int)f->profile_.height;
+  size_t step = (2 * (size_t)f->profile_.width);
+  const uint8_t* data = (const uint8_t*)f->frame_.pixels;
+  uint64_t sum = 0;
+  uint64_t count = 0;
+  for (int row = row_begin; row < row_end; row += 8) {
+    const uint8_t* p = (data + (size_t)row * step);
+    for (size_t j = 0; j < step; j += 8) sum += p[j];
+    count += ((step + 7) / 8);
+  }
+  if (count == 0) return false;
+  if (levels_.is_dark((double)sum / count)) {
+    if ((dark_rows_ != rows) || (dark_step_ != step)) {
+      dark_.assign(rows * step, 0);
+      dark_rows_ = rows;
+      dark_step_ = step;
+    }
+    memcpy(&dark_[row_begin * step], data + row_begin * step, (row_end - row_begin) * step);
+    dark_begin_ = row_begin;
+    dark_end_ = row_end;
+    return true;
+  }
+  return false;
+}
+
+// Called with ambient_mutex_ held: the dark row to subtract, if there is one
+const uint8_t* DevFrameQueue::dark_row(int row, size_t step, int rows) const {
+  if ((dark_rows_ != rows) || (dark_step_ != step)) return nullptr;
+  if ((row < dark_begin_) || (row >= dark_end_)) return nullptr;
+  return &dark_[row * step];
+}
+
+void DevFrameQueue::pop_front(
+  ru_nsec_t& ts, cv::Mat& mat, bool raw, FrameHistogram* hist, StereoBlobs* blobs
+) {
   std::unique_lock<std::mutex> lock(mutex_);
-  while (size_ <= 0) {
-    ++num_sleepers_;
-    wakeup_.wait(lock);
+  std::unique_lock<std::mutex> ambient_lock(ambient_mutex_, std::defer_lock);
+  DevFrame* f = nullptr;
+  cv::Rect roi;
+  bool convert_rgb = false;
+  bool ambient = false;
+  for (;;) {
+    while (size_ <= 0) {
+      ++num_sleepers_;
+      wakeup_.wait(lock);
+    }
+    size_t front = front_;
+    f = queue_[front];
+    queue_[front] = nullptr;
+    front_ = ((front + 1) % max_size_);
+    --size_;
+    ts = f->frame_.monotonic_ns;
+    roi = roi_;
+    convert_rgb = convert_rgb_;
+    ambient = (ambient_subtract_ && (fixup_ != FIXUP_NORMAL));
+    lock.unlock();
+    if (!ambient) break;
+    // Dark frames are kept for the lit ones and never handed out
+    cv::Rect rows_roi = (raw ? cv::Rect() : roi);
+    rows_roi = (rows_roi & cv::Rect(0, 0, 2 * (int)f->profile_.width, (int)f->profile_.height));
+    int dark_begin = (rows_roi.empty() ? 0 : rows_roi.y);
+    int dark_end = (rows_roi.empty() ? (int)f->profile_.height : rows_roi.y + rows_roi.height);
+    ambient_lock.lock();
+    if (!take_dark_frame(f, dark_begin, dark_end)) break;
+    ambient_lock.unlock();
+    delete f;
+    lock.lock();
   }
-  size_t front = front_;
-  DevFrame* f = queue_[front];
-  queue_[front] = nullptr;
-  front_ = ((front + 1) % max_size_);
-  --size_;
-  ts = f->frame_.backend_time;
+  RU_TRACE(TRACE_QUEUE_POP, ts);
   cv::UMatData* data = f;
   D("pop_front DevFrame %p frame_size %d", (void*)f, (int)f->frame_.frame_size);
-  cv::Mat m(0, 0, CV_8UC1);
+  uint32_t format = f->profile_.format;
+  // 16-bit gray and YUV are handed out in place; the fixups are for 8-bit layouts
+  frame_layout layout = ((raw || (fixup_ != FIXUP_NORMAL)) ? LAYOUT_8BIT : layout_of(format));
+  if (f->frame_.frame_size < frame_bytes(layout, f->profile_.width, f->profile_.height)) {
+    // A short frame can't be read as wide pixels
+    layout = LAYOUT_8BIT;
+  }
+  size_t elem_size = (((layout == LAYOUT_16BIT) || (layout == LAYOUT_YUV)) ? 2 : 1);
+  int mat_type = ((layout == LAYOUT_16BIT) ? CV_16UC1 : (layout == LAYOUT_YUV) ? CV_8UC2 : CV_8UC1);
+  cv::Mat m(0, 0, mat_type);
   m.allocator = &single_alloc;
   m.cols = f->profile_.width;
   m.rows = f->profile_.height;
   m.data = (uchar*)f->frame_.pixels;
   m.dims = 2;
-  m.step.p[0] = (m.cols * sizeof(uint8_t));
-  m.step.p[1] = sizeof(uint8_t);
+  m.step.p[0] = (m.cols * elem_size);
+  m.step.p[1] = elem_size;
   D("frame data %p data+size %p", m.data, m.data+f->frame_.frame_size);
   // Leap Motion devices pretend to be giving frames in YUY2 format
   // (4 bytes for 2 pixels), but it's really 8bit grayscale with
   // each row containing both the L and R rows.
   int fourcc_YUY2 = 0x59555932;
-  switch (fixup_) {
+  int out_cols = ((fixup_ == FIXUP_NORMAL) ? m.cols : 2*m.cols);
+  if (raw) roi = cv::Rect();
+  bool use_roi = !roi.empty();
+  if (use_roi) {
+    roi = (roi & cv::Rect(0, 0, out_cols, m.rows));
+    use_roi = !roi.empty();
+  }
+  int row_begin = (use_roi ? roi.y : 0);
+  int row_end = (use_roi ? roi.y + roi.height : m.rows);
+  bool yuv_format = (layout == LAYOUT_YUV);
+  int sub = (hist ? std::max(1, hist->subsample) : 1);
+  if (hist) hist->clear();
+  // Blobs come from the side-by-side eyes the fixup produces
+  if (blobs && (raw || (fixup_ == FIXUP_NORMAL))) {
+    blobs->clear();
+    blobs = nullptr;
+  }
+  if (hist && (fixup_ == FIXUP_NORMAL)) {
+    // Luma only: Y is every other byte of YUY2/UYVY
+    RU_TRACE(TRACE_FIXUP_BEGIN, ts);
+    if (yuv_format) {
+      histogram_rows(m.data, 2*m.cols, row_begin, row_end,
+        ((format == RU_FOURCC_UYVY) ? 1 : 0), 2*m.cols, 2*sub, hist);
+    } else if (layout == LAYOUT_16BIT) {
+      histogram_rows16((const uint16_t*)m.data, m.cols, row_begin, row_end,
+        sub, std::max(0, bits_of(format) - 8), hist);
+    } else if (layout == LAYOUT_Y10P) {
+      // The first 4 bytes of each 5 are the pixels' high 8 bits
+      int packed = (int)y10p_row_bytes(m.cols);
+      histogram_rows(m.data, packed, row_begin, row_end, 0, packed, 5*std::max(1, sub/4), hist);
+    } else {
+      histogram_rows(m.data, m.cols, row_begin, row_end, 0, m.cols, sub, hist);
+    }
+    RU_TRACE(TRACE_FIXUP_END, ts);
+  }
+  if (!raw && convert_rgb && (fixup_ == FIXUP_NORMAL) && yuv_format) {
+    // Only the rows inside the region of interest get converted
+    RU_TRACE(TRACE_FIXUP_BEGIN, ts);
+    cv::Mat bgr;
+    if (format == RU_FOURCC_YUY2) {
+      convert_yuyv_to_bgr(m.rowRange(row_begin, row_end), bgr);
+    } else {
+      convert_uyvy_to_bgr(m.rowRange(row_begin, row_end), bgr);
+    }
+    RU_TRACE(TRACE_FIXUP_END, ts);
+    delete f; // gives the buffer back to the device
+    if (use_roi) {
+      mat = bgr(cv::Rect(roi.x, 0, roi.width, roi.height));
+    } else {
+      mat = bgr;
+    }
+    return;
+  }
+  if (layout == LAYOUT_Y10P) {
+    // Unpacked to a new Mat, so the device buffer goes straight back
+    RU_TRACE(TRACE_FIXUP_BEGIN, ts);
+    const uchar* packed = m.data;
+    size_t packed_step = y10p_row_bytes(m.cols);
+    int cols = m.cols;
+    cv::Mat gray(row_end - row_begin, cols, CV_16UC1);
+    parallel_rows(gray.rows, cols, [&](int band_begin, int band_end) {
+      for (int row = band_begin; row < band_end; ++row) {
+        unpack_y10p_row(packed + (size_t)(row_begin + row) * packed_step, gray.ptr<uint16_t>(row), cols);
+      }
+    });
+    RU_TRACE(TRACE_FIXUP_END, ts);
+    delete f;
+    if (use_roi) {
+      mat = gray(cv::Rect(roi.x, 0, roi.width, roi.height));
+    } else {
+      mat = gray;
+    }
+    return;
+  }
+  RU_TRACE(TRACE_FIXUP_BEGIN, ts);
+  // A raw Peripheral frame keeps its interleaved bytes, only the shape changes
+  DevFrameFixup fixup = ((raw && (fixup_ == FIXUP_GRAY8_PIX_L_PIX_R)) ? FIXUP_GRAY8_ROW_L_ROW_R : fixup_);
+  uint8_t threshold = (uint8_t)(blobs ? std::max(1, std::min(255, blobs->settings.threshold)) : 255);
+  blob_band all_blobs;
+  switch (fixup) {
     case FIXUP_NORMAL:
       // The frame is just fine, do nothing
       // WARNING: this works for I420 format which starts with complete Y-plane
@@ -233,33 +528,101 @@ void DevFrameQueue::pop_front(ru_time_t& ts, cv::Mat& mat) {
       // We need to rearrange the data within each row
       int halfcols = m.cols;
       m.cols *= 2;
-      std::vector<uchar> halfrow(halfcols);
-      uchar* src = m.data;
-      for (int row = 0; row < m.rows; ++row) {
-        uchar* final_R = (src + halfcols);
-        uchar* srclim = (src + m.cols);
-        uchar* dst_L = src;
-        uchar* dst_R = &halfrow[0];
-        for (; src < srclim; src += 2) {
-          *dst_L++ = src[0];
-          *dst_R++ = src[1];
+      int cols = m.cols;
+      uchar* pixels = m.data;
+      std::mutex merge_mutex;
+      // rows outside the region of interest are left untouched
+      int rows = m.rows;
+      parallel_rows(row_end - row_begin, cols, [&](int band_begin, int band_end) {
+        std::vector<uchar> halfrow(halfcols);
+        std::unique_ptr<histogram_banks> banks(hist ? new histogram_banks() : nullptr);
+        std::unique_ptr<blob_band> band(blobs ? new blob_band() : nullptr);
+        for (int row = row_begin + band_begin; row < row_begin + band_end; ++row) {
+          uchar* src = (pixels + (size_t)row * cols);
+          // Count the row while it's in cache: L R pixel pairs, so that
+          // each eye is sampled every sub pixels
+          if (banks && (row % sub == 0)) banks->add_pairs(src, cols, 2*sub);
+          // L goes to the front of the row in place, R via halfrow
+          const uint8_t* dark = (ambient ? dark_row(row, cols, rows) : nullptr);
+          deinterleave_row(src, dark, src, &halfrow[0], halfcols);
+          if (band) {
+            band->scan(src, halfcols, 0, row, threshold);
+            band->scan(&halfrow[0], halfcols, 1, row, threshold);
+          }
+          memcpy(src + halfcols, &halfrow[0], halfcols*sizeof(uchar));
         }
-        memcpy(final_R, &halfrow[0], halfcols*sizeof(uchar));
-      }
+        std::lock_guard<std::mutex> merge_lock(merge_mutex);
+        if (banks) hist->count += banks->merge_into(hist->bins);
+        if (band) band->merge_into(all_blobs);
+      });
       break;
     }
     case FIXUP_GRAY8_ROW_L_ROW_R:
       // The data layout is fine, but it's 8-bit pixels not 16-bit
       m.cols *= 2;
+      if (hist) {
+        // A raw Peripheral frame still has its eyes interleaved
+        bool pairs = (fixup_ == FIXUP_GRAY8_PIX_L_PIX_R);
+        histogram_rows(m.data, m.cols, row_begin, row_end, 0, m.cols, (pairs ? 2*sub : sub), hist, pairs);
+      }
+      if (ambient || blobs) {
+        int cols = m.cols;
+        int halfcols = (cols / 2);
+        int rows = m.rows;
+        uchar* pixels = m.data;
+        std::mutex merge_mutex;
+        parallel_rows(row_end - row_begin, cols, [&](int band_begin, int band_end) {
+          std::unique_ptr<blob_band> band(blobs ? new blob_band() : nullptr);
+          for (int row = row_begin + band_begin; row < row_begin + band_end; ++row) {
+            uchar* p = (pixels + (size_t)row * cols);
+            const uint8_t* dark = (ambient ? dark_row(row, cols, rows) : nullptr);
+            if (dark) subtract_row(p, dark, cols);
+            if (band) {
+              band->scan(p, halfcols, 0, row, threshold);
+              band->scan(p + halfcols, halfcols, 1, row, threshold);
+            }
+          }
+          if (band) {
+            std::lock_guard<std::mutex> merge_lock(merge_mutex);
+            band->merge_into(all_blobs);
+          }
+        });
+      }
       break;
   }
+  if (blobs) blob_finish(all_blobs, *blobs);
+  RU_TRACE(TRACE_FIXUP_END, ts);
   m.rows = f->profile_.height;
-  m.step = m.cols * sizeof(uint8_t);
+  m.step = m.cols * elem_size;
   m.u = data;
   data->data = m.data;
   data->refcount = 1;
   data->size = 1;
-  mat = m;
+  if (use_roi) {
+    mat = m(roi);
+  } else {
+    mat = m;
+  }
+}
+
+void DevFrameQueue::set_roi(const cv::Rect& roi) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  roi_ = roi;
+}
+
+void DevFrameQueue::set_convert_rgb(bool on) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  convert_rgb_ = on;
+}
+
+void DevFrameQueue::set_ambient_subtract(bool on) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  ambient_subtract_ = on;
+}
+
+void DevFrameQueue::reset_ambient_levels() {
+  std::unique_lock<std::mutex> lock(ambient_mutex_);
+  levels_.reset();
 }
 
 } // end librealuvc
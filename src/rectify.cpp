@@ -0,0 +1,247 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+#include <librealuvc/ru_rectify.h>
+#include <librealuvc/ru_exception.h>
+#include "convert.h"
+#include <cmath>
+#include <cstring>
+
+namespace librealuvc {
+
+namespace { // anon
+
+// Blob layout, little-endian:
+//   u8 sig[2], u8 version, u8 score, u32 timestamp, f32 baseline, f32 q2init,
+//   2 x { f32 focal, offset[2], tangential[2], radial[6],
+//         f32 focal (deprecated), center[2], rotation[3] },
+//   u32 checksum
+constexpr size_t CALIB_SIZE = 156;
+constexpr size_t CALIB_EYE_OFFSET = 16;
+constexpr size_t CALIB_EYE_FLOATS = 17;
+
+// OpenCV's fixed-point remap precision (INTER_BITS)
+constexpr int REMAP_BITS = 5;
+constexpr int REMAP_SCALE = (1 << REMAP_BITS);
+
+float get_f32(const uint8_t* p) {
+  float f;
+  memcpy(&f, p, sizeof(f));
+  return f;
+}
+
+// Rational radial factor over squared radius, as in cv::undistort
+double radial_factor(const float* k, double r2) {
+  return ((1.0 + r2*(k[0] + r2*(k[1] + r2*k[2]))) /
+          (1.0 + r2*(k[3] + r2*(k[4] + r2*k[5]))));
+}
+
+// The stored model maps a distorted point p to p*f(|p|^2).  Find the
+// distorted r2 whose image has squared radius ru2, i.e. solve
+// r2*f(r2)^2 = ru2.  The model is monotonic over the lens, so Newton from
+// r2 = ru2 converges in a few steps.
+double invert_radial(const float* k, double ru2) {
+  double r2 = ru2;
+  for (int iter = 0; iter < 20; ++iter) {
+    double f = radial_factor(k, r2);
+    double g = r2*f*f - ru2;
+    double h = 1e-6 * (1.0 + r2);
+    double f2 = radial_factor(k, r2 + h);
+    double dg = (((r2 + h)*f2*f2 - r2*f*f) / h);
+    if (!(std::fabs(dg) > 1e-12)) break;
+    double next = r2 - (g / dg);
+    if (next < 0.0) next = 0.5 * r2;
+    if (std::fabs(next - r2) < 1e-12 * (1.0 + r2)) { r2 = next; break; }
+    r2 = next;
+  }
+  return r2;
+}
+
+// Rotation from Cayley parameters p: (I + [p]x)(I - [p]x)^-1
+void cayley_rotation(const double p[3], double r[9]) {
+  double xx = p[0]*p[0], yy = p[1]*p[1], zz = p[2]*p[2];
+  double xy = 2*p[0]*p[1], yz = 2*p[1]*p[2], zx = 2*p[2]*p[0];
+  double x = 2*p[0], y = 2*p[1], z = 2*p[2];
+  double d = (1.0 + xx + yy + zz);
+  double m[9] = {
+    1 + xx - yy - zz, xy - z, zx + y,
+    xy + z, 1 - xx + yy - zz, yz - x,
+    zx - y, yz + x, 1 - xx - yy + zz
+  };
+  for (int j = 0; j < 9; ++j) r[j] = (m[j] / d);
+}
+
+void build_maps(
+  const LeapEyeCalibration& eye, int width, int height,
+  cv::Mat& map_xy, cv::Mat& map_frac
+) {
+  // Camera matrix as the Leap tools define it; all devices are
+  // calibrated at 640x480.
+  double aspect = (height / 480.0);
+  double fx = eye.focal_length;
+  double fy = eye.focal_length * aspect;
+  double cx = 320.0 + eye.offset[0];
+  double cy = (240.0 + eye.offset[1]) * aspect;
+  // Rectified camera: same focal lengths, centered principal point
+  double ncx = ((width - 1) * 0.5);
+  double ncy = ((height - 1) * 0.5);
+  double p[3] = { -eye.rotation[0], -eye.rotation[1], -eye.rotation[2] };
+  double r[9];
+  cayley_rotation(p, r);
+  const double p1 = eye.tangential[0];
+  const double p2 = eye.tangential[1];
+  map_xy.create(height, width, CV_16SC2);
+  map_frac.create(height, width, CV_16UC1);
+  for (int v = 0; v < height; ++v) {
+    int16_t* xy = map_xy.ptr<int16_t>(v);
+    uint16_t* frac = map_frac.ptr<uint16_t>(v);
+    double ny = ((v - ncy) / fy);
+    for (int u = 0; u < width; ++u) {
+      double nx = ((u - ncx) / fx);
+      // R^T * (nx, ny, 1): back through the rectifying rotation
+      double X = r[0]*nx + r[3]*ny + r[6];
+      double Y = r[1]*nx + r[4]*ny + r[7];
+      double W = r[2]*nx + r[5]*ny + r[8];
+      double x = (X / W);
+      double y = (Y / W);
+      double ru2 = (x*x + y*y);
+      double scale = (1.0 / radial_factor(eye.radial, invert_radial(eye.radial, ru2)));
+      double xd = x*scale + 2*p1*x*y + p2*(ru2 + 2*x*x);
+      double yd = y*scale + p1*(ru2 + 2*y*y) + 2*p2*x*y;
+      double sx = (fx*xd + cx) * REMAP_SCALE;
+      double sy = (fy*yd + cy) * REMAP_SCALE;
+      // Far outside the image the samples are all border anyway
+      const double lim = (double)(INT16_MAX - 1) * REMAP_SCALE;
+      sx = std::max(-lim, std::min(lim, sx));
+      sy = std::max(-lim, std::min(lim, sy));
+      int ix = (int)std::lround(sx);
+      int iy = (int)std::lround(sy);
+      xy[2*u+0] = (int16_t)(ix >> REMAP_BITS);
+      xy[2*u+1] = (int16_t)(iy >> REMAP_BITS);
+      frac[u] = (uint16_t)(((iy & (REMAP_SCALE-1)) << REMAP_BITS) | (ix & (REMAP_SCALE-1)));
+    }
+  }
+}
+
+// Where one eye's pixels live in the source frame
+struct eye_view {
+  const uint8_t* base;
+  size_t row_step;
+  int pix_step;
+};
+
+inline int sample(const eye_view& s, int width, int height, int x, int y) {
+  if ((unsigned)x >= (unsigned)width || (unsigned)y >= (unsigned)height) return 0;
+  return s.base[y*s.row_step + x*s.pix_step];
+}
+
+void remap_rows(
+  const eye_view& src, int width, int height,
+  const cv::Mat& map_xy, const cv::Mat& map_frac,
+  cv::Mat& dst, int row_begin, int row_end
+) {
+  for (int v = row_begin; v < row_end; ++v) {
+    const int16_t* xy = map_xy.ptr<int16_t>(v);
+    const uint16_t* frac = map_frac.ptr<uint16_t>(v);
+    uint8_t* out = dst.ptr<uint8_t>(v);
+    for (int u = 0; u < width; ++u) {
+      int x = xy[2*u+0];
+      int y = xy[2*u+1];
+      int ax = (frac[u] & (REMAP_SCALE-1));
+      int ay = (frac[u] >> REMAP_BITS);
+      int p00, p01, p10, p11;
+      if (((unsigned)x < (unsigned)(width-1)) && ((unsigned)y < (unsigned)(height-1))) {
+        const uint8_t* p = src.base + y*src.row_step + x*src.pix_step;
+        p00 = p[0];
+        p01 = p[src.pix_step];
+        p10 = p[src.row_step];
+        p11 = p[src.row_step + src.pix_step];
+      } else {
+        p00 = sample(src, width, height, x, y);
+        p01 = sample(src, width, height, x+1, y);
+        p10 = sample(src, width, height, x, y+1);
+        p11 = sample(src, width, height, x+1, y+1);
+      }
+      int top = (p00*REMAP_SCALE + (p01 - p00)*ax);
+      int bot = (p10*REMAP_SCALE + (p11 - p10)*ax);
+      int val = (top*REMAP_SCALE + (bot - top)*ay);
+      out[u] = (uint8_t)((val + (1 << (2*REMAP_BITS - 1))) >> (2*REMAP_BITS));
+    }
+  }
+}
+
+} // end anon
+
+LeapStereoCalibration LeapStereoCalibration::parse(const OpaqueCalibration& calib) {
+  if (calib.get_format_name() != "LeapStereoCalibration") {
+    throw invalid_value_exception("calibration format is " + calib.get_format_name());
+  }
+  auto& data = calib.get_data();
+  if ((calib.get_version_major() != 1) || (data.size() < CALIB_SIZE)) {
+    throw invalid_value_exception("unsupported LeapStereoCalibration blob");
+  }
+  LeapStereoCalibration result;
+  result.baseline = get_f32(&data[8]);
+  for (int e = 0; e < 2; ++e) {
+    const uint8_t* p = &data[CALIB_EYE_OFFSET + e*CALIB_EYE_FLOATS*sizeof(float)];
+    float f[CALIB_EYE_FLOATS];
+    for (size_t j = 0; j < CALIB_EYE_FLOATS; ++j) f[j] = get_f32(p + j*sizeof(float));
+    auto& eye = result.eye[e];
+    eye.focal_length = f[0];
+    eye.offset[0] = f[1];
+    eye.offset[1] = f[2];
+    eye.tangential[0] = f[3];
+    eye.tangential[1] = f[4];
+    for (int j = 0; j < 6; ++j) eye.radial[j] = f[5+j];
+    // f[11..13] are the deprecated focal length and center
+    for (int j = 0; j < 3; ++j) eye.rotation[j] = f[14+j];
+  }
+  return result;
+}
+
+StereoRectifier::StereoRectifier(
+  const LeapStereoCalibration& calib, int eye_width, int eye_height
+) :
+  eye_width_(eye_width),
+  eye_height_(eye_height) {
+  if ((eye_width <= 0) || (eye_height <= 0)) {
+    throw invalid_value_exception("StereoRectifier needs a non-empty eye size");
+  }
+  for (int e = 0; e < 2; ++e) {
+    build_maps(calib.eye[e], eye_width, eye_height, map_xy_[e], map_frac_[e]);
+  }
+}
+
+void StereoRectifier::rectify(
+  const cv::Mat& src, DevFrameFixup fixup, cv::Mat& left, cv::Mat& right
+) const {
+  int w = eye_width_;
+  int h = eye_height_;
+  if ((src.type() != CV_8UC1) || (src.rows != h) || (src.cols != 2*w)) {
+    throw invalid_value_exception("StereoRectifier::rectify frame size doesn't match");
+  }
+  if ((left.data && (left.data == src.data)) || (right.data && (right.data == src.data))) {
+    throw invalid_value_exception("StereoRectifier::rectify can't work in place");
+  }
+  eye_view view[2];
+  for (int e = 0; e < 2; ++e) {
+    view[e].row_step = src.step[0];
+    if (fixup == FIXUP_GRAY8_PIX_L_PIX_R) {
+      view[e].base = src.data + e;
+      view[e].pix_step = 2;
+    } else {
+      view[e].base = src.data + e*w;
+      view[e].pix_step = 1;
+    }
+  }
+  left.create(h, w, CV_8UC1);
+  right.create(h, w, CV_8UC1);
+  cv::Mat* dst[2] = { &left, &right };
+  parallel_rows(h, 2*w, [&](int row_begin, int row_end) {
+    for (int e = 0; e < 2; ++e) {
+      remap_rows(view[e], w, h, map_xy_[e], map_frac_[e], *dst[e], row_begin, row_end);
+    }
+  });
+}
+
+} // end librealuvc
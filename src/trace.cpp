@@ -0,0 +1,154 @@
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+namespace librealuvc {
+
+std::atomic<bool> trace_enabled(false);
+
+namespace { // anon
+
+constexpr size_t TRACE_RING_SIZE = 8192; // events per thread, power of 2
+
+// Only the owning thread writes a ring; the dumper reads it concurrently,
+// so the fields are atomics (plain moves on the platforms we care about).
+
+struct trace_event {
+  std::atomic<int64_t> time_ns;
+  std::atomic<int64_t> frame_id;
+  std::atomic<uint8_t> point;
+};
+
+struct trace_ring {
+  int tid;
+  std::atomic<bool> in_use;
+  std::atomic<uint64_t> count;
+  trace_event events[TRACE_RING_SIZE];
+
+  explicit trace_ring(int id) : tid(id), in_use(true), count(0) { }
+};
+
+const char* const point_names[TRACE_COUNT] = {
+  "DQBUF", "callback", "queue_push", "queue_pop", "fixup", "fixup", "requeue"
+};
+
+class trace_registry {
+ public:
+  std::mutex mutex_;
+  vector<shared_ptr<trace_ring>> rings_;
+
+  // Rings of exited threads are handed to new threads rather than freed,
+  // so their events stay dumpable and memory stays bounded.
+  shared_ptr<trace_ring> acquire() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& r : rings_) {
+      bool expected = false;
+      if (r->in_use.compare_exchange_strong(expected, true)) return r;
+    }
+    auto r = std::make_shared<trace_ring>((int)rings_.size() + 1);
+    rings_.push_back(r);
+    return r;
+  }
+};
+
+trace_registry* get_registry() {
+  static trace_registry single;
+  return &single;
+}
+
+class thread_trace {
+ public:
+  shared_ptr<trace_ring> ring_;
+
+  thread_trace() : ring_(get_registry()->acquire()) { }
+  ~thread_trace() { ring_->in_use = false; }
+};
+
+inline int64_t now_ns() {
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+} // end anon
+
+void trace_record(trace_point pt, int64_t frame_id) {
+  static thread_local thread_trace local;
+  trace_ring* r = local.ring_.get();
+  uint64_t n = r->count.load(std::memory_order_relaxed);
+  trace_event& e = r->events[n & (TRACE_RING_SIZE-1)];
+  e.time_ns.store(now_ns(), std::memory_order_relaxed);
+  e.frame_id.store(frame_id, std::memory_order_relaxed);
+  e.point.store(pt, std::memory_order_relaxed);
+  r->count.store(n+1, std::memory_order_release);
+}
+
+void trace_enable(bool on) {
+  trace_enabled = on;
+}
+
+void trace_clear() {
+  auto reg = get_registry();
+  std::lock_guard<std::mutex> lock(reg->mutex_);
+  // Resetting another thread's count races with its writer; the worst
+  // case is a few stale events surviving the clear.
+  for (auto& r : reg->rings_) r->count = 0;
+}
+
+void trace_write_chrome_json(std::ostream& os) {
+  auto reg = get_registry();
+  vector<shared_ptr<trace_ring>> rings;
+  {
+    std::lock_guard<std::mutex> lock(reg->mutex_);
+    rings = reg->rings_;
+  }
+  os << "{\"traceEvents\":[\n";
+  bool first = true;
+  for (auto& r : rings) {
+    uint64_t end = r->count.load(std::memory_order_acquire);
+    uint64_t begin = ((end > TRACE_RING_SIZE) ? end - TRACE_RING_SIZE : 0);
+    struct copy { int64_t time_ns, frame_id; uint8_t point; };
+    vector<copy> events;
+    events.reserve((size_t)(end - begin));
+    for (uint64_t j = begin; j < end; ++j) {
+      trace_event& e = r->events[j & (TRACE_RING_SIZE-1)];
+      events.push_back({
+        e.time_ns.load(std::memory_order_relaxed),
+        e.frame_id.load(std::memory_order_relaxed),
+        e.point.load(std::memory_order_relaxed)
+      });
+    }
+    // Anything the writer lapped while we were copying is unreliable
+    uint64_t after = r->count.load(std::memory_order_acquire);
+    uint64_t valid = ((after > TRACE_RING_SIZE) ? after - TRACE_RING_SIZE : 0);
+    size_t skip = (size_t)((valid > begin) ? std::min(valid - begin, end - begin) : 0);
+    for (size_t j = skip; j < events.size(); ++j) {
+      auto& e = events[j];
+      if (e.point >= TRACE_COUNT) continue;
+      const char* phase = "i";
+      if (e.point == TRACE_FIXUP_BEGIN) phase = "B";
+      if (e.point == TRACE_FIXUP_END) phase = "E";
+      os << (first ? "" : ",\n");
+      first = false;
+      os << "{\"name\":\"" << point_names[e.point] << "\",\"ph\":\"" << phase << "\""
+         << ",\"ts\":" << (e.time_ns / 1000) << "." << ((e.time_ns / 100) % 10)
+         << ",\"pid\":1,\"tid\":" << r->tid;
+      if (phase[0] == 'i') os << ",\"s\":\"t\"";
+      os << ",\"args\":{\"frame\":" << e.frame_id << "}}";
+    }
+  }
+  os << "\n]}\n";
+}
+
+bool trace_dump_chrome_json(const string& file_path) {
+  std::ofstream os(file_path);
+  if (!os) return false;
+  trace_write_chrome_json(os);
+  return (bool)os;
+}
+
+} // end librealuvc
@@ -0,0 +1,41 @@
+#ifndef LIBREALUVC_TRACE_H
+#define LIBREALUVC_TRACE_H
+
+#include <librealuvc/ru_trace.h>
+#include <atomic>
+#include <cstdint>
+
+namespace librealuvc {
+
+enum trace_point : uint8_t {
+  TRACE_DQBUF,
+  TRACE_CALLBACK,
+  TRACE_QUEUE_PUSH,
+  TRACE_QUEUE_POP,
+  TRACE_FIXUP_BEGIN,
+  TRACE_FIXUP_END,
+  TRACE_REQUEUE,
+  TRACE_COUNT
+};
+
+extern std::atomic<bool> trace_enabled;
+
+void trace_record(trace_point pt, int64_t frame_id);
+
+#if defined(__GNUC__)
+#define RU_TRACE_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define RU_TRACE_UNLIKELY(x) (x)
+#endif
+
+// Costs a relaxed load and a not-taken branch while tracing is off
+#define RU_TRACE(pt, frame_id) \
+  do { \
+    if (RU_TRACE_UNLIKELY(librealuvc::trace_enabled.load(std::memory_order_relaxed))) { \
+      librealuvc::trace_record(librealuvc::pt, (int64_t)(frame_id)); \
+    } \
+  } while (false)
+
+} // end librealuvc
+
+#endif
@@ -6,6 +6,9 @@
 #include <librealuvc/ru_uvc.h>
 #include <chrono>
 #include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
 #include <sstream>
 #include <thread>
 #include <vector>
@@ -28,6 +31,22 @@ backend_device_group::backend_device_group(
   hid_devices(hid_devs) {
 }
 
+bool backend_device_group::operator==(const backend_device_group& b) const {
+  return (
+    (uvc_devices == b.uvc_devices) &&
+    (usb_devices == b.usb_devices) &&
+    (hid_devices == b.hid_devices)
+  );
+}
+
+string backend_device_group::to_string() const {
+  std::stringstream ss;
+  for (auto& dev : uvc_devices) ss << dev.to_string() << "\n";
+  for (auto& dev : usb_devices) ss << dev.to_string() << "\n";
+  for (auto& dev : hid_devices) ss << dev.to_string() << "\n";
+  return ss.str();
+}
+
 // stream_profile is declared in <librealuvc/hpp/ru_common.hpp>
 
 bool stream_profile::operator==(const stream_profile& b) const {
@@ -80,6 +99,88 @@ bool uvc_device_info::operator==(const uvc_device_info& b) const {
   );
 }
 
+bool usb_device_info::operator==(const usb_device_info& b) const {
+  return (
+    (id == b.id) &&
+    (vid == b.vid) &&
+    (pid == b.pid) &&
+    (mi == b.mi) &&
+    (unique_id == b.unique_id) &&
+    (conn_spec == b.conn_spec)
+  );
+}
+
+bool hid_device_info::operator==(const hid_device_info& b) const {
+  return (
+    (id == b.id) &&
+    (vid == b.vid) &&
+    (pid == b.pid) &&
+    (unique_id == b.unique_id) &&
+    (device_path == b.device_path)
+  );
+}
+
+namespace {
+
+class hid_sensor_registry {
+ public:
+  std::mutex mutex_;
+  std::map<string, hid_sensor_id> ids_;
+  std::deque<string> names_; // deque keeps references stable
+};
+
+hid_sensor_registry* get_hid_sensor_registry() {
+  static hid_sensor_registry single;
+  return &single;
+}
+
+} // end anon
+
+hid_sensor_id hid_sensor_intern(const string& name) {
+  auto reg = get_hid_sensor_registry();
+  std::lock_guard<std::mutex> lock(reg->mutex_);
+  auto iter = reg->ids_.find(name);
+  if (iter != reg->ids_.end()) return iter->second;
+  hid_sensor_id id = (hid_sensor_id)reg->names_.size();
+  reg->names_.push_back(name);
+  reg->ids_[name] = id;
+  return id;
+}
+
+const string& hid_sensor_name(hid_sensor_id id) {
+  auto reg = get_hid_sensor_registry();
+  std::lock_guard<std::mutex> lock(reg->mutex_);
+  if (id >= reg->names_.size()) {
+    throw invalid_value_exception("unknown hid_sensor_id");
+  }
+  return reg->names_[id];
+}
+
+void hid_device::start_batch_capture(hid_batch_callback callback) {
+  hid_sensor_id last_id = 0;
+  string last_name;
+  bool have_last = false;
+  start_capture([callback, last_id, last_name, have_last](const sensor_data& d) mutable {
+    // Samples usually come from the same sensor as the previous one
+    if (!have_last || (d.sensor.name != last_name)) {
+      last_name = d.sensor.name;
+      last_id = hid_sensor_intern(last_name);
+      have_last = true;
+    }
+    hid_sample_batch batch = {};
+    batch.sensor = last_id;
+    batch.count = 1;
+    batch.stride = (uint32_t)d.fo.frame_size;
+    batch.data_size = (uint32_t)d.fo.frame_size;
+    batch.samples = (const uint8_t*)d.fo.pixels;
+    batch.metadata_size = (d.fo.metadata ? d.fo.metadata_size : 0);
+    batch.metadata_offset = (uint32_t)(batch.metadata_size ?
+      ((const uint8_t*)d.fo.metadata - batch.samples) : 0);
+    batch.monotonic_ns = d.fo.monotonic_ns;
+    callback(batch);
+  });
+}
+
 // A uvc_device wrapper which retires get/set_pu and get/set_xu calls
 
 static constexpr int MAX_RETRIES = 40;
@@ -189,6 +290,14 @@ usb_spec uvc_device_with_retry::get_usb_specification() const {
   return raw_->get_usb_specification();
 }
 
+void uvc_device_with_retry::set_crop(const crop_rect& rect) {
+  raw_->set_crop(rect);
+}
+
+bool uvc_device_with_retry::get_crop(crop_rect& rect) const {
+  return raw_->get_crop(rect);
+}
+
 // Converting various structs to strings
 
 #define MEMBER(name) { \
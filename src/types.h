@@ -3,6 +3,7 @@
 
 #include <librealuvc/ru_common.h>
 #include <librealuvc/ru_exception.h>
+#include <atomic>
 #include <cassert>
 #include <cstring>
 #include <sstream>
@@ -30,11 +31,29 @@ void log_to_file(ru_severity min_sev, const char* file);
 
 void log_msg(ru_severity sev, const std::string& ss);
 
+// Messages below RU_LOG_MIN_SEVERITY are compiled out entirely
+// (set with -DLOG_MIN_SEVERITY=<level> at configure time).
+
+#ifndef RU_LOG_MIN_SEVERITY
+#define RU_LOG_MIN_SEVERITY RU_SEVERITY_DEBUG
+#endif
+
+// Lowest severity any sink currently accepts, maintained by log_to_*()
+extern std::atomic<int> log_enabled_severity;
+
+inline bool log_enabled(ru_severity sev) {
+  return ((int)sev >= log_enabled_severity.load(std::memory_order_relaxed));
+}
+
+// The message is only formatted when some sink will write it; the
+// actual I/O happens on a background thread.
 #define LOG_WITH_SEVERITY(sev, ...) \
   do { \
-    std::stringstream ss; \
-    ss << __VA_ARGS__; \
-    log_msg(sev, ss.str()); \
+    if (((sev) >= RU_LOG_MIN_SEVERITY) && librealuvc::log_enabled(sev)) { \
+      std::stringstream ss; \
+      ss << __VA_ARGS__; \
+      librealuvc::log_msg(sev, ss.str()); \
+    } \
   } while (false)
 
 #define LOG_DEBUG(...)   LOG_WITH_SEVERITY(RU_SEVERITY_DEBUG,   __VA_ARGS__)
@@ -2,12 +2,17 @@
 // Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
 
 #include <librealuvc/ru_videocapture.h>
+#include <librealuvc/ru_control.h>
+#include <librealuvc/ru_rectify.h>
 #include <librealuvc/ru_uvc.h>
 #include <librealuvc/realuvc.h>
 #include <opencv2/core/mat.hpp>
 #include <librealuvc/realuvc_driver.h>
 #include "drivers.h"
+#include "trace.h"
+#include "types.h"
 #include <chrono>
+#include <deque>
 #include <exception>
 #include <map>
 #include <mutex>
@@ -77,6 +82,7 @@ const char* prop_name(int prop_id) {
     PROP(ZOOM)
 #undef PROP
 #define PROP_LEAP(x) case librealuvc::CAP_PROP_LEAP_##x: return "CAP_PROP_LEAP_" #x;
+    PROP_LEAP(AMBIENT_SUBTRACT)
     PROP_LEAP(HDR)
     PROP_LEAP(LEDS)
 #undef PROP_LEAP
@@ -142,19 +148,48 @@ OpaqueCalibration::OpaqueCalibration(
 
 class VideoStream : public IVideoStream {
  public:
+  // Serializes control transfers to the device, blocking or from the
+  // control thread, so a multi-transfer command goes through whole.  It is
+  // recursive for set_at_frame(), which holds it across its set() calls.
+  // Taken before mutex_, never while holding it.
+  std::recursive_mutex control_mutex_;
   std::mutex mutex_;
   DevFrameFixup fixup_;
   stream_profile profile_;
   bool is_streaming_;
   DevFrameQueue queue_;
-  ru_time_t frame_time_;
+  ru_nsec_t frame_time_; // monotonic, as reported by the backend
+  cv::Rect roi_;         // requested region, in output image coordinates
+  cv::Rect hw_crop_;     // region the device crops to, empty if none
+  bool convert_rgb_;     // YUY2/UYVY frames come out as BGR
+  bool ambient_subtract_; // stereo IR dark frames are subtracted
+  shared_ptr<LeapStereoCalibration> calibration_;
+  shared_ptr<StereoRectifier> rectifier_;
+  // set_at_frame() transactions not yet seen on a frame, oldest first;
+  // effective_ns stays 0 until the control thread has applied them
+  struct PendingSettings {
+    uint64_t id;
+    ru_nsec_t effective_ns;
+  };
+  std::deque<PendingSettings> pending_settings_;
+  uint64_t last_settings_id_;
+  uint64_t frame_settings_id_; // newest transaction in effect for the last frame
+  // Software auto-exposure, stepping only once its last step shows
+  unique_ptr<AutoExposure> auto_exposure_;
+  AutoExposureSettings ae_settings_;
+  uint64_t ae_pending_id_;
   
  public:
   VideoStream(DevFrameFixup fixup, int max_size = 1) :
     fixup_(fixup),
     is_streaming_(false),
     queue_(fixup, max_size),
-    frame_time_(0.0) {
+    frame_time_(0),
+    convert_rgb_(false),
+    ambient_subtract_(false),
+    last_settings_id_(0),
+    frame_settings_id_(0),
+    ae_pending_id_(0) {
     profile_.width = 640;
     profile_.height = 480;
     profile_.fps = 30;
@@ -162,6 +197,41 @@ class VideoStream : public IVideoStream {
   }
 
   virtual ~VideoStream() { }
+  
+  // Whatever the hardware crop did not remove is cut out as a Mat view
+  void update_roi() {
+    cv::Rect soft = roi_;
+    if (!roi_.empty() && !hw_crop_.empty()) {
+      soft = cv::Rect(roi_.x - hw_crop_.x, roi_.y - hw_crop_.y, roi_.width, roi_.height);
+    }
+    queue_.set_roi(soft);
+  }
+  
+  // Called with mutex_ held for each frame handed to the caller
+  void frame_popped(ru_nsec_t frame_time) {
+    frame_time_ = frame_time;
+    while (!pending_settings_.empty()) {
+      auto& pending = pending_settings_.front();
+      if ((pending.effective_ns == 0) || (frame_time < pending.effective_ns)) break;
+      frame_settings_id_ = pending.id;
+      pending_settings_.pop_front();
+    }
+  }
+  
+  // Called with mutex_ held after frame_popped().  Returns true with the
+  // exposure/gain changes to send; ae_pending_id_ then blocks further
+  // steps until the caller stores the transaction id.
+  bool auto_exposure_step(const FrameHistogram* hist, VideoCapture::PropertyChanges& changes) {
+    if (!hist || !auto_exposure_ || (frame_settings_id_ < ae_pending_id_)) return false;
+    double old_exposure = auto_exposure_->exposure();
+    double old_gain = auto_exposure_->gain();
+    double exposure = 0.0, gain = 0.0;
+    if (!auto_exposure_->update(*hist, exposure, gain)) return false;
+    if (exposure != old_exposure) changes.push_back({ cv::CAP_PROP_EXPOSURE, exposure });
+    if (gain != old_gain) changes.push_back({ cv::CAP_PROP_GAIN, gain });
+    ae_pending_id_ = UINT64_MAX;
+    return true;
+  }
 };
 
 VideoCapture::VideoCapture() :
@@ -203,6 +273,7 @@ double VideoCapture::get(int prop_id) const {
   if (is_opencv_) return opencv_->get(prop_id);
   if (!is_realuvc_) return 0.0;
   auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
+  std::lock_guard<std::recursive_mutex> controls(istream->control_mutex_);
   std::unique_lock<std::mutex> lock(istream->mutex_);
   //printf("DEBUG: VideoCapture::get(%s) ...\n", prop_name(prop_id)); fflush(stdout);
   if (driver_) {
@@ -217,13 +288,16 @@ double VideoCapture::get(int prop_id) const {
   }
   switch (prop_id) {
     // properties which we can handle
+    case cv::CAP_PROP_AUTO_EXPOSURE:
+      return (istream->auto_exposure_ ? 1.0 : 0.0);
     case cv::CAP_PROP_BRIGHTNESS:
       return get_pu(realuvc_, RU_OPTION_BRIGHTNESS);
     case cv::CAP_PROP_CONTRAST:
       return get_pu(realuvc_, RU_OPTION_CONTRAST);
     case cv::CAP_PROP_CONVERT_RGB:
-      // FIXME
-      return true;
+      return (istream->convert_rgb_ ? 1.0 : 0.0);
+    case CAP_PROP_LEAP_AMBIENT_SUBTRACT:
+      return (istream->ambient_subtract_ ? 1.0 : 0.0);
     case cv::CAP_PROP_FOURCC:
       return (double)istream->profile_.format;
     case cv::CAP_PROP_FPS:
@@ -246,7 +320,9 @@ double VideoCapture::get(int prop_id) const {
       return get_pu(realuvc_, RU_OPTION_ZOOM_ABSOLUTE);
     // properties we will silently ignore
     case cv::CAP_PROP_POS_MSEC:
-      return (istream ? istream->frame_time_ : 0.0);
+      // Wall-clock milliseconds, converted on demand from the monotonic stamp
+      if (!istream || (istream->frame_time_ == 0)) return 0.0;
+      return (double)monotonic_to_realtime_ns(istream->frame_time_) * 1.0e-6;
     case cv::CAP_PROP_POS_FRAMES:
     case cv::CAP_PROP_POS_AVI_RATIO:
     case cv::CAP_PROP_FRAME_COUNT:
@@ -283,6 +359,7 @@ bool VideoCapture::open(int index) {
   auto backend = create_backend();
   auto info = backend->query_uvc_devices();
   is_realuvc_ = false;
+  controls_.reset();
   realuvc_.reset();
   if ((index < 0) || (index >= (int)info.size())) {
     return false;
@@ -305,6 +382,7 @@ bool VideoCapture::open(int index) {
   // Kludge for the weird frame formats returned by Leap Peripheral/Rigel
   DevFrameFixup fixup = (driver_ ? driver_->get_frame_fixup() : FIXUP_NORMAL);
   istream_ = std::make_shared<VideoStream>(fixup);
+  controls_ = std::make_shared<uvc_control_worker>(realuvc_);
   return true;
 }
 
@@ -341,45 +419,100 @@ VideoCapture& VideoCapture::operator>>(cv::UMat& image) {
   return *this;
 }
 
-bool VideoCapture::read(cv::OutputArray image) {
+// Called with istream->mutex_ held
+static bool start_streaming(
+  const shared_ptr<uvc_device>& dev,
+  const shared_ptr<VideoStream>& istream
+) {
+  if (istream->is_streaming_) return true;
+  D("profile width %d, height %d, fps %d, format 0x%x",
+    istream->profile_.width, istream->profile_.height,
+    istream->profile_.fps, istream->profile_.format);
+  // Only plain frames map directly onto a sensor crop; the stereo
+  // layouts interleave both eyes, so those are cropped in software.
+  crop_rect req = {};
+  if ((istream->fixup_ == FIXUP_NORMAL) && !istream->roi_.empty()) {
+    auto& roi = istream->roi_;
+    req = { roi.x, roi.y, roi.width, roi.height };
+  }
+  dev->set_crop(req);
+  D("probe_and_commit() ...");
+  auto captured_istream = istream;
+  dev->probe_and_commit(
+    istream->profile_,
+    [captured_istream](stream_profile profile, frame_object frame, std::function<void()> func) {
+      RU_TRACE(TRACE_CALLBACK, frame.monotonic_ns);
+      captured_istream->queue_.push_back(profile, frame, func);
+    },
+    4
+  );
+  crop_rect active = {};
+  if (dev->get_crop(active)) {
+    istream->hw_crop_ = cv::Rect(active.x, active.y, active.width, active.height);
+  } else {
+    istream->hw_crop_ = cv::Rect();
+  }
+  istream->update_roi();
+
   try {
-  if (is_opencv_) return opencv_->read(image);
-  if (!is_realuvc_) return false;
-  auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
-  { std::unique_lock<std::mutex> lock(istream->mutex_);
-    if (!istream->is_streaming_) {
-      D("profile width %d, height %d, fps %d, format 0x%x",
-        istream->profile_.width, istream->profile_.height,
-        istream->profile_.fps, istream->profile_.format);
-      D("probe_and_commit() ...");
-      auto captured_istream = istream;
-      realuvc_->probe_and_commit(
-        istream->profile_,
-        [captured_istream](stream_profile profile, frame_object frame, std::function<void()> func) {
-          captured_istream->queue_.push_back(profile, frame, func);
-        },
-        4
-      );
+    D("stream_on() ...");
+    dev->stream_on();
+    D("start_callbacks() ...");
+    dev->start_callbacks();
+    istream->is_streaming_ = true;
+  } catch (std::exception e) {
+    printf("ERROR: caught exception %s\n", e.what());
+    fflush(stdout);      
+  }
+  return istream->is_streaming_;
+}
 
-      try {
-        D("stream_on() ...");
-        realuvc_->stream_on();
-        D("start_callbacks() ...");
-        realuvc_->start_callbacks();
-        istream->is_streaming_ = true;
-      } catch (std::exception e) {
-        printf("ERROR: caught exception %s\n", e.what());
-        fflush(stdout);      
-      }
-    }
-    if (!istream->is_streaming_) return false;
+// Tag the frame just popped and take an auto-exposure step on it
+static void frame_read(
+  VideoCapture* cap, const shared_ptr<VideoStream>& istream,
+  ru_nsec_t frame_time, const FrameHistogram* hist
+) {
+  VideoCapture::PropertyChanges changes;
+  {
+    std::unique_lock<std::mutex> lock(istream->mutex_);
+    istream->frame_popped(frame_time);
+    if (!istream->auto_exposure_step(hist, changes)) return;
+  }
+  uint64_t id = cap->set_at_frame(changes);
+  std::unique_lock<std::mutex> lock(istream->mutex_);
+  istream->ae_pending_id_ = id;
+}
+
+// The fixed-up frame for read() and read_blobs()
+static bool read_fixed_up(
+  VideoCapture* cap, const shared_ptr<uvc_device>& dev, const shared_ptr<VideoStream>& istream,
+  cv::OutputArray image, StereoBlobs* blobs
+) {
+  FrameHistogram hist;
+  bool want_hist = false;
+  { std::unique_lock<std::mutex> lock(istream->mutex_);
+    if (!start_streaming(dev, istream)) return false;
+    want_hist = (istream->auto_exposure_ != nullptr);
+    hist.subsample = istream->ae_settings_.subsample;
   } // don't hold the mutex while possibly waiting for frame
   cv::Mat tmp;
-  istream->queue_.pop_front(istream->frame_time_, tmp); // wait for a frame if necessary
+  ru_nsec_t frame_time = 0;
+  // wait for a frame if necessary
+  istream->queue_.pop_front(frame_time, tmp, false, (want_hist ? &hist : nullptr), blobs);
+  frame_read(cap, istream, frame_time, (want_hist ? &hist : nullptr));
   if (image.needed()) {
     // OutputArray::assign() will not copy unless it needs to
     image.assign(tmp);
   }
+  return true;
+}
+
+bool VideoCapture::read(cv::OutputArray image) {
+  try {
+  if (is_opencv_) return opencv_->read(image);
+  if (!is_realuvc_) return false;
+  auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
+  return read_fixed_up(this, realuvc_, istream, image, nullptr);
   } catch (std::exception& e) {
     printf("EXCEPTION: VideoCapture::read %s\n", e.what());
     throw;
@@ -387,6 +520,80 @@ bool VideoCapture::read(cv::OutputArray image) {
   return true;
 }
 
+bool VideoCapture::read_blobs(StereoBlobs& blobs, cv::OutputArray image) {
+  if (!is_realuvc_ || !driver_ || !driver_->is_stereo_camera()) return false;
+  auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
+  return read_fixed_up(this, realuvc_, istream, image, &blobs);
+}
+
+bool VideoCapture::read_stereo(cv::OutputArray left, cv::OutputArray right) {
+  if (!is_realuvc_ || !driver_ || !driver_->is_stereo_camera()) return false;
+  auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
+  shared_ptr<StereoRectifier> rectifier;
+  FrameHistogram hist;
+  bool want_hist = false;
+  bool have_calibration = false;
+  { std::unique_lock<std::mutex> lock(istream->mutex_);
+    have_calibration = (istream->calibration_ != nullptr);
+  }
+  if (!have_calibration) {
+    // Reading the calibration can take a while on the Peripheral, and it
+    // is a sequence of control transfers, so it goes under the control
+    // mutex; the parsed blob is kept for later size changes.
+    shared_ptr<LeapStereoCalibration> parsed;
+    { std::lock_guard<std::recursive_mutex> controls(istream->control_mutex_);
+      auto calib = driver_->get_opaque_calibration();
+      if (!calib) return false;
+      try {
+        parsed = std::make_shared<LeapStereoCalibration>(LeapStereoCalibration::parse(*calib));
+      } catch (const invalid_value_exception& e) {
+        LOG_WARNING("read_stereo: can't parse the device calibration: " << e.what());
+        return false;
+      }
+    }
+    std::unique_lock<std::mutex> lock(istream->mutex_);
+    if (!istream->calibration_) istream->calibration_ = parsed;
+  }
+  { std::unique_lock<std::mutex> lock(istream->mutex_);
+    int eye_width = (int)istream->profile_.width;
+    int eye_height = (int)istream->profile_.height;
+    rectifier = istream->rectifier_;
+    if (!rectifier || (rectifier->eye_width() != eye_width) ||
+        (rectifier->eye_height() != eye_height)) {
+      try {
+        rectifier = std::make_shared<StereoRectifier>(*istream->calibration_, eye_width, eye_height);
+      } catch (const invalid_value_exception& e) {
+        LOG_WARNING("read_stereo: " << e.what());
+        return false;
+      }
+      istream->rectifier_ = rectifier;
+    }
+    if (!start_streaming(realuvc_, istream)) return false;
+    want_hist = (istream->auto_exposure_ != nullptr);
+    hist.subsample = istream->ae_settings_.subsample;
+  } // don't hold the mutex while possibly waiting for frame
+  cv::Mat raw;
+  ru_nsec_t frame_time = 0;
+  istream->queue_.pop_front(frame_time, raw, true, (want_hist ? &hist : nullptr));
+  frame_read(this, istream, frame_time, (want_hist ? &hist : nullptr));
+  // The stream was started at another size, or the frame isn't 8-bit
+  if ((raw.type() != CV_8UC1) ||
+      (raw.rows != rectifier->eye_height()) || (raw.cols != 2*rectifier->eye_width())) {
+    return false;
+  }
+  left.create(rectifier->eye_height(), rectifier->eye_width(), CV_8UC1);
+  right.create(rectifier->eye_height(), rectifier->eye_width(), CV_8UC1);
+  cv::Mat left_mat = left.getMat();
+  cv::Mat right_mat = right.getMat();
+  try {
+    rectifier->rectify(raw, istream->fixup_, left_mat, right_mat);
+  } catch (const invalid_value_exception& e) {
+    LOG_WARNING("read_stereo: " << e.what());
+    return false;
+  }
+  return true;
+}
+
 void VideoCapture::release() {
   D("VideoCapture::release() ...");
   if (is_opencv_) {
@@ -394,6 +601,8 @@ void VideoCapture::release() {
     opencv_.reset();
   }
   if (is_realuvc_) {
+    // Finish the control transfer in progress and drop the rest
+    controls_.reset();
     auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
     if (istream) { 
       std::unique_lock<std::mutex> lock(istream->mutex_);
@@ -416,16 +625,53 @@ bool VideoCapture::retrieve(cv::OutputArray image, int flag) {
   return read(image);
 }
 
+// Called with istream->mutex_ held, so the driver is asked directly
+static unique_ptr<AutoExposure> make_auto_exposure(
+  const shared_ptr<IPropertyDriver>& driver, const AutoExposureSettings& settings
+) {
+  if (!driver) return nullptr;
+  double exposure = 0.0, gain = 0.0;
+  double exposure_min = 0.0, exposure_max = 0.0;
+  double gain_min = 0.0, gain_max = 0.0;
+  if ((driver->get_prop(cv::CAP_PROP_EXPOSURE, &exposure) != kHandlerTrue) ||
+      (driver->get_prop_range(cv::CAP_PROP_EXPOSURE, &exposure_min, &exposure_max) != kHandlerTrue)) {
+    return nullptr;
+  }
+  if ((driver->get_prop(cv::CAP_PROP_GAIN, &gain) != kHandlerTrue) ||
+      (driver->get_prop_range(cv::CAP_PROP_GAIN, &gain_min, &gain_max) != kHandlerTrue)) {
+    // Exposure alone still works
+    gain = gain_min = gain_max = 0.0;
+  }
+  return unique_ptr<AutoExposure>(new AutoExposure(
+    settings, exposure_min, exposure_max, gain_min, gain_max, exposure, gain
+  ));
+}
+
 bool VideoCapture::set(int prop_id, double val) {
   try {
   if (is_opencv_) return opencv_->set(prop_id, val);
   if (!is_realuvc_) return false;
   auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
-  std::unique_lock<std::mutex> lock(istream->mutex_);
+  // Device transfers, which can retry for seconds, hold only the control
+  // mutex, never the stream mutex, so they don't hold up read().
+  std::lock_guard<std::recursive_mutex> controls(istream->control_mutex_);
+  std::unique_lock<std::mutex> lock(istream->mutex_, std::defer_lock);
   int32_t ival = (int32_t)val;
   if (prop_id != cv::CAP_PROP_SHARPNESS) {
     //printf("DEBUG: VideoCapture::set(%s, %.2f) ...\n", prop_name(prop_id), val); fflush(stdout);
   }
+  lock.lock();
+  if (istream->auto_exposure_) {
+    // The controller carries on from whatever was set last
+    if (prop_id == cv::CAP_PROP_EXPOSURE) istream->auto_exposure_->set_exposure(val);
+    if (prop_id == cv::CAP_PROP_GAIN) istream->auto_exposure_->set_gain(val);
+  }
+  lock.unlock();
+  if ((prop_id == cv::CAP_PROP_EXPOSURE) || (prop_id == cv::CAP_PROP_GAIN) ||
+      (prop_id == CAP_PROP_LEAP_LEDS)) {
+    // Lit and dark frames are about to change brightness
+    istream->queue_.reset_ambient_levels();
+  }
   if (driver_) {
     // The driver can implement device-specific behavior for some prop_id's
     // while falling through to the default behavior for others.
@@ -438,21 +684,38 @@ bool VideoCapture::set(int prop_id, double val) {
   bool ok = false;
   switch (prop_id) {
     // properties which we can handle
+    case cv::CAP_PROP_AUTO_EXPOSURE:
+      lock.lock();
+      if (val < 0.5) {
+        istream->auto_exposure_.reset();
+        return true;
+      }
+      if (!istream->auto_exposure_) {
+        auto ae = make_auto_exposure(driver_, istream->ae_settings_);
+        if (!ae) return false;
+        istream->auto_exposure_ = std::move(ae);
+        istream->ae_pending_id_ = 0;
+      }
+      return true;
     case cv::CAP_PROP_BRIGHTNESS:
       // For Leap we have a value 0..16
       return realuvc_->set_pu(RU_OPTION_BRIGHTNESS, ival);
     case cv::CAP_PROP_CONTRAST:
       return realuvc_->set_pu(RU_OPTION_CONTRAST, ival);
     case cv::CAP_PROP_FOURCC:
+      lock.lock();
       istream->profile_.format = ival;
       return true;
     case cv::CAP_PROP_FPS:
+      lock.lock();
       istream->profile_.fps = ival;
       break;
     case cv::CAP_PROP_FRAME_HEIGHT:
+      lock.lock();
       istream->profile_.height = ival;
       return true;
     case cv::CAP_PROP_FRAME_WIDTH: {
+      lock.lock();
       int pixel_mul = ((istream->fixup_ == FIXUP_NORMAL) ? 1 : 2); // 8bit pixels
       istream->profile_.width = (ival / pixel_mul);
       return true;
@@ -471,8 +734,19 @@ bool VideoCapture::set(int prop_id, double val) {
     case cv::CAP_PROP_ZOOM:
       //printf("DEBUG: set_pu(RU_OPTION_ZOOM_ABSOLUTE, %d) ...\n", ival);
       return realuvc_->set_pu(RU_OPTION_ZOOM_ABSOLUTE, ival);
-    // properties we will silently ignore
     case cv::CAP_PROP_CONVERT_RGB:
+      lock.lock();
+      istream->convert_rgb_ = (ival != 0);
+      istream->queue_.set_convert_rgb(istream->convert_rgb_);
+      return true;
+    case CAP_PROP_LEAP_AMBIENT_SUBTRACT:
+      lock.lock();
+      // Only the stereo IR layouts have dark frames
+      if (istream->fixup_ == FIXUP_NORMAL) return false;
+      istream->ambient_subtract_ = (ival != 0);
+      istream->queue_.set_ambient_subtract(istream->ambient_subtract_);
+      return true;
+    // properties we will silently ignore
     case cv::CAP_PROP_HUE:
     case cv::CAP_PROP_FORMAT:
     case cv::CAP_PROP_FRAME_COUNT:
@@ -492,6 +766,21 @@ bool VideoCapture::set(int prop_id, double val) {
   return false;
 }
 
+void VideoCapture::set_auto_exposure_settings(const AutoExposureSettings& settings) {
+  auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
+  if (!istream) return;
+  std::unique_lock<std::mutex> lock(istream->mutex_);
+  istream->ae_settings_ = settings;
+  if (istream->auto_exposure_) istream->auto_exposure_->set_settings(settings);
+}
+
+AutoExposureSettings VideoCapture::get_auto_exposure_settings() const {
+  auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
+  if (!istream) return AutoExposureSettings();
+  std::unique_lock<std::mutex> lock(istream->mutex_);
+  return istream->ae_settings_;
+}
+
 bool VideoCapture::is_extended() const {
   return is_realuvc_;
 }
@@ -528,6 +817,8 @@ static double little_endian_to_double(const std::vector<uint8_t>& vec) {
 
 bool VideoCapture::get_prop_range(int prop_id, double* min_val, double* max_val) {
   if (!is_realuvc_) return false;
+  auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
+  std::lock_guard<std::recursive_mutex> controls(istream->control_mutex_);
   if (driver_) {
     // The driver can implement device-specific behavior for some prop_id's
     // while falling through to the default behavior for others.
@@ -570,22 +861,161 @@ bool VideoCapture::get_prop_range(int prop_id, double* min_val, double* max_val)
   return true;
 }
 
+bool VideoCapture::set_roi(const cv::Rect& roi) {
+  if (!is_realuvc_) return false;
+  auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
+  if (!istream) return false;
+  std::unique_lock<std::mutex> lock(istream->mutex_);
+  int pixel_mul = ((istream->fixup_ == FIXUP_NORMAL) ? 1 : 2); // 8bit pixels
+  int cols = istream->profile_.width * pixel_mul;
+  int rows = istream->profile_.height;
+  if ((roi.x < 0) || (roi.y < 0) || (roi.width < 0) || (roi.height < 0) ||
+      (roi.x + roi.width > cols) || (roi.y + roi.height > rows)) {
+    return false;
+  }
+  auto& crop = istream->hw_crop_;
+  if (istream->is_streaming_ && !crop.empty()) {
+    // The sensor crop can't change until the stream is restarted
+    if (roi.empty() || (roi.x < crop.x) || (roi.y < crop.y) ||
+        (roi.x + roi.width > crop.x + crop.width) ||
+        (roi.y + roi.height > crop.y + crop.height)) {
+      return false;
+    }
+  }
+  istream->roi_ = roi;
+  istream->update_roi();
+  return true;
+}
+
+cv::Rect VideoCapture::get_roi() const {
+  if (!is_realuvc_) return cv::Rect();
+  auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
+  if (!istream) return cv::Rect();
+  std::unique_lock<std::mutex> lock(istream->mutex_);
+  return istream->roi_;
+}
+
+ru_nsec_t VideoCapture::get_frame_timestamp_ns() const {
+  if (!is_realuvc_) return 0;
+  auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
+  if (!istream) return 0;
+  std::unique_lock<std::mutex> lock(istream->mutex_);
+  return istream->frame_time_;
+}
+
+// A driver exists only for an open realuvc device, so istream_ is set
 shared_ptr<OpaqueCalibration> VideoCapture::get_opaque_calibration() {
-  return (driver_ ? driver_->get_opaque_calibration() : shared_ptr<OpaqueCalibration>());
+  if (!driver_) return shared_ptr<OpaqueCalibration>();
+  auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
+  std::lock_guard<std::recursive_mutex> controls(istream->control_mutex_);
+  return driver_->get_opaque_calibration();
 }
 
 bool VideoCapture::get_xu(int ctrl, uint8_t* data, int len) {
   std::cout << "custom get xu 2" << std::endl;
-  if(driver_)
+  if(driver_) {
+    auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
+    std::lock_guard<std::recursive_mutex> controls(istream->control_mutex_);
     return driver_->get_xu(ctrl, data, len);
+  }
   return false;
 }
 
 bool VideoCapture::set_xu(int ctrl, const uint8_t* data, int len) {
   std::cout << "custom set xu 2" << std::endl;
-  if(driver_)
+  if(driver_) {
+    auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
+    std::lock_guard<std::recursive_mutex> controls(istream->control_mutex_);
     return driver_->set_xu(ctrl, data, len);
+  }
   return false;
 }
 
+// Keys for the control worker: properties, then XU controls
+static constexpr uint64_t kControlKeyProp = (1ull << 32);
+static constexpr uint64_t kControlKeyXu   = (2ull << 32);
+
+static std::future<bool> ready_future(bool ok) {
+  std::promise<bool> promise;
+  promise.set_value(ok);
+  return promise.get_future();
+}
+
+std::future<bool> VideoCapture::set_async(int prop_id, double value) {
+  if (!controls_) return ready_future(this->set(prop_id, value));
+  return controls_->submit(kControlKeyProp | (uint32_t)prop_id, [this, prop_id, value]() {
+    return this->set(prop_id, value);
+  });
+}
+
+void VideoCapture::set_async(int prop_id, double value, std::function<void(bool)> done) {
+  if (!controls_) {
+    bool ok = this->set(prop_id, value);
+    if (done) done(ok);
+    return;
+  }
+  controls_->submit(kControlKeyProp | (uint32_t)prop_id, [this, prop_id, value]() {
+    return this->set(prop_id, value);
+  }, std::move(done));
+}
+
+std::future<bool> VideoCapture::set_xu_async(int ctrl, const uint8_t* data, int len) {
+  if (!controls_ || !driver_) return ready_future(false);
+  vector<uint8_t> bytes(data, data + len);
+  auto driver = driver_;
+  auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
+  return controls_->submit(kControlKeyXu | (uint8_t)ctrl, [driver, istream, ctrl, bytes]() {
+    std::lock_guard<std::recursive_mutex> controls(istream->control_mutex_);
+    return driver->set_xu((uint8_t)ctrl, bytes.data(), (int)bytes.size());
+  });
+}
+
+size_t VideoCapture::get_control_queue_depth() const {
+  return (controls_ ? controls_->queue_depth() : 0);
+}
+
+uint64_t VideoCapture::set_at_frame(const PropertyChanges& changes, std::function<void(bool)> done) {
+  auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
+  if (!controls_ || !istream) {
+    bool ok = true;
+    for (auto& change : changes) ok &= this->set(change.first, change.second);
+    if (done) done(ok);
+    return 0;
+  }
+  uint64_t id;
+  {
+    std::unique_lock<std::mutex> lock(istream->mutex_);
+    id = ++istream->last_settings_id_;
+    istream->pending_settings_.push_back(VideoStream::PendingSettings{ id, 0 });
+  }
+  auto driver = driver_;
+  controls_->submit(0, [this, istream, driver, changes, id]() {
+    bool ok = true;
+    // The whole transaction reaches the device before any other control
+    std::unique_lock<std::recursive_mutex> controls(istream->control_mutex_);
+    for (auto& change : changes) ok &= this->set(change.first, change.second);
+    controls.unlock();
+    // The device has acknowledged every change.  The frame being exposed
+    // right now may still have the old settings, so the first frame to
+    // count is one captured a full frame interval (per frame of latency)
+    // later.
+    int latency = (driver ? driver->get_control_latency_frames() : 1);
+    std::unique_lock<std::mutex> lock(istream->mutex_);
+    uint32_t fps = (istream->profile_.fps ? istream->profile_.fps : 30);
+    ru_nsec_t effective_ns = monotonic_now_ns() + (latency * (1000000000LL / fps));
+    for (auto& pending : istream->pending_settings_) {
+      if (pending.id == id) pending.effective_ns = effective_ns;
+    }
+    return ok;
+  }, std::move(done));
+  return id;
+}
+
+uint64_t VideoCapture::get_frame_settings_id() const {
+  auto istream = std::dynamic_pointer_cast<VideoStream>(istream_);
+  if (!istream) return 0;
+  std::unique_lock<std::mutex> lock(istream->mutex_);
+  return istream->frame_settings_id_;
+}
+
 } // end librealuvc
@@ -168,6 +168,8 @@ void config_cap(shared_ptr<VideoCapture> cap, ViewerOptions& opt) {
     printf("-- set fps %.1f width %d height %d\n", p->fps_, p->width_, p->height_);
     fflush(stdout);
     cap->set(cv::CAP_PROP_FOURCC, str2fourcc("YUY2"));
+    // Plain YUY2 comes out as 2-channel YUV unless converted
+    if (table == config_default) cap->set(cv::CAP_PROP_CONVERT_RGB, 1);
     cap->set(cv::CAP_PROP_FPS,          p->fps_);
     cap->set(cv::CAP_PROP_FRAME_WIDTH,  p->width_);
     cap->set(cv::CAP_PROP_FRAME_HEIGHT, p->height_);
@@ -25,6 +25,7 @@ The library will be compiled without the metadata support!\n")
 #endif
 
 #include "win-uvc.h"
+#include "../trace.h"
 #include "../types.h"
 
 #include "Shlwapi.h"
@@ -215,10 +216,12 @@ namespace librealuvc
                                 auto& stream = owner->_streams[dwStreamIndex];
                                 std::lock_guard<std::mutex> lock(owner->_streams_mutex);
                                 auto profile = stream.profile;
-                                frame_object f{ current_length, metadata_size, byte_buffer, metadata, monotonic_to_realtime(llTimestamp/10000.f) };
+                                frame_object f{ current_length, metadata_size, byte_buffer, metadata, (ru_nsec_t)llTimestamp * 100 };
+                                RU_TRACE(TRACE_DQBUF, f.monotonic_ns);
 
-                                auto continuation = [buffer, this]()
+                                auto continuation = [buffer, this, f]()
                                 {
+                                    RU_TRACE(TRACE_REQUEUE, f.monotonic_ns);
                                     buffer->Unlock();
                                 };
 
@@ -0,0 +1,181 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+// Telling the dark frames of a strobed stereo IR stream from the lit ones,
+// in particular when the lit frames get darker.
+
+#include "catch/catch.hpp"
+#include <librealuvc/realuvc_driver.h>
+
+#include <chrono>
+#include <future>
+#include <memory>
+#include <vector>
+
+using namespace librealuvc;
+
+namespace
+{
+    // Alternating lit and dark frames, as in the ROBUST strobe mode
+    std::vector<double> strobed(double lit, double dark, int pairs)
+    {
+        std::vector<double> levels;
+        for (int j = 0; j < pairs; ++j)
+        {
+            levels.push_back(lit);
+            levels.push_back(dark);
+        }
+        return levels;
+    }
+
+    std::vector<double> steady(double level, int count)
+    {
+        return std::vector<double>(count, level);
+    }
+
+    std::vector<double> operator+(std::vector<double> a, const std::vector<double>& b)
+    {
+        a.insert(a.end(), b.begin(), b.end());
+        return a;
+    }
+
+    // The longest run of frames taken as dark
+    int longest_dark_run(StrobeLevels& levels, const std::vector<double>& sequence)
+    {
+        int run = 0, longest = 0;
+        for (auto level : sequence)
+        {
+            run = (levels.is_dark(level) ? run + 1 : 0);
+            longest = std::max(longest, run);
+        }
+        return longest;
+    }
+}
+
+TEST_CASE("StrobeLevels tells dark frames from lit ones", "[ambient]")
+{
+    StrobeLevels levels;
+    CHECK_FALSE(levels.is_dark(200)); // the first frame is taken as lit
+    CHECK(levels.is_dark(20));
+    CHECK_FALSE(levels.is_dark(190));
+    CHECK(levels.is_dark(25));
+    CHECK_FALSE(levels.is_dark(210));
+    CHECK(levels.get_lit_level() > 150);
+    CHECK(levels.get_dark_level() < 30);
+
+    levels.reset();
+    CHECK(levels.get_lit_level() == 0);
+    CHECK_FALSE(levels.is_dark(20));
+}
+
+TEST_CASE("StrobeLevels follows stepped-down brightness", "[ambient]")
+{
+    StrobeLevels levels;
+    longest_dark_run(levels, strobed(200, 20, 8));
+
+    SECTION("exposure halved, again and again")
+    {
+        auto sequence = strobed(100, 10, 8) + strobed(50, 5, 8) + strobed(24, 2, 8);
+        CHECK(longest_dark_run(levels, sequence) <= 2);
+        // and the strobe is recognized again at the new level
+        CHECK(levels.is_dark(2));
+        CHECK_FALSE(levels.is_dark(24));
+        CHECK(levels.is_dark(2));
+    }
+
+    SECTION("exposure cut tenfold")
+    {
+        CHECK(longest_dark_run(levels, strobed(20, 2, 8)) <= 2);
+        CHECK(levels.is_dark(2));
+        CHECK_FALSE(levels.is_dark(20));
+    }
+
+    SECTION("LEDs off")
+    {
+        CHECK(longest_dark_run(levels, steady(20, 32)) <= 2);
+        CHECK_FALSE(levels.is_dark(20));
+        CHECK_FALSE(levels.is_dark(21));
+    }
+
+    SECTION("LEDs off in a dark room")
+    {
+        CHECK(longest_dark_run(levels, steady(1, 32)) <= 2);
+        CHECK_FALSE(levels.is_dark(1));
+    }
+
+    SECTION("brighter again")
+    {
+        CHECK(longest_dark_run(levels, strobed(20, 2, 8) + strobed(220, 20, 8)) <= 2);
+        CHECK(levels.is_dark(20));
+        CHECK_FALSE(levels.is_dark(220));
+    }
+}
+
+TEST_CASE("StrobeLevels keeps dark frames in a dark room", "[ambient]")
+{
+    // Dark frames of a few gray levels of noise stay dark
+    StrobeLevels levels;
+    int dark = 0;
+    for (int j = 0; j < 32; ++j)
+    {
+        levels.is_dark(180 + (j % 3));
+        dark += (levels.is_dark(1 + (j % 4)) ? 1 : 0);
+    }
+    CHECK(dark >= 30);
+}
+
+TEST_CASE("DevFrameQueue hands out frames after the brightness steps down", "[ambient]")
+{
+    const uint32_t width = 16, height = 8;
+    const size_t frame_size = 2 * width * height;
+    auto sequence = strobed(200, 20, 8) + strobed(40, 4, 8) + steady(20, 16);
+    const int marker = (int)sequence.size();
+    sequence.push_back(255); // always lit
+    sequence.push_back(255); // spare, to unblock a failed pop
+
+    DevFrameQueue queue(FIXUP_GRAY8_PIX_L_PIX_R, sequence.size());
+    queue.set_ambient_subtract(true);
+
+    stream_profile profile{ width, height, 90, RU_FOURCC_GREY };
+    std::vector<std::vector<uint8_t>> buffers;
+    for (size_t j = 0; j < sequence.size(); ++j)
+        buffers.emplace_back(frame_size, (uint8_t)sequence[j]);
+    auto push = [&](size_t j)
+    {
+        frame_object frame{ frame_size, 0, buffers[j].data(), nullptr, (ru_nsec_t)j };
+        queue.push_back(profile, frame, []() {});
+    };
+    for (int j = 0; j <= marker; ++j)
+        push(j);
+
+    // Dark frames are swallowed, so pop until the always-lit marker
+    std::vector<int> handed_out;
+    for (;;)
+    {
+        auto popped = std::async(std::launch::async, [&]()
+        {
+            ru_nsec_t ts = 0;
+            cv::Mat mat;
+            queue.pop_front(ts, mat);
+            return (int)ts;
+        });
+        auto status = popped.wait_for(std::chrono::seconds(5));
+        if (status != std::future_status::ready)
+            push(marker + 1);
+        REQUIRE(status == std::future_status::ready);
+        handed_out.push_back(popped.get());
+        if (handed_out.back() == marker)
+            break;
+    }
+
+    int stepped_down = 0;
+    int steady_part = 0;
+    for (auto j : handed_out)
+    {
+        if (j >= 16 && j < 32) ++stepped_down;
+        if (j >= 32 && j < marker) ++steady_part;
+    }
+    // At most two dark frames in a row are ever kept back
+    CHECK(stepped_down >= 5);
+    CHECK(steady_part >= 5);
+}
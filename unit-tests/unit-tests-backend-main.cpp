@@ -0,0 +1,8 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+// backend-test runs without a device: the backend pieces are driven
+// through fakes and pipes.
+
+#define CATCH_CONFIG_MAIN
+#include "catch/catch.hpp"
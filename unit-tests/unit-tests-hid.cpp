@@ -0,0 +1,299 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+// hid_reader and hid_scan_decoder, with pipes standing in for the IIO
+// character devices.
+
+#include "catch/catch.hpp"
+#include "linux/backend-hid.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace librealuvc;
+using namespace librealuvc::platform;
+
+namespace
+{
+    const uint32_t scan_size = 8;
+
+    hid_sample_batch scan_layout()
+    {
+        hid_sample_batch layout{};
+        layout.sensor = 7;
+        layout.stride = scan_size;
+        layout.data_size = 6;
+        layout.metadata_offset = 6;
+        layout.metadata_size = 2;
+        return layout;
+    }
+
+    // A non-blocking pipe, read end first, like an IIO buffer fd
+    struct sensor_pipe
+    {
+        int fds[2];
+
+        sensor_pipe()
+        {
+            REQUIRE(pipe2(fds, O_CLOEXEC | O_NONBLOCK) == 0);
+        }
+
+        ~sensor_pipe()
+        {
+            close_read();
+            close_write();
+        }
+
+        int read_fd() const { return fds[0]; }
+
+        void write_scans(uint8_t first, uint32_t count)
+        {
+            std::vector<uint8_t> data(count * scan_size);
+            for (size_t j = 0; j < data.size(); ++j)
+                data[j] = (uint8_t)(first + j / scan_size);
+            REQUIRE(write(fds[1], data.data(), data.size()) == (ssize_t)data.size());
+        }
+
+        void close_read()
+        {
+            if (fds[0] >= 0)
+                ::close(fds[0]);
+            fds[0] = -1;
+        }
+
+        void close_write()
+        {
+            if (fds[1] >= 0)
+                ::close(fds[1]);
+            fds[1] = -1;
+        }
+    };
+
+    // Batches as the sensor callback sees them
+    class batch_log
+    {
+    public:
+        hid_batch_callback callback()
+        {
+            return [this](const hid_sample_batch& batch)
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                for (uint32_t j = 0; j < batch.count; ++j)
+                {
+                    auto f = batch.frame(j);
+                    _firsts.push_back(((const uint8_t*)f.pixels)[0]);
+                    _metadata_ok.push_back(f.metadata == (const uint8_t*)f.pixels + 6);
+                }
+                _sensor = batch.sensor;
+                ++_batches;
+                _cv.notify_all();
+            };
+        }
+
+        bool wait_for_scans(size_t count)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            return _cv.wait_for(lock, std::chrono::seconds(5), [&]() { return _firsts.size() >= count; });
+        }
+
+        std::vector<uint8_t> firsts()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _firsts;
+        }
+
+        std::vector<bool> metadata_ok()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _metadata_ok;
+        }
+
+        hid_sensor_id sensor()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _sensor;
+        }
+
+        int batches()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _batches;
+        }
+
+    private:
+        std::mutex _mutex;
+        std::condition_variable _cv;
+        std::vector<uint8_t> _firsts;
+        std::vector<bool> _metadata_ok;
+        hid_sensor_id _sensor = 0;
+        int _batches = 0;
+    };
+
+    bool wait_until(std::function<bool()> done)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (!done())
+        {
+            if (std::chrono::steady_clock::now() > deadline)
+                return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return true;
+    }
+}
+
+TEST_CASE("hid_reader delivers whole scans as batches", "[hid]")
+{
+    auto reader = hid_reader::create();
+    sensor_pipe sensor;
+    batch_log log;
+    auto decoder = std::make_shared<hid_scan_decoder>(scan_layout(), 16, log.callback());
+    reader->add(sensor.read_fd(), [decoder](int fd) { return decoder->read_from(fd); });
+    CHECK(reader->size() == 1);
+
+    sensor.write_scans(10, 3);
+    REQUIRE(log.wait_for_scans(3));
+    sensor.write_scans(20, 2);
+    REQUIRE(log.wait_for_scans(5));
+
+    CHECK(log.firsts() == std::vector<uint8_t>({ 10, 11, 12, 20, 21 }));
+    CHECK(log.metadata_ok() == std::vector<bool>(5, true));
+    CHECK(log.sensor() == 7);
+    CHECK(log.batches() <= 5);
+
+    reader->remove(sensor.read_fd());
+    CHECK(reader->size() == 0);
+}
+
+TEST_CASE("hid_reader serves several fds on one thread", "[hid]")
+{
+    auto reader = hid_reader::create();
+    sensor_pipe a, b;
+    batch_log log_a, log_b;
+    auto decoder_a = std::make_shared<hid_scan_decoder>(scan_layout(), 4, log_a.callback());
+    auto decoder_b = std::make_shared<hid_scan_decoder>(scan_layout(), 4, log_b.callback());
+    reader->add(a.read_fd(), [decoder_a](int fd) { return decoder_a->read_from(fd); });
+    reader->add(b.read_fd(), [decoder_b](int fd) { return decoder_b->read_from(fd); });
+    CHECK(reader->size() == 2);
+    CHECK_THROWS(reader->add(a.read_fd(), [](int) { return true; }));
+
+    a.write_scans(1, 2);
+    b.write_scans(50, 1);
+    REQUIRE(log_a.wait_for_scans(2));
+    REQUIRE(log_b.wait_for_scans(1));
+    CHECK(log_a.firsts() == std::vector<uint8_t>({ 1, 2 }));
+    CHECK(log_b.firsts() == std::vector<uint8_t>({ 50 }));
+
+    reader->remove(a.read_fd());
+    reader->remove(b.read_fd());
+    CHECK(reader->size() == 0);
+}
+
+TEST_CASE("hid_reader drops an fd at EOF", "[hid]")
+{
+    auto reader = hid_reader::create();
+    sensor_pipe sensor;
+    batch_log log;
+    auto decoder = std::make_shared<hid_scan_decoder>(scan_layout(), 16, log.callback());
+    reader->add(sensor.read_fd(), [decoder](int fd) { return decoder->read_from(fd); });
+
+    sensor.write_scans(3, 1);
+    REQUIRE(log.wait_for_scans(1));
+    sensor.close_write();
+    CHECK(wait_until([&]() { return reader->size() == 0; }));
+    CHECK(log.firsts() == std::vector<uint8_t>({ 3 }));
+}
+
+TEST_CASE("hid_reader lets a handler remove its own fd", "[hid]")
+{
+    auto reader = hid_reader::create();
+    sensor_pipe sensor;
+    std::mutex mutex;
+    int calls = 0;
+    reader->add(sensor.read_fd(), [&](int fd)
+    {
+        uint8_t buf[64];
+        while (read(fd, buf, sizeof(buf)) > 0) {}
+        std::lock_guard<std::mutex> lock(mutex);
+        ++calls;
+        reader->remove(fd); // must not wait for itself
+        return true;
+    });
+
+    sensor.write_scans(0, 1);
+    REQUIRE(wait_until([&]() { return reader->size() == 0; }));
+    sensor.write_scans(0, 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::lock_guard<std::mutex> lock(mutex);
+    CHECK(calls == 1);
+}
+
+TEST_CASE("hid_reader survives a handler that stops the capture", "[hid]")
+{
+    // As a sensor's stop_capture() from its own batch callback: the fd is
+    // removed and both the decoder and the last reader reference dropped
+    // while the decoder's read_from() is still on the stack.
+    struct capture
+    {
+        std::shared_ptr<hid_reader> reader;
+        std::shared_ptr<hid_scan_decoder> decoder;
+        int fd = -1;
+    };
+
+    sensor_pipe sensor;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopped = false;
+    std::weak_ptr<hid_reader> weak_reader;
+    std::weak_ptr<hid_scan_decoder> weak_decoder;
+
+    auto cap = std::make_shared<capture>();
+    cap->fd = sensor.read_fd();
+    cap->reader = hid_reader::create();
+    std::weak_ptr<capture> weak_cap = cap;
+    cap->decoder = std::make_shared<hid_scan_decoder>(scan_layout(), 16, [&, weak_cap](const hid_sample_batch&)
+    {
+        auto c = weak_cap.lock();
+        if (!c)
+            return;
+        c->reader->remove(c->fd);
+        c->reader.reset();
+        c->decoder.reset();
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+        cv.notify_all();
+    });
+    weak_reader = cap->reader;
+    weak_decoder = cap->decoder;
+    auto decoder = cap->decoder;
+    cap->reader->add(cap->fd, [decoder](int fd) { return decoder->read_from(fd); });
+    decoder.reset();
+
+    sensor.write_scans(0, 1);
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        REQUIRE(cv.wait_for(lock, std::chrono::seconds(5), [&]() { return stopped; }));
+    }
+    // The reader thread lets go of both once the handler returns
+    CHECK(wait_until([&]() { return weak_reader.expired() && weak_decoder.expired(); }));
+}
+
+TEST_CASE("hid_reader::get shares one reader until released", "[hid]")
+{
+    auto a = hid_reader::get();
+    auto b = hid_reader::get();
+    CHECK(a == b);
+    std::weak_ptr<hid_reader> weak = a;
+    a.reset();
+    b.reset();
+    CHECK(weak.expired());
+    auto c = hid_reader::get();
+    CHECK(c);
+}
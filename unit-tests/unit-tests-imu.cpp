@@ -0,0 +1,288 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+// imu_ring queries, lapping and the device-to-host clock mapping, fed
+// with synthetic samples and hid_sensor_data batches.
+
+#include "catch/catch.hpp"
+#include <librealuvc/ru_imu.h>
+
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+using namespace librealuvc;
+
+namespace
+{
+    imu_sample sample_at(ru_nsec_t t, uint64_t device_ts, float x)
+    {
+        imu_sample s;
+        s.monotonic_ns = t;
+        s.device_ts = device_ts;
+        s.x = x;
+        s.y = 2 * x;
+        s.z = -x;
+        return s;
+    }
+
+    // Samples at t = 100, 200, ... 1000 with x = t / 100
+    void fill_ten(imu_ring& ring)
+    {
+        for (int j = 1; j <= 10; ++j)
+            ring.push(sample_at(100 * j, 10 * j, (float)j));
+    }
+
+    // A batch of hid_sensor_data at the given device timestamps
+    class sensor_batch
+    {
+    public:
+        sensor_batch(const std::vector<uint64_t>& device_ts, ru_nsec_t read_ns)
+            : _data(device_ts.size())
+        {
+            for (size_t j = 0; j < device_ts.size(); ++j)
+            {
+                std::memset(&_data[j], 0, sizeof(hid_sensor_data));
+                _data[j].x = (int16_t)j;
+                _data[j].y = (int16_t)(10 + j);
+                _data[j].z = (int16_t)(20 + j);
+                _data[j].ts_low = (uint32_t)device_ts[j];
+                _data[j].ts_high = (uint32_t)(device_ts[j] >> 32);
+            }
+            _batch = hid_sample_batch{};
+            _batch.count = (uint32_t)_data.size();
+            _batch.stride = sizeof(hid_sensor_data);
+            _batch.data_size = sizeof(hid_sensor_data);
+            _batch.samples = (const uint8_t*)_data.data();
+            _batch.monotonic_ns = read_ns;
+        }
+
+        const hid_sample_batch& batch() const { return _batch; }
+
+    private:
+        std::vector<hid_sensor_data> _data;
+        hid_sample_batch _batch;
+    };
+
+    std::vector<imu_sample> everything(const imu_ring& ring)
+    {
+        std::vector<imu_sample> out;
+        ring.samples_between(0, INT64_MAX, out);
+        return out;
+    }
+}
+
+TEST_CASE("imu_ring samples_between bounds and ordering", "[imu]")
+{
+    imu_ring ring(64);
+    std::vector<imu_sample> out;
+    CHECK(ring.samples_between(0, 1000, out) == 0);
+
+    fill_ten(ring);
+    // Both ends are inclusive
+    REQUIRE(ring.samples_between(200, 500, out) == 4);
+    CHECK(out[0].monotonic_ns == 200);
+    CHECK(out[1].monotonic_ns == 300);
+    CHECK(out[2].monotonic_ns == 400);
+    CHECK(out[3].monotonic_ns == 500);
+    CHECK(out[3].x == 5.0f);
+
+    REQUIRE(ring.samples_between(250, 450, out) == 2);
+    CHECK(out[0].monotonic_ns == 300);
+    CHECK(out[1].monotonic_ns == 400);
+
+    CHECK(ring.samples_between(0, 1000, out) == 10);
+    for (size_t j = 1; j < out.size(); ++j)
+        CHECK(out[j-1].monotonic_ns < out[j].monotonic_ns);
+
+    // Outside the buffered range, and an empty window; out is cleared
+    CHECK(ring.samples_between(0, 99, out) == 0);
+    CHECK(out.empty());
+    CHECK(ring.samples_between(1001, 5000, out) == 0);
+    CHECK(ring.samples_between(600, 500, out) == 0);
+    CHECK(ring.samples_between(1000, 1000, out) == 1);
+}
+
+TEST_CASE("imu_ring interpolate_at", "[imu]")
+{
+    imu_ring ring(64);
+    imu_sample s;
+    CHECK_FALSE(ring.interpolate_at(100, s));
+    CHECK_FALSE(ring.latest(s));
+
+    fill_ten(ring);
+
+    SECTION("inside the buffered range")
+    {
+        REQUIRE(ring.interpolate_at(450, s));
+        CHECK(s.monotonic_ns == 450);
+        CHECK(s.device_ts == 45);
+        CHECK(s.x == Approx(4.5));
+        CHECK(s.y == Approx(9.0));
+        CHECK(s.z == Approx(-4.5));
+
+        REQUIRE(ring.interpolate_at(525, s));
+        CHECK(s.x == Approx(5.25));
+    }
+
+    SECTION("on a sample, including the first and the last")
+    {
+        REQUIRE(ring.interpolate_at(300, s));
+        CHECK(s.x == 3.0f);
+        CHECK(s.device_ts == 30);
+        REQUIRE(ring.interpolate_at(100, s));
+        CHECK(s.x == 1.0f);
+        REQUIRE(ring.interpolate_at(1000, s));
+        CHECK(s.x == 10.0f);
+    }
+
+    SECTION("outside the buffered range")
+    {
+        CHECK_FALSE(ring.interpolate_at(99, s));
+        CHECK_FALSE(ring.interpolate_at(1001, s));
+        CHECK_FALSE(ring.interpolate_at(0, s));
+    }
+
+    REQUIRE(ring.latest(s));
+    CHECK(s.monotonic_ns == 1000);
+}
+
+TEST_CASE("imu_ring drops what the writer overwrote", "[imu]")
+{
+    imu_ring ring(16);
+    REQUIRE(ring.capacity() == 16);
+    for (int j = 0; j < 40; ++j)
+        ring.push(sample_at(100 * (j + 1), j, (float)j));
+
+    // Only the newest capacity() samples are left
+    auto out = everything(ring);
+    REQUIRE(out.size() == 16);
+    CHECK(out.front().device_ts == 24);
+    CHECK(out.back().device_ts == 39);
+
+    imu_sample s;
+    CHECK_FALSE(ring.interpolate_at(100 * 24, s)); // overwritten
+    CHECK_FALSE(ring.interpolate_at(100 * 25 - 50, s)); // before the oldest left
+    CHECK(ring.interpolate_at(100 * 25, s));
+    REQUIRE(ring.latest(s));
+    CHECK(s.device_ts == 39);
+}
+
+TEST_CASE("imu_ring readers never see a sample the writer lapped", "[imu]")
+{
+    // A small ring and a writer flat out, so readers get lapped mid-copy.
+    // Every field of a sample is derived from its index, so a torn or
+    // stale slot shows up as a mismatch.
+    imu_ring ring(16);
+    const uint64_t total = 200000;
+    std::atomic<bool> done(false);
+    std::thread writer([&]()
+    {
+        for (uint64_t j = 0; j < total; ++j)
+            ring.push(sample_at(1000 * (ru_nsec_t)(j + 1), j, (float)(j & 0xffff)));
+        done = true;
+    });
+
+    uint64_t reads = 0, samples = 0, bad = 0;
+    std::vector<imu_sample> out;
+    while (!done || (reads == 0))
+    {
+        ++reads;
+        ring.samples_between(0, INT64_MAX, out);
+        if (out.size() > ring.capacity())
+            ++bad;
+        for (size_t j = 0; j < out.size(); ++j)
+        {
+            auto& s = out[j];
+            ++samples;
+            if ((s.monotonic_ns != 1000 * (ru_nsec_t)(s.device_ts + 1)) ||
+                (s.x != (float)(s.device_ts & 0xffff)) || (s.y != 2 * s.x))
+                ++bad;
+            if ((j > 0) && (s.device_ts != out[j-1].device_ts + 1))
+                ++bad;
+        }
+        imu_sample latest;
+        if (ring.latest(latest) && (latest.x != (float)(latest.device_ts & 0xffff)))
+            ++bad;
+    }
+    writer.join();
+    CHECK(bad == 0);
+    CHECK(reads > 0);
+
+    auto last = everything(ring);
+    REQUIRE(last.size() == 16);
+    CHECK(last.back().device_ts == total - 1);
+}
+
+TEST_CASE("imu_ring maps device timestamps to host time", "[imu]")
+{
+    // Microsecond device ticks; base is an arbitrary host clock origin
+    imu_ring ring(64, 1000);
+    const ru_nsec_t base = 5000000000LL;
+    imu_sample s;
+
+    // The first batch was read 500us after its newest sample
+    sensor_batch first({ 1000, 2000, 3000 }, base + 3000000 + 500000);
+    ring.push(first.batch());
+    auto out = everything(ring);
+    REQUIRE(out.size() == 3);
+    CHECK(out[0].monotonic_ns == base + 1000000 + 500000);
+    CHECK(out[2].monotonic_ns == base + 3000000 + 500000);
+    CHECK(out[0].device_ts == 1000);
+    CHECK(out[1].x == 1.0f);
+    CHECK(out[1].y == 11.0f);
+    CHECK(out[1].z == 21.0f);
+
+    // A read only 100us late lowers the offset at once
+    ru_nsec_t second_read = base + 6000000 + 100000;
+    sensor_batch second({ 4000, 5000, 6000 }, second_read);
+    ring.push(second.batch());
+    REQUIRE(ring.latest(s));
+    CHECK(s.monotonic_ns == base + 6000000 + 100000);
+
+    // Ten seconds on, a read 2ms late only lets the offset creep by
+    // 100ppm of the elapsed host time
+    ru_nsec_t third_read = base + 10006000000LL + 2100000;
+    sensor_batch third({ 10005000, 10006000 }, third_read);
+    ring.push(third.batch());
+    ru_nsec_t creep = (third_read - second_read) * 100 / 1000000;
+    REQUIRE(creep < 2000000);
+    REQUIRE(ring.latest(s));
+    CHECK(s.monotonic_ns == 10006000LL * 1000 + base + 100000 + creep);
+
+    // An offset stepping back can't reorder the ring: the samples that
+    // would land before the newest one are pushed just after it
+    REQUIRE(ring.latest(s));
+    ru_nsec_t newest = s.monotonic_ns;
+    sensor_batch fourth({ 10006001, 10006002 }, base + 10006002000LL + 100000);
+    ring.push(fourth.batch());
+    out = everything(ring);
+    REQUIRE(out.size() == 10);
+    CHECK(out[8].monotonic_ns == newest + 1);
+    CHECK(out[9].monotonic_ns == newest + 2);
+    for (size_t j = 1; j < out.size(); ++j)
+        CHECK(out[j-1].monotonic_ns < out[j].monotonic_ns);
+}
+
+TEST_CASE("imu_recorder routes batches by sensor", "[imu]")
+{
+    imu_recorder recorder({ "test-imu-accel", "test-imu-gyro" }, 32);
+    auto accel = recorder.get_ring("test-imu-accel");
+    auto gyro = recorder.get_ring("test-imu-gyro");
+    REQUIRE(accel);
+    REQUIRE(gyro);
+    CHECK(accel != gyro);
+    CHECK_FALSE(recorder.get_ring("test-imu-other"));
+
+    auto callback = recorder.callback();
+    sensor_batch batch({ 1, 2 }, 1000000);
+    hid_sample_batch b = batch.batch();
+    b.sensor = hid_sensor_intern("test-imu-gyro");
+    callback(b);
+    b.sensor = hid_sensor_intern("test-imu-other");
+    callback(b);
+
+    CHECK(everything(*gyro).size() == 2);
+    CHECK(everything(*accel).empty());
+}
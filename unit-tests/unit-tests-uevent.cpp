@@ -0,0 +1,246 @@
+// License: Apache 2.0. See LICENSE file in root directory.
+// Copyright(c) 2019 Leap Motion Corporation. All Rights Reserved.
+
+// uevent parsing and the device watcher, driven by fake_uevent_source
+// and a backend whose device lists are set by the test.
+
+#include "catch/catch.hpp"
+#include "linux/backend-uevent.h"
+
+#include <arpa/inet.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace librealuvc;
+using namespace librealuvc::platform;
+
+namespace
+{
+    // "KEY=value\0KEY=value\0..."
+    std::string props(const std::vector<std::string>& kvs)
+    {
+        std::string s;
+        for (auto& kv : kvs)
+        {
+            s += kv;
+            s.push_back('\0');
+        }
+        return s;
+    }
+
+    std::string kernel_message(const std::string& action, const std::string& devpath,
+                               const std::vector<std::string>& kvs)
+    {
+        std::string head = action + "@" + devpath;
+        head.push_back('\0');
+        return head + props(kvs);
+    }
+
+    std::string udev_message(const std::vector<std::string>& kvs, uint32_t magic = 0xfeedcafe)
+    {
+        auto body = props(kvs);
+        uint32_t words[8] = {};
+        words[0] = htonl(magic);
+        words[1] = 40;                  // header_size
+        words[2] = 40;                  // properties_off
+        words[3] = (uint32_t)body.size();
+        std::string msg("libudev\0", 8);
+        msg.append((const char*)words, sizeof(words));
+        return msg + body;
+    }
+
+    uvc_device_info camera(const std::string& node, const std::string& metadata_node = "")
+    {
+        uvc_device_info info;
+        info.id = "/dev/" + node;
+        info.vid = 0xf182;
+        info.pid = 0x0003;
+        info.device_path = "/sys/devices/pci0000:00/0000:00:14.0/usb1/1-1/1-1:1.0/video4linux/" + node;
+        info.has_metadata_node = !metadata_node.empty();
+        if (info.has_metadata_node)
+            info.metadata_node_id = "/dev/" + metadata_node;
+        return info;
+    }
+
+    uevent video_event(const std::string& action, const std::string& node, const std::string& devname)
+    {
+        uevent ev;
+        ev.action = action;
+        ev.devpath = "/devices/virtual/unrelated/" + node;
+        ev.subsystem = "video4linux";
+        ev.devname = devname;
+        return ev;
+    }
+
+    class fake_backend : public backend
+    {
+    public:
+        std::shared_ptr<device_watcher> create_device_watcher() const override { return nullptr; }
+        std::shared_ptr<hid_device> create_hid_device(hid_device_info) const override { return nullptr; }
+        std::shared_ptr<usb_device> create_usb_device(usb_device_info) const override { return nullptr; }
+        std::shared_ptr<uvc_device> create_uvc_device(uvc_device_info) const override { return nullptr; }
+        std::shared_ptr<time_service> create_time_service() const override { return nullptr; }
+
+        std::vector<hid_device_info> query_hid_devices() const override { return {}; }
+        std::vector<usb_device_info> query_usb_devices() const override { return {}; }
+        std::vector<uvc_device_info> query_uvc_devices() const override
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            ++_uvc_queries;
+            return _uvc;
+        }
+
+        void set_uvc(const std::vector<uvc_device_info>& uvc)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _uvc = uvc;
+        }
+
+        int uvc_queries() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _uvc_queries;
+        }
+
+    private:
+        mutable std::mutex _mutex;
+        mutable int _uvc_queries = 0;
+        std::vector<uvc_device_info> _uvc;
+    };
+
+    // Collects the device groups handed to the watcher's callback
+    class change_log
+    {
+    public:
+        device_changed_callback callback()
+        {
+            return [this](backend_device_group, backend_device_group next)
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _changes.push_back(next);
+                _cv.notify_all();
+            };
+        }
+
+        bool wait_for(size_t count, backend_device_group& last)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (!_cv.wait_for(lock, std::chrono::seconds(5), [&]() { return _changes.size() >= count; }))
+                return false;
+            last = _changes[count - 1];
+            return true;
+        }
+
+    private:
+        std::mutex _mutex;
+        std::condition_variable _cv;
+        std::vector<backend_device_group> _changes;
+    };
+}
+
+TEST_CASE("uevent parses the kernel format", "[uevent]")
+{
+    auto msg = kernel_message("remove", "/devices/pci0000:00/usb1/1-1/1-1:1.0/video4linux/video0",
+        { "ACTION=remove", "DEVPATH=/devices/pci0000:00/usb1/1-1/1-1:1.0/video4linux/video0",
+          "SUBSYSTEM=video4linux", "DEVNAME=video0", "SEQNUM=4321", "MAJOR=81", "MINOR=0" });
+    uevent ev;
+    REQUIRE(uevent::parse(msg.data(), msg.size(), ev));
+    CHECK(ev.action == "remove");
+    CHECK(ev.devpath == "/devices/pci0000:00/usb1/1-1/1-1:1.0/video4linux/video0");
+    CHECK(ev.subsystem == "video4linux");
+    CHECK(ev.devname == "video0");
+    CHECK(ev.devtype.empty());
+}
+
+TEST_CASE("uevent parses the libudev format", "[uevent]")
+{
+    auto msg = udev_message(
+        { "ACTION=add", "DEVPATH=/devices/pci0000:00/usb1/1-1", "SUBSYSTEM=usb",
+          "DEVTYPE=usb_device", "DEVNAME=/dev/bus/usb/001/004", "SEQNUM=4322" });
+    uevent ev;
+    REQUIRE(uevent::parse(msg.data(), msg.size(), ev));
+    CHECK(ev.action == "add");
+    CHECK(ev.devpath == "/devices/pci0000:00/usb1/1-1");
+    CHECK(ev.subsystem == "usb");
+    CHECK(ev.devtype == "usb_device");
+    CHECK(ev.devname == "/dev/bus/usb/001/004");
+}
+
+TEST_CASE("uevent rejects malformed messages", "[uevent]")
+{
+    uevent ev;
+    auto bad_magic = udev_message({ "ACTION=add", "DEVPATH=/devices/x" }, 0xdeadbeef);
+    CHECK_FALSE(uevent::parse(bad_magic.data(), bad_magic.size(), ev));
+
+    auto truncated = udev_message({ "ACTION=add", "DEVPATH=/devices/x" });
+    CHECK_FALSE(uevent::parse(truncated.data(), 44, ev));
+
+    std::string no_at("libusb-junk\0ACTION=add\0", 23);
+    CHECK_FALSE(uevent::parse(no_at.data(), no_at.size(), ev));
+
+    auto no_devpath = kernel_message("add", "/devices/x", { "ACTION=add" });
+    CHECK_FALSE(uevent::parse(no_devpath.data(), no_devpath.size(), ev));
+}
+
+TEST_CASE("uevent_device_watcher applies removals and additions", "[uevent]")
+{
+    auto be = std::make_shared<fake_backend>();
+    be->set_uvc({ camera("video0", "video1"), camera("video2") });
+    auto source = std::make_shared<fake_uevent_source>();
+    uevent_device_watcher watcher(be.get(), source, std::chrono::milliseconds(1));
+    change_log log;
+    watcher.start(log.callback());
+    int queries = be->uvc_queries();
+    backend_device_group last;
+
+    SECTION("libudev removal by absolute node name")
+    {
+        source->inject(video_event("remove", "video0", "/dev/video0"));
+        REQUIRE(log.wait_for(1, last));
+        REQUIRE(last.uvc_devices.size() == 1);
+        CHECK(last.uvc_devices[0].id == "/dev/video2");
+        CHECK(be->uvc_queries() == queries);
+    }
+
+    SECTION("kernel removal by relative node name")
+    {
+        source->inject(video_event("remove", "video2", "video2"));
+        REQUIRE(log.wait_for(1, last));
+        REQUIRE(last.uvc_devices.size() == 1);
+        CHECK(last.uvc_devices[0].id == "/dev/video0");
+        CHECK(be->uvc_queries() == queries);
+    }
+
+    SECTION("removal of a metadata node drops its camera")
+    {
+        source->inject(video_event("remove", "video1", "/dev/video1"));
+        REQUIRE(log.wait_for(1, last));
+        REQUIRE(last.uvc_devices.size() == 1);
+        CHECK(last.uvc_devices[0].id == "/dev/video2");
+    }
+
+    SECTION("removal of an unknown node re-enumerates")
+    {
+        be->set_uvc({ camera("video2") });
+        source->inject(video_event("remove", "video7", "/dev/video7"));
+        REQUIRE(log.wait_for(1, last));
+        REQUIRE(last.uvc_devices.size() == 1);
+        CHECK(last.uvc_devices[0].id == "/dev/video2");
+        CHECK(be->uvc_queries() > queries);
+    }
+
+    SECTION("addition re-enumerates")
+    {
+        be->set_uvc({ camera("video0", "video1"), camera("video2"), camera("video4") });
+        source->inject(video_event("add", "video4", "/dev/video4"));
+        REQUIRE(log.wait_for(1, last));
+        CHECK(last.uvc_devices.size() == 3);
+        CHECK(be->uvc_queries() > queries);
+    }
+
+    watcher.stop();
+}
@@ -6,6 +6,9 @@ Copyright(c) 2017 Intel Corporation. All Rights Reserved. */
 // convenience functions
 #include <pybind11/operators.h>
 
+// numpy arrays
+#include <pybind11/numpy.h>
+
 // STL conversions
 #include <pybind11/stl.h>
 #include <pybind11/stl_bind.h>
@@ -24,8 +27,6 @@ Copyright(c) 2017 Intel Corporation. All Rights Reserved. */
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 
-#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
-#include <numpy/ndarrayobject.h>
 
 #include "../src/backend.h"
 #include "pybackend_extras.h"
@@ -57,111 +58,44 @@ using namespace librealuvc;
 using namespace pyrealuvc;
 
 namespace {
-  
-// cv::Mat to/from Numpy array (adapted from opencv/modules/python/src2/cv2.cpp)
-
-// We copy a good deal of code from opencv to try to make this work
-// without needing to modify the OpenCV library.
-
-using namespace cv;
-
-class PyEnsureGIL {
- public:
-  PyEnsureGIL() : _state(PyGILState_Ensure()) { }
-
-  ~PyEnsureGIL() { PyGILState_Release(_state); }
- private:
-  PyGILState_STATE _state;
-};
-
-class MyNumpyAllocator : public MatAllocator {
-public:
-  MyNumpyAllocator() { stdAllocator = Mat::getStdAllocator(); }
-  ~MyNumpyAllocator() { }
-
-  UMatData* x_allocate(PyObject* o, int dims, const int* sizes, int type, size_t* step) const {
-    cv::UMatData* u = new cv::UMatData(this);
-    u->data = u->origdata = (uchar*)PyArray_DATA((PyArrayObject*) o);
-    npy_intp* _strides = PyArray_STRIDES((PyArrayObject*) o);
-    for (int i = 0; i < dims-1; ++i)
-      step[i] = (size_t)_strides[i];
-    step[dims-1] = CV_ELEM_SIZE(type);
-    u->size = sizes[0]*step[0];
-    u->userdata = o;
-    return u;
-  }
 
-  UMatData* allocate(
-    int dims0, const int* sizes, int type,
-    void* data, size_t* step, AccessFlag flags, UMatUsageFlags usageFlags) const CV_OVERRIDE {
-    if (data != 0) {
-      // issue #6969: CV_Error(Error::StsAssert, "The data should normally be NULL!");
-      // probably this is safe to do in such extreme case
-      return stdAllocator->allocate(dims0, sizes, type, data, step, flags, usageFlags);
-    }
-    PyEnsureGIL gil;
-
-    int depth = CV_MAT_DEPTH(type);
-    int cn = CV_MAT_CN(type);
-    const int f = (int)(sizeof(size_t)/8);
-    int typenum = depth == CV_8U ? NPY_UBYTE : depth == CV_8S ? NPY_BYTE :
-    depth == CV_16U ? NPY_USHORT : depth == CV_16S ? NPY_SHORT :
-    depth == CV_32S ? NPY_INT : depth == CV_32F ? NPY_FLOAT :
-    depth == CV_64F ? NPY_DOUBLE : f*NPY_ULONGLONG + (f^1)*NPY_UINT;
-    int i, dims = dims0;
-    cv::AutoBuffer<npy_intp> _sizes(dims + 1);
-    for (i = 0; i < dims; i++)
-      _sizes[i] = sizes[i];
-    if ( cn > 1 )
-      _sizes[dims++] = cn;
-    PyObject* o = PyArray_SimpleNew(dims, _sizes.data(), typenum);
-    if (!o) {
-      fprintf(stderr, "ERROR: The numpy array of typenum=%d, ndims=%d can not be created", typenum, dims);
-    }
-    auto u = this->x_allocate(o, dims0, sizes, type, step);
-    u->userdata = o;
-    return u;
+// cv::Mat to numpy without copying pixels.
+//
+// The array borrows the Mat's buffer and holds a heap copy of the Mat
+// header in a capsule.  For frames from VideoCapture::read() that header
+// keeps the DevFrame alive, so the device buffer goes back to the driver
+// when Python garbage-collects the array.  The driver has only a few
+// buffers: scripts that keep frames around should keep a .copy().
+
+py::dtype dtype_from_depth(int depth) {
+  switch (depth) {
+    case CV_8U:  return py::dtype::of<uint8_t>();
+    case CV_8S:  return py::dtype::of<int8_t>();
+    case CV_16U: return py::dtype::of<uint16_t>();
+    case CV_16S: return py::dtype::of<int16_t>();
+    case CV_32S: return py::dtype::of<int32_t>();
+    case CV_32F: return py::dtype::of<float>();
+    case CV_64F: return py::dtype::of<double>();
+    default: break;
   }
+  throw invalid_value_exception("unsupported cv::Mat depth");
+}
 
-  bool allocate(UMatData* u, AccessFlag accessFlags, UMatUsageFlags usageFlags) const CV_OVERRIDE {
-    return stdAllocator->allocate(u, accessFlags, usageFlags);
+py::object mat_to_numpy(cv::Mat&& mat) {
+  if (!mat.data) return py::none();
+  cv::Mat* holder = new cv::Mat(std::move(mat));
+  py::capsule base(holder, [](void* p) { delete static_cast<cv::Mat*>(p); });
+  std::vector<py::ssize_t> shape;
+  std::vector<py::ssize_t> strides;
+  for (int j = 0; j < holder->dims; ++j) {
+    shape.push_back(holder->size[j]);
+    strides.push_back((py::ssize_t)holder->step[j]);
   }
-
-  void deallocate(UMatData* u) const CV_OVERRIDE {
-    if (!u)
-      return;
-    PyEnsureGIL gil;
-    assert(u->urefcount >= 0);
-    assert(u->refcount >= 0);
-    if (u->refcount == 0) {
-      PyObject* o = (PyObject*)u->userdata;
-      Py_XDECREF(o);
-      delete u;
-    }
+  if (holder->channels() > 1) {
+    shape.push_back(holder->channels());
+    strides.push_back((py::ssize_t)holder->elemSize1());
   }
-
-  const MatAllocator* stdAllocator;
-};
-
-MyNumpyAllocator pybackend_numpy_alloc;
-
-PyObject* pyopencv_from_mat(const Mat& m) {
-  if (!m.data)
-    Py_RETURN_NONE;
-  Mat *p = (Mat*)&m;
-  Mat temp;
-  if (!p->u || (p->allocator != &pybackend_numpy_alloc)) {
-    temp.allocator = &pybackend_numpy_alloc;
-    m.copyTo(temp);
-    p = &temp;
-  }
-  PyObject* o = (PyObject*)p->u->userdata;
-  Py_INCREF(o);
-  return o;
-}
-
-PyObject* pyopencv_from_bool(bool value) {
-  return PyBool_FromLong(value);
+  return py::array(dtype_from_depth(holder->depth()), shape, strides, holder->data, base);
 }
 
 } // anon
@@ -170,11 +104,6 @@ PyObject* pyopencv_from_bool(bool value) {
 PYBIND11_MAKE_OPAQUE(std::vector<uint8_t>)
 
 PYBIND11_MODULE(NAME, m) {
-    if (_import_array() < 0) {
-      fprintf(stderr, "FATAL: numpy.core.multiarray import fail");
-      exit(1);
-    }
-
 #if 0
     py::enum_<librealuvc::usb_spec>(m, "USB_TYPE")
         .value("USB1", librealuvc::usb_spec::usb1_type)
@@ -486,6 +415,28 @@ PYBIND11_MODULE(NAME, m) {
         .def("query_hid_devices", &librealuvc::backend::query_hid_devices)
         .def("create_time_service", &librealuvc::backend::create_time_service);
     
+    py::class_<librealuvc::Blob> blob(m, "Blob");
+    blob.def_readonly("x", &librealuvc::Blob::x)
+        .def_readonly("y", &librealuvc::Blob::y)
+        .def_readonly("area", &librealuvc::Blob::area)
+        .def_readonly("mass", &librealuvc::Blob::mass)
+        .def_readonly("peak", &librealuvc::Blob::peak);
+
+    py::class_<librealuvc::BlobSettings> blob_settings(m, "BlobSettings");
+    blob_settings.def(py::init<>())
+        .def_readwrite("threshold", &librealuvc::BlobSettings::threshold)
+        .def_readwrite("min_area", &librealuvc::BlobSettings::min_area)
+        .def_readwrite("max_blobs", &librealuvc::BlobSettings::max_blobs);
+
+    py::class_<librealuvc::AutoExposureSettings> auto_exposure_settings(m, "AutoExposureSettings");
+    auto_exposure_settings.def(py::init<>())
+        .def_readwrite("target", &librealuvc::AutoExposureSettings::target)
+        .def_readwrite("percentile", &librealuvc::AutoExposureSettings::percentile)
+        .def_readwrite("tolerance", &librealuvc::AutoExposureSettings::tolerance)
+        .def_readwrite("max_ratio", &librealuvc::AutoExposureSettings::max_ratio)
+        .def_readwrite("min_interval", &librealuvc::AutoExposureSettings::min_interval)
+        .def_readwrite("subsample", &librealuvc::AutoExposureSettings::subsample);
+
     py::class_<librealuvc::VideoCapture, std::shared_ptr<librealuvc::VideoCapture>> vidcap(m, "VideoCapture");
     vidcap
       .def(py::init<>())
@@ -497,18 +448,42 @@ PYBIND11_MODULE(NAME, m) {
       .def("isOpened", &librealuvc::VideoCapture::isOpened)
       .def("read",
         [](librealuvc::VideoCapture& this_ref) {
-          auto& image = this_ref.get_reusable_image();
-          //cv::Mat image;
-          bool ok = this_ref.read(image);
-          PyObject* image_obj = pyopencv_from_mat(image);
-          auto tuple = Py_BuildValue("(NN)", pyopencv_from_bool(ok), image_obj);
-          auto result = py::reinterpret_steal<py::object>(tuple);
-          return result;
+          // Each frame gets its own Mat so that arrays from earlier reads
+          // stay valid; waiting for the frame doesn't hold the GIL.
+          cv::Mat image;
+          bool ok = false;
+          {
+            py::gil_scoped_release release;
+            ok = this_ref.read(image);
+          }
+          return py::make_tuple(ok, mat_to_numpy(std::move(image)));
         }
       )
+      .def("read_blobs",
+        [](librealuvc::VideoCapture& this_ref, const librealuvc::BlobSettings& settings) {
+          // Only the blob lists cross into Python, not the frame
+          librealuvc::StereoBlobs blobs;
+          blobs.settings = settings;
+          bool ok = false;
+          {
+            py::gil_scoped_release release;
+            ok = this_ref.read_blobs(blobs);
+          }
+          return py::make_tuple(ok, blobs.eye[0], blobs.eye[1]);
+        }, "settings"_a = librealuvc::BlobSettings()
+      )
+      .def("get_frame_timestamp_ns", &librealuvc::VideoCapture::get_frame_timestamp_ns)
       .def("release",  &librealuvc::VideoCapture::release)
       // .def("retrieve", &librealuvc::VideoCapture::retrieve, "image"_a, "flag"_a)
       .def("set",      &librealuvc::VideoCapture::set, "propId"_a, "value"_a)
+      .def("set_at_frame",
+        [](librealuvc::VideoCapture& this_ref, const librealuvc::VideoCapture::PropertyChanges& changes) {
+          return this_ref.set_at_frame(changes);
+        }, "changes"_a)
+      .def("get_frame_settings_id", &librealuvc::VideoCapture::get_frame_settings_id)
+      .def("get_control_queue_depth", &librealuvc::VideoCapture::get_control_queue_depth)
+      .def("set_auto_exposure_settings", &librealuvc::VideoCapture::set_auto_exposure_settings, "settings"_a)
+      .def("get_auto_exposure_settings", &librealuvc::VideoCapture::get_auto_exposure_settings)
       .def("is_extended",    &librealuvc::VideoCapture::is_extended)
       .def("get_vendor_id",  &librealuvc::VideoCapture::get_vendor_id)
       .def("get_product_id", &librealuvc::VideoCapture::get_product_id);